@@ -1,6 +1,8 @@
 #include "common.hh"
 #include "buffer_util.hh"
 
+#include <immintrin.h>
+
 static const u64 blake2b_iv[8] = {
 	0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL,
 	0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
@@ -8,7 +10,7 @@ static const u64 blake2b_iv[8] = {
 	0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
 };
 
-static const u8 blake2b_sigma[12][16] = {
+static constexpr u8 blake2b_sigma[12][16] = {
 	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
 	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
 	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
@@ -102,7 +104,7 @@ void blake2b_set_lastblock(blake2b_state *S){
 	}while(0)
 
 static
-void blake2b_compress(blake2b_state *S, u8 *block){
+void blake2b_compress_scalar(blake2b_state *S, u8 *block){
 	u64 m[16];
 	u64 v[16];
 
@@ -132,6 +134,79 @@ void blake2b_compress(blake2b_state *S, u8 *block){
 #undef G
 #undef ROUND
 
+// NOTE: This is the usual single message AVX2 layout where each row of
+// the state matrix lives in a register. Columns are processed directly
+// and diagonals are processed after rotating rows b, c and d.
+#define AVX2_ROTR32(x)	_mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define AVX2_ROTR24(x)	_mm256_shuffle_epi8(x, rotr24)
+#define AVX2_ROTR16(x)	_mm256_shuffle_epi8(x, rotr16)
+#define AVX2_ROTR63(x)	_mm256_xor_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x))
+
+#define AVX2_G(a, b, c, d, m0, m1)						\
+	do{													\
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), m0);	\
+		d = AVX2_ROTR32(_mm256_xor_si256(d, a));			\
+		c = _mm256_add_epi64(c, d);							\
+		b = AVX2_ROTR24(_mm256_xor_si256(b, c));			\
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), m1);	\
+		d = AVX2_ROTR16(_mm256_xor_si256(d, a));			\
+		c = _mm256_add_epi64(c, d);							\
+		b = AVX2_ROTR63(_mm256_xor_si256(b, c));			\
+	}while(0)
+
+static TARGET_AVX2
+void blake2b_compress_avx2(blake2b_state *S, u8 *block){
+	const __m256i rotr24 = _mm256_setr_epi8(
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i rotr16 = _mm256_setr_epi8(
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+
+	i64 m[16];
+	for(i32 i = 0; i < 16; i += 1)
+		m[i] = (i64)decode_u64_le(block + i * 8);
+
+	__m256i h0 = _mm256_loadu_si256((__m256i*)&S->h[0]);
+	__m256i h1 = _mm256_loadu_si256((__m256i*)&S->h[4]);
+	__m256i a = h0;
+	__m256i b = h1;
+	__m256i c = _mm256_loadu_si256((__m256i*)&blake2b_iv[0]);
+	__m256i d = _mm256_xor_si256(
+		_mm256_loadu_si256((__m256i*)&blake2b_iv[4]),
+		_mm256_setr_epi64x((i64)S->t[0], (i64)S->t[1], (i64)S->f[0], (i64)S->f[1]));
+
+	for(i32 r = 0; r < 12; r += 1){
+		const u8 *s = blake2b_sigma[r];
+
+		// columns
+		AVX2_G(a, b, c, d,
+			_mm256_setr_epi64x(m[s[0]], m[s[2]], m[s[4]], m[s[6]]),
+			_mm256_setr_epi64x(m[s[1]], m[s[3]], m[s[5]], m[s[7]]));
+
+		// diagonals
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));
+		AVX2_G(a, b, c, d,
+			_mm256_setr_epi64x(m[s[ 8]], m[s[10]], m[s[12]], m[s[14]]),
+			_mm256_setr_epi64x(m[s[ 9]], m[s[11]], m[s[13]], m[s[15]]));
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1));
+	}
+
+	h0 = _mm256_xor_si256(h0, _mm256_xor_si256(a, c));
+	h1 = _mm256_xor_si256(h1, _mm256_xor_si256(b, d));
+	_mm256_storeu_si256((__m256i*)&S->h[0], h0);
+	_mm256_storeu_si256((__m256i*)&S->h[4], h1);
+}
+
+#undef AVX2_G
+
+// NOTE: Bound by blake2b_dispatch_init.
+static void (*blake2b_compress)(blake2b_state *S, u8 *block) = blake2b_compress_scalar;
+
 void blake2b_update(blake2b_state *S, u8 *in, u64 inlen){
 	if(inlen == 0)
 		return;
@@ -178,3 +253,418 @@ void blake2b_final(blake2b_state *S, u8 *out, u64 outlen){
 		encode_u64_le(tmp + i * 8, S->h[i]);
 	memcpy(out, tmp, S->outlen);
 }
+
+// ----------------------------------------------------------------
+// equihash final block
+// ----------------------------------------------------------------
+
+// NOTE: The final block of every equihash blake is the 12 bytes tail of
+// the 140 bytes header, followed by the 4 bytes generator and zeros. Only
+// message words 0 and 1 are non-zero so EH_MSG below adds them when the
+// (constant) sigma entry picks one of them and adds nothing otherwise.
+// Since `r` and `k` are always literals, the checks are resolved at compile
+// time and the zero words vanish from every kernel.
+
+void blake2b_eh_midstate_init(blake2b_eh_midstate *M, blake2b_state *S){
+	ASSERT(S->buflen == 12);
+	ASSERT(!blake2b_is_lastblock(S));
+
+	u8 block[16] = {};
+	memcpy(block, S->buf, 12);
+	for(i32 i = 0; i < 8; i += 1)
+		M->h[i] = S->h[i];
+	M->m0 = decode_u64_le(block + 0);
+	M->m1 = decode_u64_le(block + 8);
+	M->t[0] = S->t[0] + 16;
+	M->t[1] = S->t[1] + (M->t[0] < 16);
+	M->outlen = S->outlen;
+}
+
+#define EH_MSG(ADD, r, k, a)						\
+	do{												\
+		if(blake2b_sigma[r][k] == 0)				\
+			a = ADD(a, m0);							\
+		else if(blake2b_sigma[r][k] == 1)			\
+			a = ADD(a, m1);							\
+	}while(0)
+
+#define EH_G(ADD, XOR, ROTR32, ROTR24, ROTR16, ROTR63, r, i, a, b, c, d)	\
+	do{																		\
+		a = ADD(a, b);														\
+		EH_MSG(ADD, r, 2 * i + 0, a);										\
+		d = ROTR32(XOR(d, a));												\
+		c = ADD(c, d);														\
+		b = ROTR24(XOR(b, c));												\
+		a = ADD(a, b);														\
+		EH_MSG(ADD, r, 2 * i + 1, a);										\
+		d = ROTR16(XOR(d, a));												\
+		c = ADD(c, d);														\
+		b = ROTR63(XOR(b, c));												\
+	}while(0)
+
+#define EH_ROUND(G, r)								\
+	do{												\
+		G(r, 0, v[0], v[4], v[8], v[12]);			\
+		G(r, 1, v[1], v[5], v[9], v[13]);			\
+		G(r, 2, v[2], v[6], v[10], v[14]);			\
+		G(r, 3, v[3], v[7], v[11], v[15]);			\
+		G(r, 4, v[0], v[5], v[10], v[15]);			\
+		G(r, 5, v[1], v[6], v[11], v[12]);			\
+		G(r, 6, v[2], v[7], v[8], v[13]);			\
+		G(r, 7, v[3], v[4], v[9], v[14]);			\
+	}while(0)
+
+#define EH_ALL_ROUNDS(G)										\
+	do{															\
+		EH_ROUND(G,  0); EH_ROUND(G,  1); EH_ROUND(G,  2);		\
+		EH_ROUND(G,  3); EH_ROUND(G,  4); EH_ROUND(G,  5);		\
+		EH_ROUND(G,  6); EH_ROUND(G,  7); EH_ROUND(G,  8);		\
+		EH_ROUND(G,  9); EH_ROUND(G, 10); EH_ROUND(G, 11);		\
+	}while(0)
+
+static
+void blake2b_eh_output(blake2b_eh_midstate *M, u64 (*h)[BLAKE2B_MAX_LANES],
+		i32 num_lanes, u8 *out){
+	for(i32 lane = 0; lane < num_lanes; lane += 1){
+		u8 tmp[BLAKE2B_OUTBYTES];
+		for(i32 i = 0; i < 8; i += 1)
+			encode_u64_le(tmp + i * 8, h[i][lane]);
+		memcpy(out + lane * M->outlen, tmp, M->outlen);
+	}
+}
+
+// scalar (1 lane)
+#define X1_ADD(a, b)	((a) + (b))
+#define X1_XOR(a, b)	((a) ^ (b))
+#define X1_ROTR32(x)	rotr64(x, 32)
+#define X1_ROTR24(x)	rotr64(x, 24)
+#define X1_ROTR16(x)	rotr64(x, 16)
+#define X1_ROTR63(x)	rotr64(x, 63)
+#define X1_G(r, i, a, b, c, d)											\
+	EH_G(X1_ADD, X1_XOR, X1_ROTR32, X1_ROTR24, X1_ROTR16, X1_ROTR63,	\
+		r, i, a, b, c, d)
+
+void blake2b_eh_generate(blake2b_eh_midstate *M, u32 generator, u8 *out){
+	u64 m0 = M->m0;
+	u64 m1 = M->m1 | ((u64)generator << 32);
+
+	u64 v[16];
+	for(i32 i = 0; i < 8; i += 1)
+		v[i] = M->h[i];
+	v[ 8] = blake2b_iv[0];
+	v[ 9] = blake2b_iv[1];
+	v[10] = blake2b_iv[2];
+	v[11] = blake2b_iv[3];
+	v[12] = blake2b_iv[4] ^ M->t[0];
+	v[13] = blake2b_iv[5] ^ M->t[1];
+	v[14] = ~blake2b_iv[6];
+	v[15] = blake2b_iv[7];
+
+	EH_ALL_ROUNDS(X1_G);
+
+	u8 tmp[BLAKE2B_OUTBYTES];
+	for(i32 i = 0; i < 8; i += 1)
+		encode_u64_le(tmp + i * 8, M->h[i] ^ v[i] ^ v[i + 8]);
+	memcpy(out, tmp, M->outlen);
+}
+
+// AVX2 (4 lanes)
+#define X4_ADD(a, b)	_mm256_add_epi64(a, b)
+#define X4_XOR(a, b)	_mm256_xor_si256(a, b)
+#define X4_ROTR32(x)	_mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define X4_ROTR24(x)	_mm256_shuffle_epi8(x, rotr24)
+#define X4_ROTR16(x)	_mm256_shuffle_epi8(x, rotr16)
+#define X4_ROTR63(x)	X4_XOR(_mm256_srli_epi64(x, 63), X4_ADD(x, x))
+#define X4_G(r, i, a, b, c, d)											\
+	EH_G(X4_ADD, X4_XOR, X4_ROTR32, X4_ROTR24, X4_ROTR16, X4_ROTR63,	\
+		r, i, a, b, c, d)
+
+static TARGET_AVX2
+void blake2b_eh_generate_x4(blake2b_eh_midstate *M, u32 generator, i32 num_lanes, u8 *out){
+	DEBUG_ASSERT(num_lanes > 0 && num_lanes <= 4);
+
+	const __m256i rotr24 = _mm256_setr_epi8(
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i rotr16 = _mm256_setr_epi8(
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+
+	__m256i generators = _mm256_add_epi64(
+		_mm256_set1_epi64x((i64)generator),
+		_mm256_setr_epi64x(0, 1, 2, 3));
+	__m256i m0 = _mm256_set1_epi64x((i64)M->m0);
+	__m256i m1 = _mm256_or_si256(_mm256_set1_epi64x((i64)M->m1),
+		_mm256_slli_epi64(generators, 32));
+
+	__m256i v[16];
+	for(i32 i = 0; i < 8; i += 1)
+		v[i] = _mm256_set1_epi64x((i64)M->h[i]);
+	v[ 8] = _mm256_set1_epi64x((i64)blake2b_iv[0]);
+	v[ 9] = _mm256_set1_epi64x((i64)blake2b_iv[1]);
+	v[10] = _mm256_set1_epi64x((i64)blake2b_iv[2]);
+	v[11] = _mm256_set1_epi64x((i64)blake2b_iv[3]);
+	v[12] = _mm256_set1_epi64x((i64)(blake2b_iv[4] ^ M->t[0]));
+	v[13] = _mm256_set1_epi64x((i64)(blake2b_iv[5] ^ M->t[1]));
+	v[14] = _mm256_set1_epi64x((i64)~blake2b_iv[6]);
+	v[15] = _mm256_set1_epi64x((i64)blake2b_iv[7]);
+
+	EH_ALL_ROUNDS(X4_G);
+
+	u64 h[8][BLAKE2B_MAX_LANES];
+	for(i32 i = 0; i < 8; i += 1){
+		__m256i hi = _mm256_set1_epi64x((i64)M->h[i]);
+		hi = X4_XOR(hi, X4_XOR(v[i], v[i + 8]));
+		_mm256_storeu_si256((__m256i*)h[i], hi);
+	}
+	blake2b_eh_output(M, h, num_lanes, out);
+}
+
+// AVX-512 (8 lanes)
+#define X8_ADD(a, b)	_mm512_add_epi64(a, b)
+#define X8_XOR(a, b)	_mm512_xor_si512(a, b)
+#define X8_ROTR32(x)	_mm512_ror_epi64(x, 32)
+#define X8_ROTR24(x)	_mm512_ror_epi64(x, 24)
+#define X8_ROTR16(x)	_mm512_ror_epi64(x, 16)
+#define X8_ROTR63(x)	_mm512_ror_epi64(x, 63)
+#define X8_G(r, i, a, b, c, d)											\
+	EH_G(X8_ADD, X8_XOR, X8_ROTR32, X8_ROTR24, X8_ROTR16, X8_ROTR63,	\
+		r, i, a, b, c, d)
+
+static TARGET_AVX512
+void blake2b_eh_generate_x8(blake2b_eh_midstate *M, u32 generator, i32 num_lanes, u8 *out){
+	DEBUG_ASSERT(num_lanes > 0 && num_lanes <= 8);
+
+	__m512i generators = _mm512_add_epi64(
+		_mm512_set1_epi64((i64)generator),
+		_mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7));
+	__m512i m0 = _mm512_set1_epi64((i64)M->m0);
+	__m512i m1 = _mm512_or_si512(_mm512_set1_epi64((i64)M->m1),
+		_mm512_slli_epi64(generators, 32));
+
+	__m512i v[16];
+	for(i32 i = 0; i < 8; i += 1)
+		v[i] = _mm512_set1_epi64((i64)M->h[i]);
+	v[ 8] = _mm512_set1_epi64((i64)blake2b_iv[0]);
+	v[ 9] = _mm512_set1_epi64((i64)blake2b_iv[1]);
+	v[10] = _mm512_set1_epi64((i64)blake2b_iv[2]);
+	v[11] = _mm512_set1_epi64((i64)blake2b_iv[3]);
+	v[12] = _mm512_set1_epi64((i64)(blake2b_iv[4] ^ M->t[0]));
+	v[13] = _mm512_set1_epi64((i64)(blake2b_iv[5] ^ M->t[1]));
+	v[14] = _mm512_set1_epi64((i64)~blake2b_iv[6]);
+	v[15] = _mm512_set1_epi64((i64)blake2b_iv[7]);
+
+	EH_ALL_ROUNDS(X8_G);
+
+	u64 h[8][BLAKE2B_MAX_LANES];
+	for(i32 i = 0; i < 8; i += 1){
+		__m512i hi = _mm512_set1_epi64((i64)M->h[i]);
+		hi = X8_XOR(hi, X8_XOR(v[i], v[i + 8]));
+		_mm512_storeu_si512((void*)h[i], hi);
+	}
+	blake2b_eh_output(M, h, num_lanes, out);
+}
+
+static
+void blake2b_eh_generate_x1(blake2b_eh_midstate *M, u32 generator, i32 num_lanes, u8 *out){
+	for(i32 lane = 0; lane < num_lanes; lane += 1)
+		blake2b_eh_generate(M, generator + (u32)lane, out + lane * M->outlen);
+}
+
+// NOTE: Bound by blake2b_dispatch_init.
+typedef void (*blake2b_eh_lanes_fn)(blake2b_eh_midstate *M,
+		u32 generator, i32 num_lanes, u8 *out);
+static i32 blake2b_eh_lanes_width = 1;
+static blake2b_eh_lanes_fn blake2b_eh_lanes_kernel = blake2b_eh_generate_x1;
+
+void blake2b_eh_generate_lanes(blake2b_eh_midstate *M, u32 generator, i32 num_lanes, u8 *out){
+	DEBUG_ASSERT(num_lanes > 0 && num_lanes <= BLAKE2B_MAX_LANES);
+	// NOTE: A single leftover lane is faster on the scalar kernel.
+	i32 width = blake2b_eh_lanes_width;
+	while(num_lanes > 1){
+		i32 n = (num_lanes < width) ? num_lanes : width;
+		blake2b_eh_lanes_kernel(M, generator, n, out);
+		generator += (u32)n;
+		num_lanes -= n;
+		out += n * M->outlen;
+	}
+	if(num_lanes == 1)
+		blake2b_eh_generate(M, generator, out);
+}
+
+// ----------------------------------------------------------------
+// dispatch
+// ----------------------------------------------------------------
+
+// NOTE: Implementations are listed from best to worst. The scalar
+// implementations must always come last since they're supported
+// everywhere and are used as the fallback.
+struct blake2b_compress_impl{
+	const char *name;
+	bool (*supported)(const CPU_Features *cpu);
+	void (*compress)(blake2b_state *S, u8 *block);
+};
+
+struct blake2b_eh_lanes_impl{
+	const char *name;
+	bool (*supported)(const CPU_Features *cpu);
+	i32 width;
+	blake2b_eh_lanes_fn generate;
+};
+
+static bool blake2b__any(const CPU_Features *cpu){ return true; }
+static bool blake2b__avx2(const CPU_Features *cpu){ return cpu->avx2; }
+static bool blake2b__avx512(const CPU_Features *cpu){ return cpu->avx512f; }
+
+static const blake2b_compress_impl blake2b_compress_impls[] = {
+	{ "avx2", blake2b__avx2, blake2b_compress_avx2 },
+	{ "scalar", blake2b__any, blake2b_compress_scalar },
+};
+
+static const blake2b_eh_lanes_impl blake2b_eh_lanes_impls[] = {
+	{ "avx512", blake2b__avx512, 8, blake2b_eh_generate_x8 },
+	{ "avx2", blake2b__avx2, 4, blake2b_eh_generate_x4 },
+	{ "scalar", blake2b__any, 1, blake2b_eh_generate_x1 },
+};
+
+// NOTE: Known answers from test/blake2b_test.py. The header is from
+// block 818128 and the second answer is for the blake generated with
+// generator = 5259811 (which is the same as the equihash index 15779433
+// divided by EH_HASHES_PER_BLAKE).
+static u8 blake2b_kat_header[140] = {
+	0x04, 0x00, 0x00, 0x00, 0xE8, 0xB9, 0x46, 0x3A, 0xB4, 0x74, 0x20, 0x9C, 0x91, 0xD9, 0x39, 0x05,
+	0x1B, 0x73, 0xA4, 0x8C, 0x66, 0xA4, 0x0A, 0x13, 0xA8, 0x4B, 0x61, 0x80, 0x5F, 0x41, 0x3E, 0x75,
+	0x7B, 0x00, 0x00, 0x00, 0xEC, 0x79, 0x39, 0xC4, 0x27, 0x09, 0xBC, 0x10, 0x10, 0x90, 0x62, 0x46,
+	0x4B, 0x00, 0x35, 0xC2, 0xA8, 0x24, 0xC1, 0xA3, 0x30, 0x38, 0x40, 0x5C, 0x53, 0x55, 0x20, 0x9E,
+	0xB4, 0x98, 0x21, 0x6B, 0xB5, 0x79, 0x4E, 0xF0, 0x52, 0x6D, 0x8C, 0x3B, 0xC6, 0x59, 0x65, 0xE9,
+	0xF1, 0xEA, 0x6A, 0xB2, 0xCC, 0xC7, 0x16, 0x93, 0x05, 0xC7, 0x0E, 0xB9, 0xF3, 0x43, 0x66, 0xB2,
+	0xCE, 0xF3, 0x9D, 0x18, 0xCA, 0x75, 0x46, 0x61, 0xB8, 0x9C, 0x00, 0x1E, 0xDE, 0xFA, 0xCE, 0x03,
+	0x10, 0xDF, 0xB8, 0x52, 0x29, 0x01, 0x68, 0x9E, 0xDD, 0xA0, 0x65, 0xDD, 0x58, 0xF5, 0xCD, 0x6D,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xC2, 0x01, 0xB6, 0x81,
+};
+
+static const u8 blake2b_kat_expected1[54] = {
+	0x66, 0x73, 0xFA, 0xF3, 0x65, 0x27, 0x3E, 0xB1, 0x93, 0xD0, 0x09, 0xE6, 0xEB, 0xFB, 0xF2, 0x4F,
+	0x7A, 0x88, 0x98, 0xB9, 0xE4, 0xE6, 0x53, 0x72, 0x28, 0x2F, 0x1B, 0x67, 0x3C, 0x64, 0xBA, 0x58,
+	0xBA, 0xBE, 0xA9, 0x0B, 0xCC, 0x24, 0xCE, 0xD3, 0x9B, 0x61, 0x4B, 0x9D, 0x5B, 0xCC, 0xDC, 0xFF,
+	0x5D, 0x91, 0x02, 0x03, 0x37, 0x3C,
+};
+
+static const u32 blake2b_kat_generator2 = 5259811;
+static const u8 blake2b_kat_expected2[54] = {
+	0xA0, 0x2B, 0xA4, 0x88, 0xC6, 0x9F, 0xFE, 0xB7, 0x02, 0x2D, 0x44, 0x1D, 0x4C, 0x8F, 0x07, 0x5A,
+	0xC1, 0x97, 0xF3, 0x3B, 0x4E, 0x29, 0x4E, 0x0B, 0xAB, 0x4E, 0x50, 0x99, 0x03, 0x68, 0xF0, 0x47,
+	0x45, 0x23, 0xD2, 0x24, 0x8C, 0x21, 0x61, 0xFA, 0xCD, 0x6B, 0xF2, 0x8F, 0xC8, 0x59, 0x7B, 0xC3,
+	0x10, 0xD1, 0xBB, 0x2B, 0x38, 0x2D,
+};
+
+static
+bool blake2b_kat_compress(const blake2b_compress_impl *impl){
+	void (*prev_compress)(blake2b_state*, u8*) = blake2b_compress;
+	blake2b_compress = impl->compress;
+
+	u8 out[BLAKE2B_OUTBYTES];
+	blake2b_state S;
+	blake2b_init_eh(&S, "BitcoinZ", 144, 5);
+	blake2b_update(&S, blake2b_kat_header, sizeof(blake2b_kat_header));
+
+	blake2b_state tmp = S;
+	blake2b_final(&tmp, out, tmp.outlen);
+	bool result = memcmp(out, blake2b_kat_expected1, 54) == 0;
+
+	u32 le_generator = u32_cpu_to_le(blake2b_kat_generator2);
+	tmp = S;
+	blake2b_update(&tmp, (u8*)&le_generator, 4);
+	blake2b_final(&tmp, out, tmp.outlen);
+	result = result && memcmp(out, blake2b_kat_expected2, 54) == 0;
+
+	blake2b_compress = prev_compress;
+	return result;
+}
+
+static
+bool blake2b_kat_eh_lanes(const blake2b_eh_lanes_impl *impl){
+	// NOTE: Use the scalar compress to build the midstate so we
+	// only test the lanes implementation here.
+	void (*prev_compress)(blake2b_state*, u8*) = blake2b_compress;
+	blake2b_compress = blake2b_compress_scalar;
+	blake2b_state S;
+	blake2b_init_eh(&S, "BitcoinZ", 144, 5);
+	blake2b_update(&S, blake2b_kat_header, sizeof(blake2b_kat_header));
+	blake2b_compress = prev_compress;
+
+	blake2b_eh_midstate M;
+	blake2b_eh_midstate_init(&M, &S);
+
+	// NOTE: Check the known answer on every lane and with every
+	// number of active lanes.
+	bool result = true;
+	for(i32 num_lanes = 1; num_lanes <= impl->width; num_lanes += 1){
+		for(i32 lane = 0; lane < num_lanes; lane += 1){
+			u8 out[BLAKE2B_MAX_LANES * BLAKE2B_OUTBYTES];
+			impl->generate(&M, blake2b_kat_generator2 - lane, num_lanes, out);
+			if(memcmp(out + lane * M.outlen, blake2b_kat_expected2, 54) != 0)
+				result = false;
+		}
+	}
+	return result;
+}
+
+void blake2b_dispatch_init(void){
+	const CPU_Features *cpu = cpu_features();
+
+	for(i32 i = 0; i < NARRAY(blake2b_compress_impls); i += 1){
+		const blake2b_compress_impl *impl = &blake2b_compress_impls[i];
+		if(!impl->supported(cpu))
+			continue;
+		if(!blake2b_kat_compress(impl)){
+			LOG_ERROR("blake2b_compress (%s) failed known answer test\n", impl->name);
+			continue;
+		}
+		LOG("blake2b_compress: %s\n", impl->name);
+		blake2b_compress = impl->compress;
+		break;
+	}
+
+	for(i32 i = 0; i < NARRAY(blake2b_eh_lanes_impls); i += 1){
+		const blake2b_eh_lanes_impl *impl = &blake2b_eh_lanes_impls[i];
+		if(!impl->supported(cpu))
+			continue;
+		if(!blake2b_kat_eh_lanes(impl)){
+			LOG_ERROR("blake2b_eh_generate_lanes (%s) failed known answer test\n", impl->name);
+			continue;
+		}
+		LOG("blake2b_eh_generate_lanes: %s (%d lanes)\n", impl->name, impl->width);
+		blake2b_eh_lanes_width = impl->width;
+		blake2b_eh_lanes_kernel = impl->generate;
+		break;
+	}
+}
+
+bool blake2b_selftest(void){
+	const CPU_Features *cpu = cpu_features();
+	bool result = true;
+
+	for(i32 i = 0; i < NARRAY(blake2b_compress_impls); i += 1){
+		const blake2b_compress_impl *impl = &blake2b_compress_impls[i];
+		if(!impl->supported(cpu)){
+			LOG("blake2b_compress (%s): not supported\n", impl->name);
+			continue;
+		}
+		bool passed = blake2b_kat_compress(impl);
+		LOG("blake2b_compress (%s): %s\n", impl->name, passed ? "passed" : "failed");
+		result = result && passed;
+	}
+
+	for(i32 i = 0; i < NARRAY(blake2b_eh_lanes_impls); i += 1){
+		const blake2b_eh_lanes_impl *impl = &blake2b_eh_lanes_impls[i];
+		if(!impl->supported(cpu)){
+			LOG("blake2b_eh_generate_lanes (%s): not supported\n", impl->name);
+			continue;
+		}
+		bool passed = blake2b_kat_eh_lanes(impl);
+		LOG("blake2b_eh_generate_lanes (%s): %s\n", impl->name, passed ? "passed" : "failed");
+		result = result && passed;
+	}
+	return result;
+}
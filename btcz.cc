@@ -1,5 +1,7 @@
 #include "common.hh"
 #include "buffer_util.hh"
+#include "memory.hh"
+#include "thread.hh"
 
 struct BlockHeader{
 	i32 version;
@@ -28,11 +30,9 @@ void serialize_eh_solution(u8 *buffer, EH_Solution solution){
 }
 
 static
-bool btcz_check_block(BlockHeader *header){
+void btcz_serialize_block_header(u8 *buf, BlockHeader *header){
 	static_assert(sizeof(BlockHeader) == 240, "");
 	static_assert(sizeof(EH_Solution) == 100, "");
-
-	u8 buf[241];
 	serialize_u32(buf + 0x00, header->version);
 	serialize_u256(buf + 0x04, header->hash_prev_block);
 	serialize_u256(buf + 0x24, header->hash_merkle_root);
@@ -46,6 +46,12 @@ bool btcz_check_block(BlockHeader *header){
 	// is always 100 so this byte is essentially wasted.
 	encode_u8(buf + 0x8C, 0x64);
 	serialize_eh_solution(buf + 0x8D, header->solution);
+}
+
+static
+bool btcz_check_block(BlockHeader *header){
+	u8 buf[241];
+	btcz_serialize_block_header(buf, header);
 
 	print_buf("eh header", buf, 140);
 	print_buf("full header", buf, 241);
@@ -75,9 +81,20 @@ bool btcz_check_block(BlockHeader *header){
 	return true;
 }
 
+// NOTE: Per job pow context. The first 64 bytes block of the header
+// (version, prev_hash and most of merkle_root) is the same for the whole
+// job so its sha256 midstate is computed once when the mining params
+// change and each check only hashes the remaining 177 bytes, of which
+// only the nonce and solution change between checks.
+#define BTCZ_POW_TAIL_BYTES (241 - 64)
+struct BTCZ_PowContext{
+	sha256_midstate midstate;
+	u8 tail[BTCZ_POW_TAIL_BYTES];
+	u256 target;
+};
+
 static
-bool btcz_check_pow_target(MiningParams *params,
-		u256 nonce, EH_Solution solution){
+void btcz_pow_context_init(BTCZ_PowContext *ctx, MiningParams *params){
 	static_assert(sizeof(EH_Solution) == 100, "");
 	u8 buf[241];
 	serialize_u32(buf + 0x00, params->version);
@@ -86,16 +103,43 @@ bool btcz_check_pow_target(MiningParams *params,
 	serialize_u256(buf + 0x44, params->final_sapling_root);
 	serialize_u32(buf + 0x64, params->time);
 	serialize_u32(buf + 0x68, params->bits);
-	serialize_u256(buf + 0x6C, nonce);
+	memset(buf + 0x6C, 0, 32);
 
 	// NOTE: This byte is because the solution is preceeded by
 	// it's length in a "compact" form. In the case of BTCZ, it
 	// is always 100 so this byte is essentially wasted.
 	encode_u8(buf + 0x8C, 0x64);
-	serialize_eh_solution(buf + 0x8D, solution);
+	memset(buf + 0x8D, 0, EH_PACKED_SOLUTION_BYTES);
 
-	u256 wsha256_result = wsha256(buf, 241);
-	return !(wsha256_result > params->target);
+	sha256_midstate_init(&ctx->midstate, buf, 64);
+	memcpy(ctx->tail, buf + 64, BTCZ_POW_TAIL_BYTES);
+	ctx->target = params->target;
+}
+
+// NOTE: Checks the solutions of a single solve against the pow target
+// at once, writing whether each one is at or below the target to
+// `result`. All headers hash in the same wsha256_many batch.
+static
+void btcz_pow_check(BTCZ_PowContext *ctx, u256 nonce,
+		EH_Solution *sols, i32 num_sols, bool *result){
+	u8 bufs[8][BTCZ_POW_TAIL_BYTES];
+	u8 *in[8];
+	u256 wsha256_results[8];
+	for(i32 start = 0; start < num_sols; start += 8){
+		i32 count = (num_sols - start < 8) ? (num_sols - start) : 8;
+		for(i32 i = 0; i < count; i += 1){
+			memcpy(bufs[i], ctx->tail, 0x6C - 64);
+			serialize_u256(bufs[i] + 0x6C - 64, nonce);
+			encode_u8(bufs[i] + 0x8C - 64, 0x64);
+			serialize_eh_solution(bufs[i] + 0x8D - 64, sols[start + i]);
+			in[i] = bufs[i];
+		}
+
+		wsha256_many_midstate(&ctx->midstate, in, BTCZ_POW_TAIL_BYTES,
+			count, wsha256_results);
+		for(i32 i = 0; i < count; i += 1)
+			result[start + i] = !(wsha256_results[i] > ctx->target);
+	}
 }
 
 static
@@ -119,12 +163,44 @@ void btcz_state_add_nonce(blake2b_state *state, u256 nonce){
 	blake2b_update(state, buf, 32);
 }
 
+// NOTE: Miners sharing a job get disjoint slices of the nonce space
+// by keeping the top byte of the nonce within their slice, which is
+// [256 * slice / num_slices, 256 * (slice + 1) / num_slices) so slices
+// cover every value between them. btcz_nonce_increase would need to
+// carry through every byte below it to leave the slice, which won't
+// happen (see the NOTE in there).
+//	The bytes below it come from a local xorshift seeded with the job
+// time and the slice, since miners run this at the same time from
+// different threads and rand() is shared state.
+//	When the pool leaves us no more than the top byte there is nothing
+// to slice, so slice 0 takes the whole nonce space and the others
+// return false and should sit the job out.
 static
-void btcz_nonce_init(MiningParams *params, u256 *nonce){
+bool btcz_nonce_init(MiningParams *params, i32 slice, i32 num_slices, u256 *nonce){
 	*nonce = params->nonce1;
-	srand(params->time);
-	for(i32 i = params->nonce1_bytes; i < 32; i += 1)
-		nonce->data[i] = ((u32)rand() << 16) | ((u32)rand() << 0);
+	u32 state = params->time ^ ((u32)(slice + 1) * 0x9E3779B9u);
+	if(state == 0)
+		state = 0x9E3779B9u;
+	for(i32 i = params->nonce1_bytes; i < 32; i += 1){
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		nonce->data[i] = (u8)(state >> 24);
+	}
+	if(num_slices > 1){
+		if(params->nonce1_bytes >= 31){
+			if(slice != 0){
+				LOG_ERROR("no room to slice the nonce (nonce1 is %d bytes),"
+					" only miner 0 works on this job\n", params->nonce1_bytes);
+				return false;
+			}
+			return true;
+		}
+		u32 slice_begin = (256 * (u32)slice) / num_slices;
+		u32 slice_end = (256 * (u32)(slice + 1)) / num_slices;
+		nonce->data[31] = (u8)(slice_begin + nonce->data[31] % (slice_end - slice_begin));
+	}
+	return true;
 }
 
 static
@@ -140,42 +216,337 @@ void btcz_nonce_increase(MiningParams *params, u256 *nonce){
 	}
 }
 
-#if 1
-int main(int argc, char **argv){
-	// NOTE: This is the address and port of the BTCZ mining pool
-	// https://btcz.darkfibermines.com/ and my personal BTCZ public
-	// address which I used for testing.
-	const char *connect_addr = "142.4.211.28";
-	const char *connect_port = "4000";
-	const char *user = "t1Rxx8pUgs29isFXV8mjDPuBbNf22SDqZGq";
-	const char *password = "x";
+static
+void btcz_test_params(MiningParams *params, u256 *nonce){
+	// block = 818128
+	const char *prev_hash_hex = "0000007b753e415f80614ba8130aa4668ca4731b0539d9919c2074b43a46b9e8";
+	const char *merkle_root_hex = "6b2198b49e2055535c403830a3c124a8c235004b4662901010bc0927c43979ec";
+	const char *final_sapling_root_hex = "189df3ceb26643f3b90ec7059316c7ccb26aeaf1e96559c63b8c6d52f04e79b5";
+	const char *nonce_hex = "81b601c200000000000000006dcdf558dd65a0dd9e68012952b8df1003cefade";
+
+	DEBUG_ASSERT(count_hex_digits(prev_hash_hex) == 64);
+	DEBUG_ASSERT(count_hex_digits(merkle_root_hex) == 64);
+	DEBUG_ASSERT(count_hex_digits(final_sapling_root_hex) == 64);
+	DEBUG_ASSERT(count_hex_digits(nonce_hex) == 64);
+
+	memset(params, 0, sizeof(MiningParams));
+	strcpy(params->job_id, "818128");
+	params->version = 4;
+	params->prev_hash = hex_be_to_u256(prev_hash_hex);
+	params->merkle_root = hex_be_to_u256(merkle_root_hex);
+	params->final_sapling_root = hex_be_to_u256(final_sapling_root_hex);
+	params->time = 1632007626;
+	params->bits = 0x1e009cb8;
+	params->nonce1_bytes = 4;
+	params->target = compact_to_u256(params->bits);
+	*nonce = hex_be_to_u256(nonce_hex);
+	params->nonce1 = *nonce;
+}
+
+// NOTE: Runs the known answer tests of every hash implementation
+// supported by this cpu and then checks block 818128 end to end with
+// whatever implementations were selected by the dispatch.
+static
+int btcz_selftest(void){
+	bool blake2b_ok = blake2b_selftest();
+	bool sha256_ok = sha256_selftest();
 
 	MiningParams params;
-	STRATUM *S = btcz_stratum_connect(
-			connect_addr, connect_port,
-			user, password, &params);
-	if(!S){
-		LOG_ERROR("failed to connect to pool\n");
-		return -1;
+	u256 nonce;
+	btcz_test_params(&params, &nonce);
+
+	BlockHeader header;
+	header.version = params.version;
+	header.hash_prev_block = params.prev_hash;
+	header.hash_merkle_root = params.merkle_root;
+	header.hash_final_sapling_root = params.final_sapling_root;
+	header.time = params.time;
+	header.bits = params.bits;
+	header.nonce = nonce;
+	header.solution = hex_to_eh_solution(
+		"02969d2baea1d4f46df3ddfc40b270b99edba12611cdc547990c8225d18f09ab"
+		"96da59fd028558e4ab5f6e6e7e1469c2723a089789e121944d2ee7a89f0f9218"
+		"7d821ddd9694eff1579ec92d52e3fd4ee4d0bb522f560c7378bbef28efa9fd39"
+		"ff112128");
+
+	u8 buf[241];
+	u8 *in = buf;
+	u256 block_hash;
+	btcz_serialize_block_header(buf, &header);
+	wsha256_many(&in, 241, 1, &block_hash);
+	u256 expected_hash = hex_be_to_u256(
+		"000000260cf4f036b6023e48c893cadaf93457de8512357ce56159d25bf4ea3f");
+	BTCZ_PowContext pow_ctx;
+	bool below_pow_target = false;
+	btcz_pow_context_init(&pow_ctx, &params);
+	btcz_pow_check(&pow_ctx, nonce, &header.solution, 1, &below_pow_target);
+
+	bool block_ok = btcz_check_block(&header)
+		&& block_hash == expected_hash
+		&& below_pow_target;
+	LOG("block 818128: %s\n", block_ok ? "passed" : "failed");
+
+	bool stratum_ok = btcz_stratum_selftest();
+
+	bool result = blake2b_ok && sha256_ok && block_ok && stratum_ok;
+	LOG("selftest: %s\n", result ? "passed" : "failed");
+	return result ? 0 : -1;
+}
+
+// NOTE: Solves `num_solves` consecutive nonces starting from block
+// 818128 once for each page mode and reports Sol/s. Page modes that
+// can't be obtained on this machine are reported and skipped since
+// the solver would fall back to an already measured mode.
+static
+int btcz_bench_page_modes(EH_SolverConfig *base_config, i32 num_solves){
+	MiningParams params;
+	u256 start_nonce;
+	btcz_test_params(&params, &start_nonce);
+
+	blake2b_state base_state;
+	btcz_state_init(&base_state, &params);
+
+	f64 sols_per_sec[MEM_PAGES_COUNT] = {};
+	bool measured[MEM_PAGES_COUNT] = {};
+	for(i32 mode = MEM_PAGES_NORMAL; mode < MEM_PAGES_COUNT; mode += 1){
+		EH_SolverConfig config = *base_config;
+		config.max_page_mode = mode;
+		EH_Solver *solver = eh_solver_create(&config);
+		if(eh_solver_page_mode(solver) != mode){
+			LOG("%s pages: not available (got %s pages)\n",
+				mem_page_mode_name(mode),
+				mem_page_mode_name(eh_solver_page_mode(solver)));
+			eh_solver_destroy(solver);
+			continue;
+		}
+
+		i32 total_sols = 0;
+		u256 nonce = start_nonce;
+		i64 start = time_now_us();
+		for(i32 i = 0; i < num_solves; i += 1){
+			blake2b_state cur_state = base_state;
+			btcz_state_add_nonce(&cur_state, nonce);
+
+			EH_Solution sols[8];
+			total_sols += eh_solver_solve(solver, &cur_state, sols, NARRAY(sols), NULL);
+			btcz_nonce_increase(&params, &nonce);
+		}
+		i64 elapsed = time_now_us() - start;
+		eh_solver_destroy(solver);
+
+		measured[mode] = true;
+		sols_per_sec[mode] = (f64)total_sols * 1000000.0 / (f64)elapsed;
+		LOG("%s pages: %d solves, %d sols, %.3f s/solve, %.4f Sol/s\n",
+			mem_page_mode_name(mode), num_solves, total_sols,
+			(f64)elapsed / (1000000.0 * num_solves), sols_per_sec[mode]);
 	}
 
-	LOG("connected...\n");
+	LOG("summary:\n");
+	for(i32 mode = MEM_PAGES_NORMAL; mode < MEM_PAGES_COUNT; mode += 1){
+		if(measured[mode]){
+			LOG("\t%-16s %.4f Sol/s\n",
+				mem_page_mode_name(mode), sols_per_sec[mode]);
+		}else{
+			LOG("\t%-16s n/a\n", mem_page_mode_name(mode));
+		}
+	}
+	return 0;
+}
+
+// NOTE: Solves the same `num_solves` nonces as btcz_bench_page_modes
+// (the corpus) with every bucket geometry in the lists below and reports
+// Sol/s, solutions and slots discarded and spilled per solve and the
+// memory each one takes, so the geometry can be picked per host class
+// from data. Geometry fields set on the command line are held fixed
+// instead of swept. Slot bits are relative to the default for the
+// bucket bits, which is the number of slot ids for an extra_room of 2.
+static
+int btcz_bench_geometry(EH_SolverConfig *base_config, i32 num_solves){
+	static const i32 bucket_bits_list[] = { 12, 13, 14 };
+	static const i32 slot_bits_delta_list[] = { 0, -1 };
+	static const i32 bucket_slots_percent_list[] = { 50, 75, 100 };
+
+	MiningParams params;
+	u256 start_nonce;
+	btcz_test_params(&params, &start_nonce);
+
+	blake2b_state base_state;
+	btcz_state_init(&base_state, &params);
+
+	struct GeometryResult{
+		EH_Geometry geometry;
+		f64 sols_per_sec;
+		f64 sols_per_solve;
+		f64 discarded_per_solve;
+		f64 spilled_per_solve;
+		usize memory_size;
+	};
+	GeometryResult results[NARRAY(bucket_bits_list)
+		* NARRAY(slot_bits_delta_list) * NARRAY(bucket_slots_percent_list)];
+	i32 num_results = 0;
+
+	EH_Geometry *fixed = &base_config->geometry;
+	for(i32 i = 0; i < NARRAY(bucket_bits_list); i += 1)
+	for(i32 j = 0; j < NARRAY(slot_bits_delta_list); j += 1)
+	for(i32 k = 0; k < NARRAY(bucket_slots_percent_list); k += 1){
+		// NOTE: Fixed fields only go through the sweep once.
+		if((fixed->bucket_bits != 0 && i > 0)
+		|| (fixed->slot_bits != 0 && j > 0)
+		|| (fixed->bucket_slots[0] != 0 && k > 0))
+			continue;
+
+		EH_Geometry geometry = *fixed;
+		if(geometry.bucket_bits == 0)
+			geometry.bucket_bits = bucket_bits_list[i];
+		if(geometry.slot_bits == 0){
+			EH_Geometry tmp = {};
+			tmp.bucket_bits = geometry.bucket_bits;
+			eh_geometry_resolve(&tmp);
+			geometry.slot_bits = tmp.slot_bits + slot_bits_delta_list[j];
+		}
+		if(geometry.bucket_slots[0] == 0){
+			for(i32 level = 0; level < NARRAY(geometry.bucket_slots); level += 1){
+				geometry.bucket_slots[level] = (i32)(((i64)1 << geometry.slot_bits)
+					* bucket_slots_percent_list[k] / 100);
+			}
+		}
+		if(!eh_geometry_resolve(&geometry)){
+			LOG("skipping invalid geometry (bucket_bits = %d, slot_bits = %d)\n",
+				geometry.bucket_bits, geometry.slot_bits);
+			continue;
+		}
+
+		EH_SolverConfig config = *base_config;
+		config.geometry = geometry;
+		EH_Solver *solver = eh_solver_create(&config);
+
+		i32 total_sols = 0;
+		i64 total_discarded = 0;
+		i64 total_spilled = 0;
+		u256 nonce = start_nonce;
+		i64 start = time_now_us();
+		for(i32 n = 0; n < num_solves; n += 1){
+			blake2b_state cur_state = base_state;
+			btcz_state_add_nonce(&cur_state, nonce);
+
+			EH_Solution sols[8];
+			total_sols += eh_solver_solve(solver, &cur_state, sols, NARRAY(sols), NULL);
+			btcz_nonce_increase(&params, &nonce);
+
+			EH_SolveStats stats;
+			eh_solver_last_stats(solver, &stats);
+			total_discarded += stats.num_discarded_hashes + stats.num_discarded_collisions;
+			total_spilled += stats.num_spilled_slots;
+		}
+		i64 elapsed = time_now_us() - start;
+
+		GeometryResult *result = &results[num_results];
+		num_results += 1;
+		result->geometry = geometry;
+		result->sols_per_sec = (f64)total_sols * 1000000.0 / (f64)elapsed;
+		result->sols_per_solve = (f64)total_sols / num_solves;
+		result->discarded_per_solve = (f64)total_discarded / num_solves;
+		result->spilled_per_solve = (f64)total_spilled / num_solves;
+		result->memory_size = eh_solver_memory_size(solver);
+		eh_solver_destroy(solver);
+	}
+
+	LOG("summary (%d solves each):\n", num_solves);
+	LOG("\tbucket bits  slot bits  bucket slots   Sol/s  sols/solve"
+		"  discarded/solve  spilled/solve  memory MB\n");
+	for(i32 i = 0; i < num_results; i += 1){
+		GeometryResult *result = &results[i];
+		LOG("\t%11d  %9d  %12d  %6.4f  %10.2f  %15.1f  %13.1f  %9zu\n",
+			result->geometry.bucket_bits, result->geometry.slot_bits,
+			result->geometry.bucket_slots[0], result->sols_per_sec,
+			result->sols_per_solve, result->discarded_per_solve,
+			result->spilled_per_solve, result->memory_size >> 20);
+	}
+	return 0;
+}
+
+// NOTE: Job switch latency is the time from receiving a notify to the
+// first hash of the new job, which is when the first solve for it
+// starts. This is mostly the time it takes to unwind the solve that
+// was cancelled by the new job.
+struct BTCZ_SwitchStats{
+	i32 num_switches;
+	i64 total_us;
+	i64 max_us;
+};
+
+static
+void btcz_switch_stats_add(BTCZ_SwitchStats *stats, i64 latency_us){
+	stats->num_switches += 1;
+	stats->total_us += latency_us;
+	if(latency_us > stats->max_us)
+		stats->max_us = latency_us;
+	LOG("job switch latency: %.3f ms (avg %.3f ms, max %.3f ms, %d switches)\n",
+		(f64)latency_us / 1000.0,
+		(f64)stats->total_us / (1000.0 * stats->num_switches),
+		(f64)stats->max_us / 1000.0, stats->num_switches);
+}
+
+#if 1
+// NOTE: A miner is a solver (with its own threads, arena and cpus)
+// mining its own slice of the nonce space, see btcz_nonce_init. There
+// can be more than one sharing the same stratum session, for example
+// one per NUMA node so no solve has to go through memory or barriers
+// on other nodes, at the cost of an arena per miner.
+#define BTCZ_MAX_MINERS STRATUM_MAX_CANCEL
+struct BTCZ_Miner{
+	i32 miner_id;
+	i32 num_miners;
+	STRATUM *S;
+	EH_SolverConfig solver_config;
+	i32 cpus[CPU_MAX_CPUS];
+	MiningParams params;
+	EH_CancelToken cancel;
+	thread_t thread_handle;
+};
+
+static
+void btcz_miner_run(BTCZ_Miner *miner){
+	STRATUM *S = miner->S;
+	MiningParams params = miner->params;
+	EH_CancelToken *cancel = &miner->cancel;
+	EH_Solver *solver = eh_solver_create(&miner->solver_config);
+	BTCZ_SwitchStats switch_stats = {};
+	i64 last_notify_time_us = params.notify_time_us;
 	while(1){
-		LOG("job_id: %s\n", params.job_id);
+		LOG("miner %d: job_id: %s\n", miner->miner_id, params.job_id);
 		blake2b_state base_state;
 		btcz_state_init(&base_state, &params);
 
+		BTCZ_PowContext pow_ctx;
+		btcz_pow_context_init(&pow_ctx, &params);
+
 		u256 nonce;
-		btcz_nonce_init(&params, &nonce);
+		if(!btcz_nonce_init(&params, miner->miner_id, miner->num_miners, &nonce)){
+			while(!btcz_stratum_update_params(S, &params))
+				thread_sleep_ms(100);
+			continue;
+		}
 		while(1){
 			// prepare blake2b state for the current nonce
 			blake2b_state cur_state = base_state;
 			btcz_state_add_nonce(&cur_state, nonce);
 
+			// NOTE: A set_target also gets us here with new params
+			// but only a notify is a job switch.
+			if(params.notify_time_us != last_notify_time_us){
+				last_notify_time_us = params.notify_time_us;
+				btcz_switch_stats_add(&switch_stats,
+					time_now_us() - params.notify_time_us);
+			}
+
 			// solve the equihash
 			EH_Solution sols[8];
 			i32 max_sols = NARRAY(sols);
-			i32 num_sols = eh_solve(&cur_state, sols, max_sols);
+			i32 num_sols = eh_solver_solve(solver, &cur_state,
+				sols, max_sols, cancel);
+			if(eh_cancel_is_tripped(cancel))
+				LOG("solve cancelled by a new job\n");
 			if(num_sols > max_sols){
 				LOG("missed %d solutions (max_sols = %d, num_sols = %d)\n",
 					(num_sols - max_sols), max_sols, num_sols);
@@ -184,22 +555,33 @@ int main(int argc, char **argv){
 
 			// submit results
 			LOG("num_sols = %d\n", num_sols);
+			bool below_pow_target[NARRAY(sols)];
+			btcz_pow_check(&pow_ctx, nonce, sols, num_sols, below_pow_target);
+			EH_Solution submit_sols[NARRAY(sols)];
+			i32 num_submit_sols = 0;
 			for(i32 i = 0; i < num_sols; i += 1){
 				bool is_eh_solution = eh_check_solution(&cur_state, &sols[i]);
-				bool is_above_pow_target = !btcz_check_pow_target(&params, nonce, sols[i]);
+				bool is_above_pow_target = !below_pow_target[i];
 				LOG("sol %d: is_eh_solution = %s, is_above_pow_target = %s\n",
 					i, is_eh_solution ? "yes" : "no",
 					is_above_pow_target ? "yes" : "no");
 				if(is_above_pow_target)
 					continue;
 				LOG("sending sol %d...\n", i);
-				if(!btcz_stratum_submit_solution(S, &params, nonce, sols[i]))
-					LOG_ERROR("failed to submit solution %d\n", i);
+				submit_sols[num_submit_sols] = sols[i];
+				num_submit_sols += 1;
+			}
+			if(num_submit_sols > 0
+			&& !btcz_stratum_submit_solutions(S, &params, nonce,
+					submit_sols, num_submit_sols)){
+				LOG_ERROR("failed to submit %d solutions\n", num_submit_sols);
 			}
 
 			// NOTE: Check if the server updated our mining params and if
 			// so, we should re-initialize our blake2b state and nonce with
-			// the new params.
+			// the new params. The token is reset before checking so a job
+			// that arrives after the check still cancels the next solve.
+			eh_cancel_reset(cancel);
 			if(btcz_stratum_update_params(S, &params))
 				break;
 
@@ -207,41 +589,244 @@ int main(int argc, char **argv){
 			btcz_nonce_increase(&params, &nonce);
 		}
 	}
-	return 0;
+	eh_solver_destroy(solver);
 }
 
-#else
+static
+void btcz_miner_thread(void *arg){
+	btcz_miner_run((BTCZ_Miner*)arg);
+}
 
-void btcz_test_state_init(blake2b_state *state){
-	// block = 818128
-	u32 version = 4;
-	char *prev_hash_hex = "0000007b753e415f80614ba8130aa4668ca4731b0539d9919c2074b43a46b9e8";
-	char *merkle_root_hex = "6b2198b49e2055535c403830a3c124a8c235004b4662901010bc0927c43979ec";
-	char *final_sapling_root_hex = "189df3ceb26643f3b90ec7059316c7ccb26aeaf1e96559c63b8c6d52f04e79b5";
-	u32 time = 1632007626;
-	u32 bits = 0x1e009cb8;
-	char *nonce_hex = "81b601c200000000000000006dcdf558dd65a0dd9e68012952b8df1003cefade";
+int main(int argc, char **argv){
+	// NOTE: Options of the form `--name=value` must come first.
+	//	`--cpu-disable=avx512,sha` hides cpu features from the hash
+	// dispatch so implementations can be compared against each other
+	// (A/B) on the same machine.
+	//	`--bucket-chunk=n` sets EH_SolverConfig::bucket_chunk_size.
+	//	`--thread-timings=0|1` sets EH_SolverConfig::thread_timings.
+	//	`--affinity=compact|scatter|<cpu list>` pins solver threads,
+	// see EH_SolverConfig::affinity.
+	//	`--miners=node|n` runs one miner per NUMA node or n miners
+	// instead of a single solver over every cpu, see BTCZ_Miner. Their
+	// threads are always pinned, over consecutive compact ranges of cpus,
+	// so it can't be combined with `--affinity`.
+	//	`--bucket-bits=n`, `--slot-bits=n` and `--bucket-slots=n[,n...]`
+	// set EH_SolverConfig::geometry, with either one number of bucket
+	// slots for every level or one per level.
+	//	`--adaptive-slots=mb` resizes the bucket slots of each level
+	// between solves from the bucket fill of previous solves, within mb
+	// megabytes (or what the geometry takes if zero), see
+	// EH_SolverConfig::adaptive_slots.
+	// NOTE: The topology is detected on the first call to cpu_topology,
+	// which must happen here before any thread is spawned.
+	cpu_topology();
+
+	EH_SolverConfig solver_config = eh_solver_default_config();
+	static i32 affinity_cpus[CPU_MAX_CPUS];
+	i32 num_miners = 1;
+	while(argc >= 2 && strncmp(argv[1], "--", 2) == 0 && strchr(argv[1], '=')){
+		if(strncmp(argv[1], "--cpu-disable=", 14) == 0){
+			if(!cpu_disable_features(argv[1] + 14))
+				return -1;
+		}else if(strncmp(argv[1], "--bucket-chunk=", 15) == 0){
+			solver_config.bucket_chunk_size = atoi(argv[1] + 15);
+		}else if(strncmp(argv[1], "--thread-timings=", 17) == 0){
+			solver_config.thread_timings = atoi(argv[1] + 17) != 0;
+		}else if(strncmp(argv[1], "--bucket-bits=", 14) == 0){
+			solver_config.geometry.bucket_bits = atoi(argv[1] + 14);
+		}else if(strncmp(argv[1], "--slot-bits=", 12) == 0){
+			solver_config.geometry.slot_bits = atoi(argv[1] + 12);
+		}else if(strncmp(argv[1], "--bucket-slots=", 15) == 0){
+			EH_Geometry *geometry = &solver_config.geometry;
+			i32 max_levels = NARRAY(geometry->bucket_slots);
+			i32 num_levels = 0;
+			const char *value = argv[1] + 15;
+			const char *p = value;
+			while(num_levels < max_levels){
+				char *end;
+				i32 num_slots = (i32)strtol(p, &end, 10);
+				if(end == p || num_slots <= 0)
+					break;
+				geometry->bucket_slots[num_levels] = num_slots;
+				num_levels += 1;
+				p = end;
+				if(*p != ',')
+					break;
+				p += 1;
+			}
+			if(*p != 0 || (num_levels != 1 && num_levels != max_levels)){
+				LOG_ERROR("invalid bucket slots \"%s\"\n", value);
+				return -1;
+			}
+			for(i32 level = num_levels; level < max_levels; level += 1)
+				geometry->bucket_slots[level] = geometry->bucket_slots[0];
+		}else if(strncmp(argv[1], "--adaptive-slots=", 17) == 0){
+			i32 budget_mb = atoi(argv[1] + 17);
+			if(budget_mb < 0){
+				LOG_ERROR("invalid slot budget \"%s\"\n", argv[1] + 17);
+				return -1;
+			}
+			solver_config.adaptive_slots = true;
+			solver_config.slots_budget = (usize)budget_mb << 20;
+		}else if(strncmp(argv[1], "--miners=", 9) == 0){
+			const char *value = argv[1] + 9;
+			if(strcmp(value, "node") == 0)
+				num_miners = cpu_topology()->num_nodes;
+			else
+				num_miners = atoi(value);
+			if(num_miners <= 0 || num_miners > BTCZ_MAX_MINERS){
+				LOG_ERROR("invalid number of miners \"%s\"\n", value);
+				return -1;
+			}
+		}else if(strncmp(argv[1], "--affinity=", 11) == 0){
+			const char *value = argv[1] + 11;
+			if(strcmp(value, "compact") == 0){
+				solver_config.affinity = CPU_AFFINITY_COMPACT;
+			}else if(strcmp(value, "scatter") == 0){
+				solver_config.affinity = CPU_AFFINITY_SCATTER;
+			}else{
+				i32 num_cpus = cpu_parse_list(value, affinity_cpus, CPU_MAX_CPUS);
+				if(num_cpus <= 0){
+					LOG_ERROR("invalid cpu list \"%s\"\n", value);
+					return -1;
+				}
+				solver_config.affinity = CPU_AFFINITY_LIST;
+				solver_config.affinity_cpus = affinity_cpus;
+				solver_config.num_affinity_cpus = num_cpus;
+			}
+		}else{
+			LOG_ERROR("unknown option \"%s\"\n", argv[1]);
+			return -1;
+		}
+		argc -= 1;
+		argv += 1;
+	}
+	if(num_miners > 1 && solver_config.affinity != CPU_AFFINITY_NONE){
+		LOG_ERROR("--miners pins the threads of each miner to its own cpus"
+			" and can't be combined with --affinity\n");
+		return -1;
+	}
+	if(!eh_solver_config_check(&solver_config)){
+		LOG_ERROR("usage: --bucket-bits=n --slot-bits=n"
+			" --bucket-slots=n[,n...] --adaptive-slots=mb\n");
+		return -1;
+	}
+	cpu_print_features();
+	cpu_print_topology();
+	blake2b_dispatch_init();
+	sha256_dispatch_init();
+
+	if(argc >= 2 && strcmp(argv[1], "--selftest") == 0)
+		return btcz_selftest();
+
+	if(argc >= 2 && strcmp(argv[1], "--bench-wsha256") == 0){
+		i32 num_headers = (argc >= 3) ? atoi(argv[2]) : 1000000;
+		wsha256_bench(num_headers > 0 ? num_headers : 1000000);
+		return 0;
+	}
 
-	DEBUG_ASSERT(count_hex_digits(prev_hash_hex) == 64);
-	DEBUG_ASSERT(count_hex_digits(merkle_root_hex) == 64);
-	DEBUG_ASSERT(count_hex_digits(final_sapling_root_hex) == 64);
-	DEBUG_ASSERT(count_hex_digits(nonce_hex) == 64);
+	if(argc >= 2 && strcmp(argv[1], "--bench-scatter") == 0){
+		eh_bench_scatter();
+		return 0;
+	}
 
-	u8 buf[140];
-	serialize_u32(buf + 0x00, version);
-	serialize_u256(buf + 0x04, hex_be_to_u256(prev_hash_hex));
-	serialize_u256(buf + 0x24, hex_be_to_u256(merkle_root_hex));
-	serialize_u256(buf + 0x44, hex_be_to_u256(final_sapling_root_hex));
-	serialize_u32(buf + 0x64, time);
-	serialize_u32(buf + 0x68, bits);
-	serialize_u256(buf + 0x6C, hex_be_to_u256(nonce_hex));
+	if(argc >= 2 && strcmp(argv[1], "--bench-geometry") == 0){
+		i32 num_solves = (argc >= 3) ? atoi(argv[2]) : 2;
+		return btcz_bench_geometry(&solver_config, num_solves > 0 ? num_solves : 2);
+	}
 
-	blake2b_init_eh(state, EH_PERSONAL, EH_N, EH_K);
-	blake2b_update(state, buf, 140);
+	if(argc >= 2 && strcmp(argv[1], "--bench-pages") == 0){
+		i32 num_solves = (argc >= 3) ? atoi(argv[2]) : 8;
+		return btcz_bench_page_modes(&solver_config, num_solves > 0 ? num_solves : 8);
+	}
+
+	// NOTE: This is the address and port of the BTCZ mining pool
+	// https://btcz.darkfibermines.com/ and my personal BTCZ public
+	// address which I used for testing.
+	const char *connect_addr = "142.4.211.28";
+	const char *connect_port = "4000";
+	const char *user = "t1Rxx8pUgs29isFXV8mjDPuBbNf22SDqZGq";
+	const char *password = "x";
+
+	// NOTE: With compact order, splitting cpus in num_nodes equal ranges
+	// gives each miner a node when nodes have the same number of cpus.
+	static i32 cpu_order[CPU_MAX_CPUS];
+	i32 num_cpus = cpu_affinity_order(CPU_AFFINITY_COMPACT, cpu_order, CPU_MAX_CPUS);
+	if(num_miners > num_cpus)
+		num_miners = num_cpus;
+	if(num_miners > 1)
+		LOG("running %d miners over %d cpus\n", num_miners, num_cpus);
+
+	BTCZ_Miner *miners = (BTCZ_Miner*)calloc(num_miners, sizeof(BTCZ_Miner));
+	for(i32 i = 0; i < num_miners; i += 1){
+		BTCZ_Miner *miner = &miners[i];
+		miner->miner_id = i;
+		miner->num_miners = num_miners;
+		miner->solver_config = solver_config;
+		if(num_miners > 1){
+			i32 begin = (num_cpus * i) / num_miners;
+			i32 end = (num_cpus * (i + 1)) / num_miners;
+			memcpy(miner->cpus, cpu_order + begin, (end - begin) * sizeof(i32));
+			miner->solver_config.affinity = CPU_AFFINITY_LIST;
+			miner->solver_config.affinity_cpus = miner->cpus;
+			miner->solver_config.num_affinity_cpus = end - begin;
+			miner->solver_config.num_threads = end - begin;
+		}
+	}
+	// NOTE: Leave one cpu for the system, like the solver does when it
+	// picks the number of threads itself. It comes off the end of the last
+	// miner's range so every range stays on its node. That miner then runs
+	// one thread short and solves a bit slower than the others, which only
+	// shows in per-miner rates: each miner searches its own nonce slice so
+	// nobody waits on it.
+	if(num_miners > 1){
+		EH_SolverConfig *last_config = &miners[num_miners - 1].solver_config;
+		if(last_config->num_threads > 1){
+			last_config->num_threads -= 1;
+			last_config->num_affinity_cpus -= 1;
+		}
+	}
+
+	MiningParams params;
+	STRATUM *S = btcz_stratum_connect(
+			connect_addr, connect_port,
+			user, password, &params, &miners[0].cancel);
+	if(!S){
+		LOG_ERROR("failed to connect to pool\n");
+		return -1;
+	}
+
+	LOG("connected...\n");
+	for(i32 i = 0; i < num_miners; i += 1){
+		miners[i].S = S;
+		miners[i].params = params;
+		if(i != 0){
+			btcz_stratum_add_cancel(S, &miners[i].cancel);
+			thread_spawn(&miners[i].thread_handle, btcz_miner_thread, &miners[i]);
+		}
+	}
+	btcz_miner_run(&miners[0]);
+	for(i32 i = 1; i < num_miners; i += 1)
+		thread_join(&miners[i].thread_handle);
+	free(miners);
+	btcz_stratum_close(S);
+	return 0;
+}
+
+#else
+
+void btcz_test_state_init(blake2b_state *state){
+	MiningParams params;
+	u256 nonce;
+	btcz_test_params(&params, &nonce);
+	btcz_state_init(state, &params);
+	btcz_state_add_nonce(state, nonce);
 }
 
 int main(int argc, char **argv){
 	LOG("BTCZ TEST\n");
+	blake2b_dispatch_init();
+	sha256_dispatch_init();
 
 	blake2b_state state;
 	btcz_test_state_init(&state);
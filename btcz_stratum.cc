@@ -5,11 +5,297 @@
 #include "common.hh"
 #include "buffer_util.hh"
 #include "json.hh"
+#include "net.hh"
+#include "thread.hh"
 
-#include <winsock2.h>
+// ----------------------------------------------------------------
+// job slot and submit queue
+// ----------------------------------------------------------------
+
+// NOTE: The network thread publishes params by writing the slot that
+// is not current and then bumping the sequence number, so the current
+// slot is never written while the sequence number stays the same. The
+// reader copies the current slot and retries if the sequence number
+// moved meanwhile, because then the slot it copied may have been
+// rewritten under it. Only the network thread writes.
+//	The copies are plain loads and stores, so this only works if they
+// stay between the sequence number accesses: the reader needs an acquire
+// fence between its copy and the second load, so the copy can't move
+// past the check, and the writer needs a release fence between the bump
+// of the previous publish and the slot writes, so the writes to a slot
+// that was current can't be seen before it stopped being current.
+struct StratumJobSlot{
+	i32 seq;
+	MiningParams params[2];
+};
+
+static
+void job_slot_publish(StratumJobSlot *slot, MiningParams *params){
+	i32 seq = slot->seq;
+	atomic_fence_release();
+	slot->params[(seq + 1) & 1] = *params;
+	atomic_exchange(&slot->seq, seq + 1);
+}
+
+static
+void job_slot_read(StratumJobSlot *slot, MiningParams *out_params){
+	while(1){
+		i32 seq = atomic_load(&slot->seq);
+		*out_params = slot->params[seq & 1];
+		atomic_fence_acquire();
+		if(atomic_load(&slot->seq) == seq){
+			out_params->job_seq = seq;
+			return;
+		}
+	}
+}
+
+// NOTE: This is a bounded multi producer single consumer queue where
+// each cell has a sequence number that tells whether it is free for
+// the producer at position `pos` (seq == pos) or holds the entry the
+// consumer at position `pos` is waiting for (seq == pos + 1). Producers
+// only contend on `tail` and never wait on each other, and a full queue
+// fails the push instead of blocking.
+#define STRATUM_SUBMIT_QUEUE_SIZE 64
+static_assert(IS_POWER_OF_TWO(STRATUM_SUBMIT_QUEUE_SIZE),
+	"STRATUM_SUBMIT_QUEUE_SIZE must be a power of two");
+
+// NOTE: Solutions found together (for the same nonce) are queued as a
+// single entry so they can go out in a single write.
+#define STRATUM_MAX_BATCH 8
+
+struct StratumSubmit{
+	char job_id[16];
+	u32 time;
+	i32 nonce1_bytes;
+	u256 nonce;
+	i32 num_solutions;
+	EH_Solution solutions[STRATUM_MAX_BATCH];
+};
+
+struct StratumSubmitCell{
+	i32 seq;
+	StratumSubmit submit;
+};
+
+struct StratumSubmitQueue{
+	// NOTE: Padded so producers bumping `tail` don't keep taking the
+	// consumer's cache line.
+	i32 head;
+	i32 pad0[15];
+	i32 tail;
+	i32 pad1[15];
+	StratumSubmitCell cells[STRATUM_SUBMIT_QUEUE_SIZE];
+};
+
+static
+void submit_queue_init(StratumSubmitQueue *queue){
+	queue->head = 0;
+	queue->tail = 0;
+	for(i32 i = 0; i < STRATUM_SUBMIT_QUEUE_SIZE; i += 1)
+		queue->cells[i].seq = i;
+}
+
+static
+bool submit_queue_push(StratumSubmitQueue *queue, StratumSubmit *submit){
+	StratumSubmitCell *cell;
+	i32 pos = atomic_load(&queue->tail);
+	while(1){
+		cell = &queue->cells[pos & (STRATUM_SUBMIT_QUEUE_SIZE - 1)];
+		i32 diff = (i32)((u32)atomic_load(&cell->seq) - (u32)pos);
+		if(diff == 0){
+			i32 prev = atomic_compare_exchange(&queue->tail, pos, pos + 1);
+			if(prev == pos)
+				break;
+			pos = prev;
+		}else if(diff < 0){
+			// NOTE: The consumer didn't free this cell yet so the
+			// queue is full.
+			return false;
+		}else{
+			pos = atomic_load(&queue->tail);
+		}
+	}
+
+	cell->submit = *submit;
+	atomic_exchange(&cell->seq, pos + 1);
+	return true;
+}
+
+static
+bool submit_queue_pop(StratumSubmitQueue *queue, StratumSubmit *out_submit){
+	i32 pos = queue->head;
+	StratumSubmitCell *cell = &queue->cells[pos & (STRATUM_SUBMIT_QUEUE_SIZE - 1)];
+	if(atomic_load(&cell->seq) != pos + 1)
+		return false;
+
+	*out_submit = cell->submit;
+	atomic_exchange(&cell->seq, pos + STRATUM_SUBMIT_QUEUE_SIZE);
+	queue->head = pos + 1;
+	return true;
+}
+
+// ----------------------------------------------------------------
+// in-flight submits
+// ----------------------------------------------------------------
+
+// NOTE: Submits don't wait for their responses so we keep the ones
+// that weren't answered yet in a table keyed by message id. Ids are
+// handed out in order so the table is direct mapped (id modulo the
+// table size) and an entry only gets overwritten by a submit sent
+// STRATUM_MAX_INFLIGHT messages later, in which case we give up on it.
+#define STRATUM_MAX_INFLIGHT 64
+static_assert(IS_POWER_OF_TWO(STRATUM_MAX_INFLIGHT),
+	"STRATUM_MAX_INFLIGHT must be a power of two");
+
+struct StratumInflight{
+	i32 id;
+	i64 send_time_us;
+};
+
+// NOTE: Bucket 0 counts latencies under 1ms and bucket i > 0 counts
+// latencies in [2^(i-1), 2^i) ms, with the last bucket taking anything
+// above that.
+#define STRATUM_LATENCY_BUCKETS 14
+
+struct StratumLatencyHistogram{
+	i32 count[STRATUM_LATENCY_BUCKETS];
+	i32 num_samples;
+	i64 total_us;
+	i64 max_us;
+};
+
+static
+void latency_histogram_add(StratumLatencyHistogram *histogram, i64 latency_us){
+	i32 bucket = 0;
+	i64 latency_ms = latency_us / 1000;
+	while(latency_ms > 0 && bucket < (STRATUM_LATENCY_BUCKETS - 1)){
+		latency_ms >>= 1;
+		bucket += 1;
+	}
+	histogram->count[bucket] += 1;
+	histogram->num_samples += 1;
+	histogram->total_us += latency_us;
+	if(latency_us > histogram->max_us)
+		histogram->max_us = latency_us;
+}
+
+static
+void latency_histogram_print(const char *name, StratumLatencyHistogram *histogram){
+	if(histogram->num_samples == 0){
+		LOG("%s: no samples\n", name);
+		return;
+	}
+
+	char line[512];
+	i32 len = 0;
+	for(i32 i = 0; i < STRATUM_LATENCY_BUCKETS; i += 1){
+		if(histogram->count[i] == 0)
+			continue;
+		if(i == (STRATUM_LATENCY_BUCKETS - 1)){
+			len += snprintf(line + len, sizeof(line) - len, " >=%dms:%d",
+				1 << (i - 1), histogram->count[i]);
+		}else{
+			len += snprintf(line + len, sizeof(line) - len, " <%dms:%d",
+				1 << i, histogram->count[i]);
+		}
+	}
+	LOG("%s: %d samples, avg %.2f ms, max %.2f ms,%s\n",
+		name, histogram->num_samples,
+		(f64)histogram->total_us / (1000.0 * histogram->num_samples),
+		(f64)histogram->max_us / 1000.0, line);
+}
+
+// ----------------------------------------------------------------
+// job table
+// ----------------------------------------------------------------
+
+// NOTE: A notify with clean_jobs = false (usually new transactions on the
+// same tip) doesn't invalidate the jobs before it, so solves that started
+// on them may still submit. We keep the last STRATUM_MAX_JOBS job ids the
+// server sent since its last clean notify, dropping the oldest when full,
+// and only submit solutions for jobs that are still in the table. Anything
+// else would be rejected as stale anyway.
+#define STRATUM_MAX_JOBS 8
+
+struct StratumJob{
+	char job_id[16];
+	i64 notify_time_us;
+};
+
+struct StratumJobTable{
+	i32 num_jobs;
+	i32 next_job;
+	StratumJob jobs[STRATUM_MAX_JOBS];
+};
+
+static
+void job_table_clear(StratumJobTable *table){
+	table->num_jobs = 0;
+	table->next_job = 0;
+}
+
+static
+StratumJob *job_table_find(StratumJobTable *table, const char *job_id){
+	for(i32 i = 0; i < table->num_jobs; i += 1){
+		if(strcmp(table->jobs[i].job_id, job_id) == 0)
+			return &table->jobs[i];
+	}
+	return NULL;
+}
+
+static
+void job_table_insert(StratumJobTable *table,
+		const char *job_id, i64 notify_time_us){
+	// NOTE: A server may re-send a job id, in which case it just
+	// gets refreshed.
+	StratumJob *job = job_table_find(table, job_id);
+	if(!job){
+		job = &table->jobs[table->next_job];
+		table->next_job = (table->next_job + 1) % STRATUM_MAX_JOBS;
+		if(table->num_jobs < STRATUM_MAX_JOBS)
+			table->num_jobs += 1;
+	}
+	memcpy(job->job_id, job_id, sizeof(job->job_id));
+	job->notify_time_us = notify_time_us;
+}
+
+// ----------------------------------------------------------------
+// STRATUM
+// ----------------------------------------------------------------
+
+// NOTE: How long the server has to answer the handshake, and how long
+// reconnects wait after failing, doubling from the min to the max.
+#define STRATUM_HANDSHAKE_TIMEOUT_MS	30000
+#define STRATUM_RECONNECT_MIN_MS		1000
+#define STRATUM_RECONNECT_MAX_MS		60000
+
+// NOTE: How long a send waits for room in the socket send buffer before
+// the connection is considered dead. Messages are small so the buffer
+// only fills up if the server stopped reading.
+#define STRATUM_SEND_TIMEOUT_MS 5000
+
+// NOTE: Server messages are lines of JSON but TCP doesn't know about
+// lines, so a recv may end in the middle of one or carry several. The
+// receive buffer keeps whatever comes after the last complete line
+// until the next recv completes it, growing as needed for long lines.
+// A line that doesn't fit in STRATUM_RECV_MAX_SIZE is treated as a
+// connection error.
+#define STRATUM_RECV_MIN_SPACE	4096
+#define STRATUM_RECV_MAX_SIZE	(1 << 20)
+
+struct StratumRecvBuffer{
+	char *data;
+	i32 size;
+	i32 capacity;
+};
+
+// NOTE: How often the network thread logs the submit latencies.
+#define STRATUM_STATS_INTERVAL_US (60 * 1000000)
 
 struct STRATUM{
-	SOCKET server;
+	net_socket_t server;
+	NetPoller poller;
 	const char *connect_addr;
 	const char *connect_port;
 	const char *user;
@@ -26,7 +312,6 @@ struct STRATUM{
 	i32 next_id;
 	i32 subscribe_id;
 	i32 authorize_id;
-	i32 submit_id;
 
 	// NOTE: Some bookkeeping.
 	i32 num_sent_command_subscribe;
@@ -37,11 +322,38 @@ struct STRATUM{
 	i32 num_recv_response_submit;
 	i32 num_recv_command_set_target;
 	i32 num_recv_command_notify;
+	i32 num_recv_bad_message;
 
 	bool connection_closed;
 	bool connection_error;
 	bool update_params;
+	bool new_job;
+	bool clean_job;
 	MiningParams params;
+	StratumRecvBuffer recv_buffer;
+
+	// NOTE: Jobs we can still submit solutions for.
+	StratumJobTable job_table;
+	i32 num_submits_stale;
+
+	// NOTE: Submits that weren't answered yet and how long it took
+	// for the ones that were to be accepted or rejected.
+	StratumInflight inflight[STRATUM_MAX_INFLIGHT];
+	i32 num_submits_lost;
+	StratumLatencyHistogram accept_latency;
+	StratumLatencyHistogram reject_latency;
+	i64 last_stats_time_us;
+
+	// NOTE: Everything above is owned by the network thread once
+	// btcz_stratum_connect returns. Miners only go through the job
+	// slot, the submit queue and the cancel tokens, which can only be
+	// added to.
+	thread_t network_thread;
+	i32 quit;
+	i32 num_cancel;
+	EH_CancelToken *cancel[STRATUM_MAX_CANCEL];
+	StratumJobSlot job_slot;
+	StratumSubmitQueue submit_queue;
 };
 
 struct ServerResponse{
@@ -56,16 +368,16 @@ struct ServerResponse{
 // ----------------------------------------------------------------
 
 static
-void string_copy(char *dest, i32 dest_len, char *source){
-	i32 copy_len = (i32)strlen(source);
+void string_copy(char *dest, i32 dest_len, StrSlice source){
+	i32 copy_len = source.len;
 	if(copy_len >= dest_len)
 		copy_len = dest_len - 1;
-	memcpy(dest, source, copy_len);
+	memcpy(dest, source.ptr, copy_len);
 	dest[copy_len] = 0;
 }
 
 static
-u32 hex_le_to_u32(const char *hex){
+u32 hex_le_to_u32(StrSlice hex){
 	u8 le_number[4];
 	hex_to_buffer(hex, le_number, 4);
 	u32 result = decode_u32_le(le_number);
@@ -124,6 +436,17 @@ void eh_solution_to_hex(char *dest, EH_Solution source){
 // (client -> server) message handling
 // ----------------------------------------------------------------
 
+static
+bool stratum_send(STRATUM *S, const char *buf, i32 len){
+	bool closed;
+	if(!net_send_all(S->server, buf, len, STRATUM_SEND_TIMEOUT_MS, &closed)){
+		S->connection_closed = closed;
+		S->connection_error = !closed;
+		return false;
+	}
+	return true;
+}
+
 static
 bool send_command_subscribe(STRATUM *S, const char *user_agent,
 		const char *connect_addr, const char *connect_port){
@@ -140,14 +463,8 @@ bool send_command_subscribe(STRATUM *S, const char *user_agent,
 			id, user_agent, connect_addr, connect_port);
 	DEBUG_ASSERT(writelen < sizeof(buf));
 
-	int ret = send(S->server, buf, writelen, 0);
-	if(ret <= 0){
-		LOG_ERROR("send failed (ret = %d, error = %d)\n",
-			ret, WSAGetLastError());
-		S->connection_closed = (ret == 0);
-		S->connection_error = (ret < 0);
+	if(!stratum_send(S, buf, writelen))
 		return false;
-	}
 
 	S->next_id += 1;
 	S->subscribe_id = id;
@@ -171,14 +488,8 @@ bool send_command_authorize(STRATUM *S,
 			id, user, password);
 	DEBUG_ASSERT(writelen < sizeof(buf));
 
-	int ret = send(S->server, buf, writelen, 0);
-	if(ret <= 0){
-		LOG_ERROR("send failed (ret = %d, error = %d)\n",
-			ret, WSAGetLastError());
-		S->connection_closed = (ret == 0);
-		S->connection_error = (ret < 0);
+	if(!stratum_send(S, buf, writelen))
 		return false;
-	}
 
 	S->next_id += 1;
 	S->authorize_id = id;
@@ -187,9 +498,28 @@ bool send_command_authorize(STRATUM *S,
 }
 
 static
-bool send_command_submit(
-		STRATUM *S, MiningParams *params,
-		u256 nonce, EH_Solution eh_solution){
+StratumInflight *inflight_find(STRATUM *S, i32 id){
+	StratumInflight *entry = &S->inflight[id & (STRATUM_MAX_INFLIGHT - 1)];
+	if(id <= 0 || entry->id != id)
+		return NULL;
+	return entry;
+}
+
+static
+void inflight_insert(STRATUM *S, i32 id, i64 send_time_us){
+	StratumInflight *entry = &S->inflight[id & (STRATUM_MAX_INFLIGHT - 1)];
+	if(entry->id != 0){
+		LOG_ERROR("giving up on response to submit %d\n", entry->id);
+		S->num_submits_lost += 1;
+	}
+	entry->id = id;
+	entry->send_time_us = send_time_us;
+}
+
+// NOTE: Sends one "mining.submit" per solution in `submit` with a single
+// write and adds them to the in-flight table.
+static
+bool send_commands_submit(STRATUM *S, StratumSubmit *submit){
 	static const char fmt_submit[] =
 		"{"
 			"\"id\":%d,"
@@ -198,35 +528,35 @@ bool send_command_submit(
 		"}\n";
 
 	char hex_time[32];
-	u32_to_hex_le(hex_time, params->time);
+	u32_to_hex_le(hex_time, submit->time);
 
 	char hex_nonce[128];
-	u256_to_hex_le(hex_nonce, nonce, params->nonce1_bytes);
-
-	// NOTE: These will do for BTCZ only since the packed solution for
-	// ZEC is 1344 bytes which translates to 2688 hex characters.
-	char hex_sol[256];
-	eh_solution_to_hex(hex_sol, eh_solution);
-
-
-	char buf[2048];
-	i32 id = S->next_id;
-	int writelen = snprintf(buf, sizeof(buf), fmt_submit,
-			id, S->user, params->job_id, hex_time, hex_nonce, hex_sol);
-	DEBUG_ASSERT(writelen < sizeof(buf));
+	u256_to_hex_le(hex_nonce, submit->nonce, submit->nonce1_bytes);
+
+	char buf[STRATUM_MAX_BATCH * 2048];
+	i32 writelen = 0;
+	i32 first_id = S->next_id;
+	for(i32 i = 0; i < submit->num_solutions; i += 1){
+		// NOTE: These will do for BTCZ only since the packed solution for
+		// ZEC is 1344 bytes which translates to 2688 hex characters.
+		char hex_sol[256];
+		eh_solution_to_hex(hex_sol, submit->solutions[i]);
+
+		i32 id = first_id + i;
+		i32 len = snprintf(buf + writelen, sizeof(buf) - writelen, fmt_submit,
+				id, S->user, submit->job_id, hex_time, hex_nonce, hex_sol);
+		DEBUG_ASSERT(len < (i32)(sizeof(buf) - writelen));
+		writelen += len;
+	}
 
-	int ret = send(S->server, buf, writelen, 0);
-	if(ret <= 0){
-		LOG_ERROR("send failed (ret = %d, error = %d)\n",
-			ret, WSAGetLastError());
-		S->connection_closed = (ret == 0);
-		S->connection_error = (ret < 0);
+	if(!stratum_send(S, buf, writelen))
 		return false;
-	}
 
-	S->next_id += 1;
-	S->submit_id = id;
-	S->num_sent_command_submit += 1;
+	i64 send_time_us = time_now_us();
+	for(i32 i = 0; i < submit->num_solutions; i += 1)
+		inflight_insert(S, first_id + i, send_time_us);
+	S->next_id += submit->num_solutions;
+	S->num_sent_command_submit += submit->num_solutions;
 	return true;
 }
 
@@ -325,7 +655,8 @@ bool parse_server_command_set_target(JSON_State *json, MiningParams *params){
 }
 
 static
-bool parse_server_command_notify(JSON_State *json, MiningParams *params){
+bool parse_server_command_notify(JSON_State *json,
+		MiningParams *params, bool *out_clean_jobs){
 	// NOTE: All hex strings here must be parsed in little endian
 	// order.
 
@@ -384,10 +715,7 @@ bool parse_server_command_notify(JSON_State *json, MiningParams *params){
 	// clean_jobs
 	if(!json_consume_boolean(json, &tok))
 		return false;
-	// TODO: Do we need a job queue?
-	//S->clean_jobs = tok.token_boolean;
-	if(!tok.token_boolean)
-		return false;
+	*out_clean_jobs = tok.token_boolean;
 
 	// NOTE: This last unknown boolean seems to be optional
 	// as it does not appear in some of the server messages.
@@ -398,162 +726,259 @@ bool parse_server_command_notify(JSON_State *json, MiningParams *params){
 	return json_consume_token(json, NULL, ']');
 }
 
+// NOTE: Parses a single server message (one line without the '\n').
+// Returns false if the line was malformed or the message was one we
+// can't handle, which leaves the rest of the line unparsed.
 static
-bool inbound_data(SOCKET s){
-	timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 0;
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(s, &readfds);
-	int ret = select(0, &readfds, NULL, NULL, &timeout);
-	if(ret == SOCKET_ERROR){
-		LOG_ERROR("select failed (ret = %d, error = %d)\n",
-			ret, WSAGetLastError());
-		return false;
-	}
-	return FD_ISSET(s, &readfds);
-}
-
-static
-bool consume_messages_aux(STRATUM *S){
-	while(inbound_data(S->server)){
-		char buf[4096];
-		int ret = recv(S->server, buf, sizeof(buf), 0);
-		if(ret <= 0){
-			LOG_ERROR("recv failed (ret = %d, error = %d)\n",
-				ret, WSAGetLastError());
-			S->connection_closed = (ret == 0);
-			S->connection_error = (ret < 0);
+bool parse_server_message(STRATUM *S, char *line, i64 recv_time_us){
+	JSON_State json = json_init((u8*)line);
+	while(json_consume_token(&json, NULL, '{')){
+		JSON_Token tok;
+		if(!json_consume_key(&json, "id")
+		|| !json_consume_either(&json, &tok, TOKEN_NUMBER, TOKEN_NULL)
+		|| !json_consume_token(&json, NULL, ','))
 			return false;
-		}
 
-		// NOTE: There may be one or more server messages in a
-		// single packet.
-		if(buf[ret - 1] != '\n')
-			return false;
-		buf[ret - 1] = 0;
-		JSON_State json = json_init((u8*)buf);
-
-		while(json_consume_token(&json, NULL, '{')){
-			JSON_Token tok;
-			if(!json_consume_key(&json, "id")
-			|| !json_consume_either(&json, &tok, TOKEN_NUMBER, TOKEN_NULL)
-			|| !json_consume_token(&json, NULL, ','))
+		if(tok.token == TOKEN_NUMBER){
+			// server response
+			if(!json_consume_key(&json, "result"))
 				return false;
-	
-			if(tok.token == TOKEN_NUMBER){
-				// server response
-				if(!json_consume_key(&json, "result"))
-					return false;
 
-				i32 response_id = (i32)tok.token_number;
-				const char *method = "unknown";
-				ServerResponse response;
-				if(response_id == S->submit_id){
-					// NOTE: Since we only do "mining.subscribe" and "mining.authorize"
-					// at the beggining of the session, we'll be handling exclusively
-					// "mining.submit" responses so it only makes sense that it is
-					// checked first.
-					if(!parse_server_response_common_result(&json, &response)
-					|| !json_consume_token(&json, NULL, ',')
-					|| !json_consume_key(&json, "error")
-					|| !parse_server_response_error(&json, &response))
-						return false;
-					S->num_recv_response_submit += 1;
-					method = "mining.submit";
-				}else if(response_id == S->subscribe_id){
-					// NOTE: We don't add "S->update_params = true" in here
-					// because this message is sent to the server at the
-					// beggining of the session and it should be sent only
-					// once. It means that whenever we get the nonce1 from
-					// this response we won't need to update it until we
-					// disconnect or get disconnected.
-					if(!parse_server_response_subscribe_result(&json, &response, &S->params)
-					|| !json_consume_token(&json, NULL, ',')
-					|| !json_consume_key(&json, "error")
-					|| !parse_server_response_error(&json, &response))
-						return false;
-					S->num_recv_response_subscribe += 1;
-					method = "mining.subscribe";
-				}else if(response_id == S->authorize_id){
-					if(!parse_server_response_common_result(&json, &response)
-					|| !json_consume_token(&json, NULL, ',')
-					|| !json_consume_key(&json, "error")
-					|| !parse_server_response_error(&json, &response))
-						return false;
-					S->num_recv_response_authorize += 1;
-					method = "mining.authorize";
-				}else{
+			i32 response_id = (i32)tok.token_number;
+			const char *method = "unknown";
+			ServerResponse response;
+			StratumInflight *inflight = inflight_find(S, response_id);
+			if(inflight){
+				// NOTE: Since we only do "mining.subscribe" and "mining.authorize"
+				// at the beggining of the session, we'll be handling exclusively
+				// "mining.submit" responses so it only makes sense that it is
+				// checked first.
+				if(!parse_server_response_common_result(&json, &response)
+				|| !json_consume_token(&json, NULL, ',')
+				|| !json_consume_key(&json, "error")
+				|| !parse_server_response_error(&json, &response))
 					return false;
-				}
-
-				if(!response.result){
-					if(response.error_is_null){
-						LOG_ERROR("\"%s\" failed without"
-							" description of the error\n", method);
-					}else{
-						LOG_ERROR("\"%s\" failed: (%d) %s\n", method,
-							response.error_code, response.error_message);
-					}
+				S->num_recv_response_submit += 1;
+				method = "mining.submit";
+
+				i64 latency_us = recv_time_us - inflight->send_time_us;
+				if(response.result)
+					latency_histogram_add(&S->accept_latency, latency_us);
+				else
+					latency_histogram_add(&S->reject_latency, latency_us);
+				inflight->id = 0;
+			}else if(response_id == S->subscribe_id){
+				// NOTE: We don't add "S->update_params = true" in here
+				// because this message is sent to the server at the
+				// beggining of the session and it should be sent only
+				// once. It means that whenever we get the nonce1 from
+				// this response we won't need to update it until we
+				// disconnect or get disconnected.
+				if(!parse_server_response_subscribe_result(&json, &response, &S->params)
+				|| !json_consume_token(&json, NULL, ',')
+				|| !json_consume_key(&json, "error")
+				|| !parse_server_response_error(&json, &response))
 					return false;
-				}
-			}else{
-				// server message
-				if(!json_consume_key(&json, "method")
-				|| !json_consume_token(&json, &tok, TOKEN_STRING)
+				S->num_recv_response_subscribe += 1;
+				method = "mining.subscribe";
+			}else if(response_id == S->authorize_id){
+				if(!parse_server_response_common_result(&json, &response)
 				|| !json_consume_token(&json, NULL, ',')
-				|| !json_consume_key(&json, "params"))
+				|| !json_consume_key(&json, "error")
+				|| !parse_server_response_error(&json, &response))
 					return false;
+				S->num_recv_response_authorize += 1;
+				method = "mining.authorize";
+			}else{
+				return false;
+			}
 
-				if(strcmp("mining.set_target", tok.token_string) == 0){
-					// set_target
-					if(!parse_server_command_set_target(&json, &S->params))
-						return false;
-					S->num_recv_command_set_target += 1;
-					S->update_params = true;
-				}else if(strcmp("mining.notify", tok.token_string) == 0){
-					// notify
-					if(!parse_server_command_notify(&json, &S->params))
-						return false;	
-					S->num_recv_command_notify += 1;
-					S->update_params = true;
+			if(!response.result){
+				if(response.error_is_null){
+					LOG_ERROR("\"%s\" failed without"
+						" description of the error\n", method);
 				}else{
-					return false;
+					LOG_ERROR("\"%s\" failed: (%d) %s\n", method,
+						response.error_code, response.error_message);
 				}
+
+				// NOTE: A rejected share is not a reason to drop
+				// whatever other messages came with it.
+				if(response_id <= S->authorize_id)
+					return false;
 			}
+		}else{
+			// server message
+			if(!json_consume_key(&json, "method")
+			|| !json_consume_token(&json, &tok, TOKEN_STRING)
+			|| !json_consume_token(&json, NULL, ',')
+			|| !json_consume_key(&json, "params"))
+				return false;
 
-			if(!json_consume_token(&json, NULL, '}'))
+			if(str_slice_equals(tok.token_string, "mining.set_target")){
+				// set_target
+				if(!parse_server_command_set_target(&json, &S->params))
+					return false;
+				S->num_recv_command_set_target += 1;
+				S->update_params = true;
+			}else if(str_slice_equals(tok.token_string, "mining.notify")){
+				// notify
+				bool clean_jobs;
+				if(!parse_server_command_notify(&json, &S->params, &clean_jobs))
+					return false;
+				S->params.notify_time_us = recv_time_us;
+				S->num_recv_command_notify += 1;
+				S->update_params = true;
+				S->new_job = true;
+
+				// NOTE: Only a clean job makes the previous ones stale. Any
+				// other job is picked up by the miner after the current solve
+				// and whatever it finds still gets submitted.
+				if(clean_jobs){
+					S->clean_job = true;
+					job_table_clear(&S->job_table);
+				}
+				job_table_insert(&S->job_table,
+					S->params.job_id, recv_time_us);
+			}else{
 				return false;
+			}
 		}
+
+		if(!json_consume_token(&json, NULL, '}'))
+			return false;
 	}
 	return true;
 }
 
 static
-void consume_messages(STRATUM *S){
-	if(!consume_messages_aux(S) && (S->connection_closed || S->connection_error)){
-		if(S->connection_closed)
-			LOG("connection has been closed by the server\n");
-		if(S->connection_error)
-			LOG("connection error has occurred\n");
-		closesocket(S->server);
+char *recv_buffer_reserve(StratumRecvBuffer *buf, i32 min_space){
+	i32 needed = buf->size + min_space;
+	if(needed > buf->capacity){
+		i32 capacity = buf->capacity > 0 ? buf->capacity : STRATUM_RECV_MIN_SPACE;
+		while(capacity < needed)
+			capacity *= 2;
+		buf->data = (char*)realloc(buf->data, capacity);
+		if(!buf->data)
+			FATAL_ERROR("failed to grow receive buffer to %d bytes\n", capacity);
+		buf->capacity = capacity;
+	}
+	return buf->data + buf->size;
+}
+
+// NOTE: Parses every complete line in the receive buffer in place and
+// moves whatever is left (the start of a line) to the front.
+static
+bool recv_buffer_parse_lines(STRATUM *S, i64 recv_time_us){
+	StratumRecvBuffer *buf = &S->recv_buffer;
+	char *line = buf->data;
+	char *end = buf->data + buf->size;
+	while(1){
+		char *newline = (char*)memchr(line, '\n', end - line);
+		if(!newline)
+			break;
+		*newline = 0;
+		if(!parse_server_message(S, line, recv_time_us)){
+			LOG_ERROR("failed to parse server message: %.200s\n", line);
+			S->num_recv_bad_message += 1;
+		}
+		line = newline + 1;
+	}
+
+	i32 remainder = (i32)(end - line);
+	if(remainder > 0 && line != buf->data)
+		memmove(buf->data, line, remainder);
+	buf->size = remainder;
+	if(buf->size >= STRATUM_RECV_MAX_SIZE){
+		LOG_ERROR("server message longer than %d bytes\n", STRATUM_RECV_MAX_SIZE);
+		S->connection_error = true;
+		return false;
+	}
+	return true;
+}
+
+// NOTE: Reads until the socket has nothing left, parsing as it goes.
+static
+bool consume_messages_aux(STRATUM *S){
+	StratumRecvBuffer *buf = &S->recv_buffer;
+	while(1){
+		char *space = recv_buffer_reserve(buf, STRATUM_RECV_MIN_SPACE);
+		i32 space_size = buf->capacity - buf->size;
+		i32 ret = net_recv(S->server, space, space_size);
+		i64 recv_time_us = time_now_us();
+		if(ret == NET_RECV_WOULD_BLOCK)
+			break;
+		if(ret <= 0){
+			LOG_ERROR("recv failed (ret = %d, error = %d)\n",
+				ret, net_last_error());
+			S->connection_closed = (ret == NET_RECV_CLOSED);
+			S->connection_error = (ret == NET_RECV_ERROR);
+			return false;
+		}
+
+		buf->size += ret;
+		if(!recv_buffer_parse_lines(S, recv_time_us))
+			return false;
+	}
+	return true;
+}
 
+static bool stratum_open(STRATUM *S);
+
+// NOTE: This runs on the network thread so it can't give up on the
+// process. It keeps retrying with backoff until it gets a new session or
+// the stratum is closed, sleeping in the poller so btcz_stratum_close can
+// wake it up.
+static
+void reconnect(STRATUM *S){
+	if(S->connection_closed)
+		LOG("connection has been closed by the server\n");
+	if(S->connection_error)
+		LOG("connection error has occurred\n");
+	if(S->server != NET_INVALID_SOCKET){
+		net_poller_remove(&S->poller, S->server);
+		net_close(S->server);
+		S->server = NET_INVALID_SOCKET;
+	}
+
+	i32 backoff_ms = STRATUM_RECONNECT_MIN_MS;
+	while(!atomic_load(&S->quit)){
 		LOG("reconnecting...\n");
-		STRATUM *tmp = btcz_stratum_connect(
-			S->connect_addr, S->connect_port,
-			S->user, S->password, NULL);
-		if(!tmp){
-			FATAL_ERROR("reconnect failed\n");
+		if(stratum_open(S) || atomic_load(&S->quit))
 			return;
+
+		LOG_ERROR("reconnect failed, retrying in %d ms\n", backoff_ms);
+		i64 retry_time_us = time_now_us() + (i64)backoff_ms * 1000;
+		while(!atomic_load(&S->quit)){
+			i64 remaining_us = retry_time_us - time_now_us();
+			if(remaining_us <= 0)
+				break;
+			NetEvent event;
+			net_poller_wait(&S->poller, (i32)((remaining_us + 999) / 1000), &event, 1);
 		}
-		*S = *tmp;
-		free(tmp);
+		backoff_ms *= 2;
+		if(backoff_ms > STRATUM_RECONNECT_MAX_MS)
+			backoff_ms = STRATUM_RECONNECT_MAX_MS;
 	}
 }
 
+static
+void consume_messages(STRATUM *S){
+	if(!consume_messages_aux(S) && (S->connection_closed || S->connection_error))
+		reconnect(S);
+}
+
+// NOTE: Waits up to `timeout_ms` for the server and handles whatever
+// it sent. There is only the server socket in the poller.
+static
+void poll_messages(STRATUM *S, i32 timeout_ms){
+	NetEvent event;
+	if(net_poller_wait(&S->poller, timeout_ms, &event, 1) > 0)
+		consume_messages(S);
+}
+
 // ----------------------------------------------------------------
-// server thread
+// network thread
 // ----------------------------------------------------------------
 
 static
@@ -571,13 +996,31 @@ bool handshake(STRATUM *S,
 		return false;
 	}
 
-	// NOTE: Loop while we don't have the necessary
-	// information to start working.
+	// NOTE: Loop while we don't have the necessary information to start
+	// working. A server that accepts the connection and then says nothing
+	// must not keep btcz_stratum_close waiting, so this gives up on quit
+	// or after STRATUM_HANDSHAKE_TIMEOUT_MS. Closed connections are left
+	// to the caller instead of going through reconnect.
+	i64 deadline_us = time_now_us() + (i64)STRATUM_HANDSHAKE_TIMEOUT_MS * 1000;
 	while(S->num_recv_response_subscribe == 0
 			|| S->num_recv_response_authorize == 0
 			|| S->num_recv_command_set_target == 0
 			|| S->num_recv_command_notify == 0){
-		consume_messages(S);
+		if(atomic_load(&S->quit)){
+			LOG_ERROR("handshake interrupted\n");
+			return false;
+		}
+		i64 remaining_us = deadline_us - time_now_us();
+		if(remaining_us <= 0){
+			LOG_ERROR("server didn't finish the handshake in %d ms\n",
+				STRATUM_HANDSHAKE_TIMEOUT_MS);
+			return false;
+		}
+
+		NetEvent event;
+		if(net_poller_wait(&S->poller, (i32)((remaining_us + 999) / 1000), &event, 1) > 0
+		&& !consume_messages_aux(S) && (S->connection_closed || S->connection_error))
+			return false;
 	}
 	return true;
 }
@@ -604,99 +1047,378 @@ bool parse_port_string(const char *str, u16 *out){
 	return true;
 }
 
-STRATUM *btcz_stratum_connect(
-		const char *connect_addr,
-		const char *connect_port,
-		const char *user,
-		const char *password,
-		MiningParams *out_params){
-
+// NOTE: Connects and does the handshake on `S`, resetting everything
+// from the previous session (if any) except for the params.
+static
+bool stratum_open(STRATUM *S){
 	u32 server_addr;
 	u16 server_port;
-	if(!parse_ip_string(connect_addr, &server_addr)){
+	if(!parse_ip_string(S->connect_addr, &server_addr)){
 		LOG_ERROR("failed to parse server address\n");
-		return NULL;
+		return false;
 	}
-	if(!parse_port_string(connect_port, &server_port)){
+	if(!parse_port_string(S->connect_port, &server_port)){
 		LOG_ERROR("failed to parse server port");
-		return NULL;
+		return false;
 	}
 
-	SOCKET server = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-	if(server == INVALID_SOCKET){
-		LOG_ERROR("failed to create server socket (error = %d)\n",
-			WSAGetLastError());
-		return NULL;
+	net_socket_t server = net_connect_tcp(server_addr, server_port);
+	if(server == NET_INVALID_SOCKET){
+		LOG_ERROR("failed to connect to server\n");
+		return false;
+	}
+	if(!net_poller_add(&S->poller, server, S)){
+		LOG_ERROR("failed to poll server socket\n");
+		net_close(server);
+		return false;
 	}
 
-	sockaddr_in addr;
-	addr.sin_family = AF_INET;
-	addr.sin_port = server_port;
-	addr.sin_addr.s_addr = server_addr;
-	int ret = connect(server, (sockaddr*)&addr, sizeof(sockaddr_in));
-	if(ret != 0){
-		LOG_ERROR("failed to connect to server"
-			" (ret = %d, error = %d)\n",
-			ret, WSAGetLastError());
-		closesocket(server);
-		return NULL;
+	S->server = server;
+	S->next_id = 1;
+	S->subscribe_id = 0;
+	S->authorize_id = 0;
+	S->num_sent_command_subscribe = 0;
+	S->num_sent_command_authorize = 0;
+	S->num_sent_command_submit = 0;
+	S->num_recv_response_subscribe = 0;
+	S->num_recv_response_authorize = 0;
+	S->num_recv_response_submit = 0;
+	S->num_recv_command_set_target = 0;
+	S->num_recv_command_notify = 0;
+	S->num_recv_bad_message = 0;
+	S->connection_closed = false;
+	S->connection_error = false;
+	S->update_params = false;
+	S->new_job = false;
+	S->clean_job = false;
+	S->recv_buffer.size = 0;
+
+	// NOTE: Jobs don't carry over to a new session either.
+	job_table_clear(&S->job_table);
+
+	// NOTE: Ids start over with the new session so whatever is still
+	// in flight won't be answered.
+	for(i32 i = 0; i < STRATUM_MAX_INFLIGHT; i += 1){
+		if(S->inflight[i].id != 0){
+			S->num_submits_lost += 1;
+			S->inflight[i].id = 0;
+		}
+	}
+
+	if(!handshake(S, S->connect_addr, S->connect_port, S->user, S->password)){
+		LOG_ERROR("failed to do server handshake\n");
+		net_poller_remove(&S->poller, server);
+		net_close(server);
+		S->server = NET_INVALID_SOCKET;
+		return false;
+	}
+	return true;
+}
+
+static
+void stratum_print_stats(STRATUM *S){
+	LOG("submits: %d sent, %d answered, %d lost, %d stale\n",
+		S->num_sent_command_submit, S->num_recv_response_submit,
+		S->num_submits_lost, S->num_submits_stale);
+	latency_histogram_print("accept latency", &S->accept_latency);
+	latency_histogram_print("reject latency", &S->reject_latency);
+}
+
+// NOTE: Handles server messages as they arrive, publishes new params
+// (and trips the cancel token on a new clean job) and sends whatever the
+// miner pushed into the submit queue for jobs that are still valid.
+//	It sleeps in the poller until the server sends something, a miner
+// pushes a submit (see btcz_stratum_submit_solutions) or the stats are
+// due, so submits go out as soon as they are pushed without the thread
+// waking up while there is nothing to do.
+static
+void stratum_network_thread(void *arg){
+	STRATUM *S = (STRATUM*)arg;
+	while(!atomic_load(&S->quit)){
+		i64 until_stats_us = S->last_stats_time_us
+			+ STRATUM_STATS_INTERVAL_US - time_now_us();
+		i32 timeout_ms = (until_stats_us > 0)
+			? (i32)((until_stats_us + 999) / 1000) : 0;
+		poll_messages(S, timeout_ms);
+
+		// NOTE: A reconnect only gives up when we're quitting.
+		if(S->server == NET_INVALID_SOCKET)
+			continue;
+
+		if(S->update_params){
+			S->update_params = false;
+			job_slot_publish(&S->job_slot, &S->params);
+			if(S->new_job){
+				S->new_job = false;
+				if(S->clean_job){
+					i32 num_cancel = atomic_load(&S->num_cancel);
+					for(i32 i = 0; i < num_cancel; i += 1)
+						eh_cancel_trip(S->cancel[i]);
+				}
+				S->clean_job = false;
+			}
+		}
+
+		StratumSubmit submit;
+		while(submit_queue_pop(&S->submit_queue, &submit)){
+			if(!job_table_find(&S->job_table, submit.job_id)){
+				LOG("dropping %d solutions for stale job %s\n",
+					submit.num_solutions, submit.job_id);
+				S->num_submits_stale += submit.num_solutions;
+				continue;
+			}
+
+			if(!send_commands_submit(S, &submit)){
+				LOG_ERROR("failed to send `submit` message\n");
+				if(S->connection_closed || S->connection_error){
+					reconnect(S);
+					break;
+				}
+			}
+		}
+
+		i64 now = time_now_us();
+		if((now - S->last_stats_time_us) >= STRATUM_STATS_INTERVAL_US){
+			S->last_stats_time_us = now;
+			stratum_print_stats(S);
+		}
 	}
+}
 
+STRATUM *btcz_stratum_connect(
+		const char *connect_addr,
+		const char *connect_port,
+		const char *user,
+		const char *password,
+		MiningParams *out_params,
+		EH_CancelToken *cancel){
 	STRATUM *S = (STRATUM*)malloc(sizeof(STRATUM));
 	memset(S, 0, sizeof(STRATUM));
-	S->server = server;
 	S->connect_addr = connect_addr;
 	S->connect_port = connect_port;
 	S->user = user;
 	S->password = password;
-	S->next_id = 1;
-	if(!handshake(S, connect_addr, connect_port, user, password)){
-		LOG_ERROR("failed to do server handshake\n");
-		closesocket(server);
+	if(cancel){
+		S->cancel[0] = cancel;
+		S->num_cancel = 1;
+	}
+	submit_queue_init(&S->submit_queue);
+	if(!net_poller_init(&S->poller)){
 		free(S);
 		return NULL;
 	}
-	if(out_params){
-		S->update_params = false;
-		*out_params = S->params;
-	}else{
-		S->update_params = true;
+	if(!stratum_open(S)){
+		net_poller_destroy(&S->poller);
+		free(S);
+		return NULL;
 	}
+
+	S->update_params = false;
+	S->new_job = false;
+	S->clean_job = false;
+	job_slot_publish(&S->job_slot, &S->params);
+	if(out_params)
+		job_slot_read(&S->job_slot, out_params);
+	S->last_stats_time_us = time_now_us();
+	thread_spawn(&S->network_thread, stratum_network_thread, S);
 	return S;
 }
 
-bool btcz_stratum_submit_solution(
-		STRATUM *S, MiningParams *params,
-		u256 nonce, EH_Solution solution){
-	// TODO: We should do a submit queue.
-	if(!send_command_submit(S, params, nonce, solution))
-		return false;
+void btcz_stratum_close(STRATUM *S){
+	if(!S)
+		return;
+	atomic_exchange(&S->quit, 1);
+	net_poller_wake(&S->poller);
+	thread_join(&S->network_thread);
+	stratum_print_stats(S);
+	if(S->server != NET_INVALID_SOCKET)
+		net_close(S->server);
+	net_poller_destroy(&S->poller);
+	free(S->recv_buffer.data);
+	free(S);
+}
 
-	i32 prev = S->num_recv_response_submit;
-	while(prev == S->num_recv_response_submit)
-		consume_messages(S);
+bool btcz_stratum_submit_solutions(
+		STRATUM *S, MiningParams *params, u256 nonce,
+		EH_Solution *solutions, i32 num_solutions){
+	StratumSubmit submit;
+	memcpy(submit.job_id, params->job_id, sizeof(submit.job_id));
+	submit.time = params->time;
+	submit.nonce1_bytes = params->nonce1_bytes;
+	submit.nonce = nonce;
+	while(num_solutions > 0){
+		i32 batch = num_solutions;
+		if(batch > STRATUM_MAX_BATCH)
+			batch = STRATUM_MAX_BATCH;
+		submit.num_solutions = batch;
+		memcpy(submit.solutions, solutions, batch * sizeof(EH_Solution));
+		if(!submit_queue_push(&S->submit_queue, &submit)){
+			LOG_ERROR("submit queue is full\n");
+			net_poller_wake(&S->poller);
+			return false;
+		}
+		solutions += batch;
+		num_solutions -= batch;
+	}
+	net_poller_wake(&S->poller);
 	return true;
 }
 
 bool btcz_stratum_update_params(
-		STRATUM *S, MiningParams *out_params){
-	consume_messages(S);
-	if(S->update_params){
-		S->update_params = false;
-		*out_params = S->params;
-		return true;
-	}
-	return false;
+		STRATUM *S, MiningParams *inout_params){
+	if(atomic_load(&S->job_slot.seq) == inout_params->job_seq)
+		return false;
+	job_slot_read(&S->job_slot, inout_params);
+	return true;
+}
+
+bool btcz_stratum_add_cancel(STRATUM *S, EH_CancelToken *cancel){
+	// NOTE: The token is stored before the count is bumped so the
+	// network thread never sees a slot that wasn't written yet. Only
+	// one thread should be adding tokens at a time.
+	i32 index = atomic_load(&S->num_cancel);
+	if(index >= STRATUM_MAX_CANCEL)
+		return false;
+	S->cancel[index] = cancel;
+	atomic_exchange(&S->num_cancel, index + 1);
+	return true;
 }
 
-struct WSAInit{
-	WSAInit(void){
-		WSADATA dummy;
-		if(WSAStartup(MAKEWORD(2, 2), &dummy) != 0)
-			FATAL_ERROR("failed to initialize windows sockets\n");
+// ----------------------------------------------------------------
+// replay test
+// ----------------------------------------------------------------
+
+// NOTE: Server sides of whole sessions, from the handshake responses to
+// a couple of jobs (clean or not) and submit responses, in the two styles we've seen
+// pools use. They are fed to the receive buffer whole, one byte at a
+// time and in chunks of every size in between that is likely to split
+// lines in different places, and every run must end up with the same
+// params and counters as parsing the whole session at once.
+#define STRATUM_REPLAY_HASH_A "e9e4f3b3a3d2e0d1ad4a5dd2c1d9f0ff8c0d4b1e0e2d0c2a7b05a1a600000000"
+#define STRATUM_REPLAY_HASH_B "8b0b3da9e6fd9c4c0bb7c0d83e0d8f43e4d6a1f60f55bb7f2e73e6f1c2b1a0de"
+#define STRATUM_REPLAY_HASH_C "0000000000000000000000000000000000000000000000000000000000000000"
+
+static const char stratum_replay_session_compact[] =
+	"{\"id\":1,\"result\":[null,\"81000000\"],\"error\":null}\n"
+	"{\"id\":2,\"result\":true,\"error\":null}\n"
+	"{\"id\":null,\"method\":\"mining.set_target\",\"params\":"
+		"[\"0010000000000000000000000000000000000000000000000000000000000000\"]}\n"
+	"{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"1a2b\",\"04000000\","
+		"\"" STRATUM_REPLAY_HASH_A "\",\"" STRATUM_REPLAY_HASH_B "\",\"" STRATUM_REPLAY_HASH_C "\","
+		"\"6d3a6b5c\",\"1d0ffe3c\",true,true]}\n"
+	"{\"id\":3,\"result\":true,\"error\":null}\n"
+	"{\"id\":4,\"result\":null,\"error\":[23,\"Low difficulty share\"]}\n"
+	"{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"1a2c\",\"04000000\","
+		"\"" STRATUM_REPLAY_HASH_B "\",\"" STRATUM_REPLAY_HASH_A "\",\"" STRATUM_REPLAY_HASH_C "\","
+		"\"a53a6b5c\",\"1d0ffe3c\",true]}\n";
+
+static const char stratum_replay_session_spaced[] =
+	"{\"id\": 1, \"result\": [\"6f3c0a\", \"0badc0de\"], \"error\": null}\r\n"
+	"{\"id\": 2, \"result\": true, \"error\": null}\r\n"
+	"{\"id\": null, \"method\": \"mining.set_target\", \"params\": "
+		"[\"00ffff0000000000000000000000000000000000000000000000000000000000\"]}\r\n"
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"7\", \"04000000\", "
+		"\"" STRATUM_REPLAY_HASH_B "\", \"" STRATUM_REPLAY_HASH_C "\", \"" STRATUM_REPLAY_HASH_A "\", "
+		"\"11226b5c\", \"1d0ffe3c\", true]}\r\n"
+	"{\"id\": 4, \"result\": false, \"error\": [21, \"Job not found\", \"\"]}\r\n"
+	"{\"id\": 3, \"result\": true, \"error\": null}\r\n"
+	"{\"id\": null, \"method\": \"mining.set_target\", \"params\": "
+		"[\"0007fff800000000000000000000000000000000000000000000000000000000\"]}\r\n"
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"8\", \"04000000\", "
+		"\"" STRATUM_REPLAY_HASH_B "\", \"" STRATUM_REPLAY_HASH_A "\", \"" STRATUM_REPLAY_HASH_A "\", "
+		"\"3a226b5c\", \"1d0ffe3c\", false]}\r\n";
+
+struct StratumReplaySession{
+	const char *name;
+	const char *data;
+	i32 size;
+	i32 num_set_target;
+	i32 num_notify;
+	const char *job_id;
+	i32 num_jobs;
+};
+
+// NOTE: Replays `data` into a fresh STRATUM that looks like it sent the
+// subscribe, the authorize and two submits (ids 1 to 4).
+static
+bool stratum_replay(STRATUM *S, const char *data, i32 size, i32 chunk_size){
+	memset(S, 0, sizeof(STRATUM));
+	S->subscribe_id = 1;
+	S->authorize_id = 2;
+	S->next_id = 5;
+	inflight_insert(S, 3, 0);
+	inflight_insert(S, 4, 0);
+
+	bool result = true;
+	for(i32 offset = 0; result && offset < size; offset += chunk_size){
+		i32 len = size - offset;
+		if(len > chunk_size)
+			len = chunk_size;
+		memcpy(recv_buffer_reserve(&S->recv_buffer, len), data + offset, len);
+		S->recv_buffer.size += len;
+		result = recv_buffer_parse_lines(S, 0);
 	}
-	~WSAInit(void){
-		WSACleanup();
+	return result && S->recv_buffer.size == 0;
+}
+
+static
+bool stratum_replay_check(StratumReplaySession *session){
+	STRATUM *expected = (STRATUM*)malloc(sizeof(STRATUM));
+	STRATUM *S = (STRATUM*)malloc(sizeof(STRATUM));
+	bool result = stratum_replay(expected, session->data, session->size, session->size)
+		&& expected->num_recv_response_subscribe == 1
+		&& expected->num_recv_response_authorize == 1
+		&& expected->num_recv_response_submit == 2
+		&& expected->num_recv_command_set_target == session->num_set_target
+		&& expected->num_recv_command_notify == session->num_notify
+		&& expected->num_recv_bad_message == 0
+		&& expected->accept_latency.num_samples == 1
+		&& expected->reject_latency.num_samples == 1
+		&& strcmp(expected->params.job_id, session->job_id) == 0
+		&& expected->job_table.num_jobs == session->num_jobs;
+
+	static const i32 chunk_sizes[] = { 1, 2, 3, 5, 7, 13, 64, 100, 333, 4096 };
+	for(i32 i = 0; result && i < NARRAY(chunk_sizes); i += 1){
+		result = stratum_replay(S, session->data, session->size, chunk_sizes[i])
+			&& memcmp(&S->params, &expected->params, sizeof(MiningParams)) == 0
+			&& S->num_recv_response_submit == expected->num_recv_response_submit
+			&& S->num_recv_command_set_target == expected->num_recv_command_set_target
+			&& S->num_recv_command_notify == expected->num_recv_command_notify
+			&& S->job_table.num_jobs == expected->job_table.num_jobs
+			&& S->num_recv_bad_message == 0;
+		free(S->recv_buffer.data);
 	}
-};
-static WSAInit wsa_init;
+	LOG("stratum replay %s: %s\n", session->name, result ? "passed" : "failed");
+
+	free(expected->recv_buffer.data);
+	free(expected);
+	free(S);
+	return result;
+}
+
+bool btcz_stratum_selftest(void){
+	// NOTE: The long session has a set_target padded with whitespace
+	// so it's longer than a single recv and a few times the initial
+	// receive buffer.
+	i32 padding = 3 * STRATUM_RECV_MIN_SPACE;
+	i32 long_size = (i32)sizeof(stratum_replay_session_compact) + padding + 256;
+	char *long_data = (char*)malloc(long_size);
+	long_size = snprintf(long_data, long_size,
+		"%s{\"id\":null,\"method\":\"mining.set_target\",\"params\":[%*s"
+		"\"0000ffff00000000000000000000000000000000000000000000000000000000\"]}\n",
+		stratum_replay_session_compact, padding, "");
+
+	StratumReplaySession sessions[] = {
+		{ "compact", stratum_replay_session_compact,
+			(i32)sizeof(stratum_replay_session_compact) - 1, 1, 2, "1a2c", 1 },
+		{ "spaced", stratum_replay_session_spaced,
+			(i32)sizeof(stratum_replay_session_spaced) - 1, 2, 2, "8", 2 },
+		{ "long line", long_data, long_size, 2, 2, "1a2c", 1 },
+	};
+
+	bool result = true;
+	for(i32 i = 0; i < NARRAY(sessions); i += 1)
+		result = stratum_replay_check(&sessions[i]) && result;
+	free(long_data);
+	return result;
+}
@@ -3,10 +3,10 @@
 pushd %~dp0
 @SET COMPILER_DEFINES=-DARCH_X64=1 -DPLATFORM_WINDOWS=1 -DBUILD_DEBUG=1
 @SET COMPILER_FLAGS=-Fe:"out.exe" -W3 -WX -MTd -Zi -D_CRT_SECURE_NO_WARNINGS=1 %COMPILER_DEFINES% %COMPILER_INCLUDES%
-@SET LINKER_LIBRARIES=shell32.lib ws2_32.lib
+@SET LINKER_LIBRARIES=shell32.lib ws2_32.lib advapi32.lib
 @SET LINKER_FLAGS=-subsystem:console -incremental:no -opt:ref -dynamicbase %LINKER_LIBRARIES%
 
-@SET SRC="../blake2b.cc" "../btcz.cc" "../btcz_stratum.cc" "../common.cc" "../equihash3.cc" "../json.cc" "../sha256.cc"
+@SET SRC="../blake2b.cc" "../btcz.cc" "../btcz_stratum.cc" "../common.cc" "../cpu.cc" "../equihash3.cc" "../json.cc" "../sha256.cc"
 
 @REM @SET SRC="../proxy.cc"
 
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# NOTE: Type punning through pointer casts (see buffer_util.hh) is fine
+# with MSVC but GCC needs -fno-strict-aliasing for it.
+
+cd "$(dirname "$0")"
+COMPILER_DEFINES="-DARCH_X64=1 -DPLATFORM_LINUX=1 -DBUILD_DEBUG=1"
+COMPILER_FLAGS="-o out -std=c++17 -Wall -Wno-sign-compare -Wno-unused-variable -Wno-unused-function -Wno-maybe-uninitialized -fno-strict-aliasing -g $COMPILER_DEFINES"
+LINKER_LIBRARIES="-lpthread"
+
+SRC="../blake2b.cc ../btcz.cc ../btcz_stratum.cc ../common.cc ../cpu.cc ../equihash3.cc ../json.cc ../sha256.cc"
+
+# SRC="../proxy.cc"
+
+mkdir -p ./build
+cd ./build
+rm -f ./out
+g++ -O2 $COMPILER_FLAGS $SRC $LINKER_LIBRARIES
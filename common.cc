@@ -7,9 +7,9 @@ i32 hexdigit(u8 c){
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x10
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x20
 		 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1, // 0x30
-		-1, 10, 11, 12, 13, 14, 15, 16, -1, -1, -1, -1, -1, -1, -1, -1, // 0x40
+		-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x40
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x50
-		-1, 10, 11, 12, 13, 14, 15, 16, -1, -1, -1, -1, -1, -1, -1, -1, // 0x60
+		-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x60
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x70
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x80
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x90
@@ -23,57 +23,63 @@ i32 hexdigit(u8 c){
 	return hex_to_digit[c];
 }
 
-void hex_to_buffer(const char *hex, u8 *buf, i32 buflen){
-	if(hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
-		hex += 2;
+static
+StrSlice hex_skip_prefix(StrSlice hex){
+	if(hex.len >= 2 && hex.ptr[0] == '0' && (hex.ptr[1] == 'x' || hex.ptr[1] == 'X')){
+		hex.ptr += 2;
+		hex.len -= 2;
+	}
+	return hex;
+}
+
+i32 count_hex_digits(StrSlice hex){
+	hex = hex_skip_prefix(hex);
+	i32 result = 0;
+	while(result < hex.len && hexdigit(hex.ptr[result]) != -1)
+		result += 1;
+	return result;
+}
+
+void hex_to_buffer(StrSlice hex, u8 *buf, i32 buflen){
+	hex = hex_skip_prefix(hex);
 
 	memset(buf, 0, buflen);
-	const char *ptr = hex;
+	i32 pos = 0;
 	i32 i = 0;
-	while(*ptr && i < buflen){
-		i32 c0 = hexdigit(*ptr++);
+	while(pos < hex.len && i < buflen){
+		i32 c0 = hexdigit(hex.ptr[pos]);
+		if(c0 == -1)
+			break;
+		pos += 1;
+
 		i32 c1 = 0;
-		if(*ptr){
+		if(pos < hex.len && hexdigit(hex.ptr[pos]) != -1){
 			c1 = c0;
-			c0 = hexdigit(*ptr++);
+			c0 = hexdigit(hex.ptr[pos]);
+			pos += 1;
 		}
-		DEBUG_ASSERT(c0 != -1 && c1 != -1);
 		buf[i++] = (u8)(c1 << 4) | (u8)c0;
 	}
 }
 
-void hex_to_buffer_inv(const char *hex, u8 *buf, i32 buflen){
-	if(hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
-		hex += 2;
+void hex_to_buffer_inv(StrSlice hex, u8 *buf, i32 buflen){
+	hex = hex_skip_prefix(hex);
 
 	// now, to load `buf` in little endian order we need
 	// to start from the end of the hex string
-	const char *ptr = hex;
-	while(hexdigit(*ptr) != -1)
-		ptr += 1;
-	ptr -= 1;
+	i32 pos = count_hex_digits(hex) - 1;
 
 	memset(buf, 0, buflen);
 	i32 i = 0;
-	while(ptr >= hex && i < buflen){
-		i32 c0 = hexdigit(*ptr--);
+	while(pos >= 0 && i < buflen){
+		i32 c0 = hexdigit(hex.ptr[pos--]);
 		i32 c1 = 0;
-		if(ptr >= hex)
-			c1 = hexdigit(*ptr--);
-		DEBUG_ASSERT(c0 != -1 && c1 != -1);
+		if(pos >= 0)
+			c1 = hexdigit(hex.ptr[pos--]);
 		buf[i++] = (u8)(c1 << 4) | (u8)c0;
 	}
 }
 
-i32 count_hex_digits(const char *hex){
-	if(hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
-		hex += 2;
-	i32 result = 0;
-	while(hexdigit(*hex++) != -1)
-		result += 1;
-	return result;
-}
-
 void print_buf(const char *debug_name, u8 *buf, i32 buflen){
 	printf("buf (%s, len = %d):\n", debug_name, buflen);
 	for(i32 i = 0; i < buflen; i += 1){
@@ -24,6 +24,8 @@ typedef uint32_t	u32;
 typedef int64_t		i64;
 typedef uint64_t	u64;
 typedef size_t		usize;
+typedef float		f32;
+typedef double		f64;
 
 // arch settings
 #ifdef ARCH_X64
@@ -52,14 +54,23 @@ typedef size_t		usize;
 #endif
 
 // compiler settings
+// NOTE: TARGET_* lets a single function use instructions the rest of
+// the program isn't compiled for. It must only be called after checking
+// the matching cpu feature (see cpu_features).
 #if defined(_MSC_VER)
 #	define INLINE __forceinline
 #	define UNREACHABLE abort()
 #	define FALLTHROUGH ((void)0)
+#	define TARGET_AVX2
+#	define TARGET_AVX512
+#	define TARGET_SHA
 #elif defined(__GNUC__)
 #	define INLINE __attribute__((always_inline)) inline
 #	define UNREACHABLE abort()
 #	define FALLTHROUGH __attribute__((fallthrough))
+#	define TARGET_AVX2 __attribute__((target("avx2")))
+#	define TARGET_AVX512 __attribute__((target("avx512f")))
+#	define TARGET_SHA __attribute__((target("sha,sse4.1")))
 #else
 #	error "add compiler settings"
 #endif
@@ -71,11 +82,14 @@ typedef size_t		usize;
 #define BYTES_TO_BITS(x) (8 * (x))
 
 // TODO: logging
+// NOTE: __FUNCTION__ is a string literal on MSVC but a variable on GCC
+// so it can't be pasted into the format string.
 #include <stdio.h>
-#define LOG(...)		fprintf(stdout, __FUNCTION__ ": " __VA_ARGS__)
-#define LOG_ERROR(...)	fprintf(stdout, __FUNCTION__ ": " __VA_ARGS__)
+#define LOG(fmt, ...)		fprintf(stdout, "%s: " fmt, __FUNCTION__, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...)	fprintf(stdout, "%s: " fmt, __FUNCTION__, ##__VA_ARGS__)
 
-static INLINE
+// NOTE: GCC refuses to force inline variadic functions.
+static inline
 void fatal_error(const char *fmt, ...){
 	fprintf(stdout, "==== FATAL ERROR ====\n");
 	va_list ap;
@@ -85,16 +99,118 @@ void fatal_error(const char *fmt, ...){
 	exit(-1);
 }
 
-#define FATAL_ERROR(...) fatal_error(__FUNCTION__ ": " __VA_ARGS__)
+#define FATAL_ERROR(fmt, ...) fatal_error("%s: " fmt, __FUNCTION__, ##__VA_ARGS__)
 
 // ----------------------------------------------------------------
 // Utility - common.cc
 // ----------------------------------------------------------------
-void hex_to_buffer(const char *hex, u8 *buf, i32 buflen);
-void hex_to_buffer_inv(const char *hex, u8 *buf, i32 buflen);
-i32 count_hex_digits(const char *hex);
+
+// NOTE: A string that isn't necessarily null terminated, usually
+// pointing into a bigger buffer (like the JSON lexer tokens that point
+// into the message they came from).
+struct StrSlice{
+	const char *ptr;
+	i32 len;
+};
+
+static INLINE
+StrSlice str_slice(const char *str){
+	StrSlice result;
+	result.ptr = str;
+	result.len = (i32)strlen(str);
+	return result;
+}
+
+static INLINE
+bool str_slice_equals(StrSlice slice, const char *str){
+	return strncmp(slice.ptr, str, slice.len) == 0 && str[slice.len] == 0;
+}
+
+// NOTE: The hex decoders stop at the end of the slice or at the first
+// character that is not a hex digit, whichever comes first.
+void hex_to_buffer(StrSlice hex, u8 *buf, i32 buflen);
+void hex_to_buffer_inv(StrSlice hex, u8 *buf, i32 buflen);
+i32 count_hex_digits(StrSlice hex);
 void print_buf(const char *debug_name, u8 *buf, i32 buflen);
 
+static INLINE
+void hex_to_buffer(const char *hex, u8 *buf, i32 buflen){
+	hex_to_buffer(str_slice(hex), buf, buflen);
+}
+
+static INLINE
+void hex_to_buffer_inv(const char *hex, u8 *buf, i32 buflen){
+	hex_to_buffer_inv(str_slice(hex), buf, buflen);
+}
+
+static INLINE
+i32 count_hex_digits(const char *hex){
+	return count_hex_digits(str_slice(hex));
+}
+
+// ----------------------------------------------------------------
+// CPU - cpu.cc
+// ----------------------------------------------------------------
+struct CPU_Features{
+	bool ssse3;
+	bool sse41;
+	bool avx2;
+	bool avx512f;
+	bool sha_ni;
+};
+
+// NOTE: cpu_disable_features takes a comma separated list of features
+// to pretend aren't there ("ssse3", "sse41", "avx2", "avx512", "sha" or
+// "all"). It's meant for A/B benchmarking and must be called before the
+// hash kernels are bound (see blake2b_dispatch_init).
+const CPU_Features *cpu_features(void);
+bool cpu_disable_features(const char *list);
+void cpu_print_features(void);
+
+// NOTE: The cpus this process is allowed to run on and where they are.
+// Node numbers are renumbered to go from zero to num_nodes - 1 and
+// package/core are only meaningful for telling hyperthreads apart.
+#define CPU_MAX_CPUS	1024
+#define CPU_MAX_NODES	8
+
+struct CPU_Info{
+	i32 cpu;
+	i32 node;
+	i32 package;
+	i32 core;
+};
+
+struct CPU_Topology{
+	i32 num_cpus;
+	i32 num_nodes;
+	CPU_Info cpus[CPU_MAX_CPUS];
+};
+
+// NOTE: How solver threads get pinned to cpus. Compact fills a node
+// (and each core's hyperthreads) before moving on, scatter spreads
+// threads round robin over nodes and then over cores, and list uses
+// an explicit list of cpus in order.
+enum{
+	CPU_AFFINITY_NONE = 0,
+	CPU_AFFINITY_COMPACT,
+	CPU_AFFINITY_SCATTER,
+	CPU_AFFINITY_LIST,
+};
+
+// NOTE: cpu_parse_list parses lists like "0,2,4-7" (the linux cpulist
+// format) and returns the number of cpus or -1 if it's malformed.
+// cpu_affinity_order writes the order cpus should be handed out in for
+// the compact or scatter policy and returns how many were written.
+//	cpu_topology detects the topology on its first call, which isn't
+// thread safe, so it must first be called from the main thread before
+// any other thread is spawned. Everything after that can be called
+// from any thread.
+const CPU_Topology *cpu_topology(void);
+i32 cpu_node_of(i32 cpu);
+i32 cpu_parse_list(const char *str, i32 *out_cpus, i32 max_cpus);
+i32 cpu_affinity_order(i32 policy, i32 *out_cpus, i32 max_cpus);
+void cpu_print_topology(void);
+
 // ----------------------------------------------------------------
 // u256
 // ----------------------------------------------------------------
@@ -109,19 +225,29 @@ struct u256{
 // "AABB" hex string will translate to the 0xBBAA number.
 
 static INLINE
-u256 hex_be_to_u256(const char *hex){
+u256 hex_be_to_u256(StrSlice hex){
 	u256 result;
 	hex_to_buffer_inv(hex, result.data, 32);
 	return result;
 }
 
 static INLINE
-u256 hex_le_to_u256(const char *hex){
+u256 hex_le_to_u256(StrSlice hex){
 	u256 result;
 	hex_to_buffer(hex, result.data, 32);
 	return result;
 }
 
+static INLINE
+u256 hex_be_to_u256(const char *hex){
+	return hex_be_to_u256(str_slice(hex));
+}
+
+static INLINE
+u256 hex_le_to_u256(const char *hex){
+	return hex_le_to_u256(str_slice(hex));
+}
+
 static INLINE
 u256 compact_to_u256(u32 compact){
 	u8 num_bytes = (u8)(compact >> 24);
@@ -135,13 +261,31 @@ u256 compact_to_u256(u32 compact){
 	return result;
 }
 
+// NOTE: Returns the 64-bit word `i` of `a` where word 0 is the least
+// significant one.
+static INLINE
+u64 u256_word(const u256 &a, i32 i){
+	DEBUG_ASSERT(i >= 0 && i < 4);
+	u64 result;
+#if ARCH_BIG_ENDIAN
+	result = 0;
+	for(i32 j = 7; j >= 0; j -= 1)
+		result = (result << 8) | a.data[i * 8 + j];
+#else
+	memcpy(&result, &a.data[i * 8], 8);
+#endif
+	return result;
+}
+
+// NOTE: For pow checks the most significant word almost always
+// decides, so this usually exits after the first comparison.
 static
 bool operator>(const u256 &a, const u256 &b){
-	for(i32 i = 31; i >= 0; i -= 1){
-		if(a.data[i] > b.data[i])
-			return true;
-		if(a.data[i] < b.data[i])
-			return false;
+	for(i32 i = 3; i >= 0; i -= 1){
+		u64 aw = u256_word(a, i);
+		u64 bw = u256_word(b, i);
+		if(aw != bw)
+			return aw > bw;
 	}
 	return false;
 }
@@ -173,12 +317,70 @@ void blake2b_init_eh(blake2b_state *S, const char *personal, u32 N, u32 K);
 void blake2b_update(blake2b_state *S, u8 *in, u64 inlen);
 void blake2b_final(blake2b_state *S, u8 *out, u64 outlen);
 
+// NOTE: Every equihash blake is the same 140 bytes header followed by
+// a different 4 bytes little endian generator. The midstate caches the
+// state after the first block plus the 12 bytes tail of the header so
+// the final block can be compressed directly from the generator. It
+// must be initialized from a state that has absorbed exactly the 140
+// bytes header.
+//	blake2b_eh_generate_lanes does `num_lanes` consecutive generators
+// starting at `generator` and writes the output of lane `i` to
+// `out + i * outlen`. It uses AVX2 (4 lanes) or AVX-512 (8 lanes)
+// when available.
+struct blake2b_eh_midstate{
+	u64 h[8];
+	u64 m0;
+	u64 m1;
+	u64 t[2];
+	u64 outlen;
+};
+
+#define BLAKE2B_MAX_LANES 8
+void blake2b_eh_midstate_init(blake2b_eh_midstate *M, blake2b_state *S);
+void blake2b_eh_generate(blake2b_eh_midstate *M, u32 generator, u8 *out);
+void blake2b_eh_generate_lanes(blake2b_eh_midstate *M, u32 generator, i32 num_lanes, u8 *out);
+
+// NOTE: blake2b_dispatch_init binds blake2b_compress and the multi-lane
+// kernels to the best implementation supported by cpu_features that also
+// passes the known answer tests. Until it's called, everything runs on the
+// scalar implementations. blake2b_selftest runs the known answer tests on
+// every implementation supported by the cpu.
+void blake2b_dispatch_init(void);
+bool blake2b_selftest(void);
+
 // ----------------------------------------------------------------
 // SHA-256 - sha256.cc
 // ----------------------------------------------------------------
 u256 sha256(u8 *in, i32 inlen);
 u256 wsha256(u8 *in, i32 inlen);
 
+// NOTE: Double sha256 of `count` inputs of the same length `inlen`,
+// writing the digest of `in[i]` into `out[i]`. Inputs are hashed in
+// lockstep when a multi-buffer implementation is selected so this is
+// the one to use when checking many headers at once.
+void wsha256_many(u8 **in, i32 inlen, i32 count, u256 *out);
+
+// NOTE: The sha256 state after hashing a prefix made of whole 64 bytes
+// blocks. wsha256_many_midstate is the same as wsha256_many except that
+// every input is treated as if it was preceded by that prefix, so only
+// the part that changes between inputs needs to be hashed.
+struct sha256_midstate{
+	u32 h[8];
+	u64 len;
+};
+
+void sha256_midstate_init(sha256_midstate *M, u8 *in, i32 inlen);
+void wsha256_many_midstate(const sha256_midstate *M,
+		u8 **in, i32 inlen, i32 count, u256 *out);
+
+// NOTE: Same as blake2b_dispatch_init/blake2b_selftest but for
+// sha256_compress and wsha256_many. wsha256_bench reports the
+// throughput of every wsha256_many implementation supported by
+// the cpu on `num_headers` block headers.
+void sha256_dispatch_init(void);
+bool sha256_selftest(void);
+void wsha256_bench(i32 num_headers);
+
 // ----------------------------------------------------------------
 // Equihash - equihash.cc
 //	ZEC: personal = "ZcashPoW", N = 200, K = 9
@@ -223,9 +425,106 @@ EH_Solution hex_to_eh_solution(const char *hex){
 	return result;
 }
 
+// NOTE: How hashes are split into buckets. The bucket of a hash is picked
+// by the low bucket_bits of its first digit, slot ids (which back
+// references are made of) are slot_bits wide and bucket_slots is how many
+// slots a bucket has room for at each level (the output of init and of
+// every round but the last). Slots past that go to the spill area, up to
+// the 2^slot_bits slot ids. bucket_bits + 2 * slot_bits can be at most 40.
+//	Zero means the default for that field, which may depend on the others,
+// see eh_geometry_resolve.
+struct EH_Geometry{
+	i32 bucket_bits;
+	i32 slot_bits;
+	i32 bucket_slots[EH_K];
+};
+
+// NOTE: EH_Solver keeps its worker threads parked between solves so
+// it should be created once and reused for every nonce.
+struct EH_SolverConfig{
+	// NOTE: Zero means one thread per cpu core minus one
+	// thread that is left for the system.
+	i32 num_threads;
+
+	// NOTE: The best page mode (MEM_PAGES_* from memory.hh) to try
+	// for the solver arena. It will fall back to worse modes if it
+	// can't be satisfied, check eh_solver_page_mode.
+	i32 max_page_mode;
+
+	// NOTE: Number of buckets a thread takes at a time from the shared
+	// work cursor in each round. Smaller chunks balance better, bigger
+	// chunks touch the cursor less. Zero means the default.
+	i32 bucket_chunk_size;
+
+	// NOTE: Also log how long each thread worked and waited in each
+	// phase after every solve, instead of only the slowest ones.
+	bool thread_timings;
+
+	// NOTE: How solver threads are pinned (CPU_AFFINITY_* from the cpu
+	// section). With CPU_AFFINITY_LIST, thread i gets pinned to
+	// affinity_cpus[i % num_affinity_cpus]. Threads on different NUMA
+	// nodes own different ranges of buckets, see eh_solver_create.
+	//	Thread 0 is the thread calling eh_solver_create, which gets
+	// pinned too, so it should also be the one calling eh_solver_solve.
+	i32 affinity;
+	const i32 *affinity_cpus;
+	i32 num_affinity_cpus;
+
+	EH_Geometry geometry;
+
+	// NOTE: With adaptive_slots, the bucket slots of each level are
+	// resized between solves to the bucket fill seen in the solves before,
+	// starting from `geometry`. Both slot sets are kept within
+	// slots_budget bytes, or within what `geometry` takes if it's zero.
+	bool adaptive_slots;
+	usize slots_budget;
+};
+
+// NOTE: What happened to the slots of the last solve.
+struct EH_SolveStats{
+	i32 num_discarded_hashes;
+	i32 num_discarded_collisions;
+	i32 num_discarded_solutions;
+	i32 num_spilled_slots;
+};
+
+// NOTE: A solve that was started with a cancellation token stops soon
+// after the token is tripped (from any thread) and returns zero
+// solutions. Workers check it before taking each chunk of buckets, so
+// that is at most bucket_chunk_size buckets per thread after the trip.
+struct EH_CancelToken{
+	i32 tripped;
+};
+
+void eh_cancel_reset(EH_CancelToken *token);
+void eh_cancel_trip(EH_CancelToken *token);
+bool eh_cancel_is_tripped(EH_CancelToken *token);
+
+// NOTE: eh_geometry_resolve fills in the defaults and returns false if
+// the geometry can't work, in which case eh_solver_create would fail.
+// eh_solver_config_check logs why eh_solver_create would fail on the
+// geometry or the slot budget of `config` so it can be rejected up front.
+// eh_solver_memory_size is everything the solver allocated up front,
+// which is also all it uses.
+struct EH_Solver;
+bool eh_geometry_resolve(EH_Geometry *geometry);
+bool eh_solver_config_check(EH_SolverConfig *config);
+EH_SolverConfig eh_solver_default_config(void);
+EH_Solver *eh_solver_create(EH_SolverConfig *config);
+void eh_solver_destroy(EH_Solver *solver);
+i32 eh_solver_page_mode(EH_Solver *solver);
+usize eh_solver_memory_size(EH_Solver *solver);
+void eh_solver_last_stats(EH_Solver *solver, EH_SolveStats *out_stats);
+i32 eh_solver_solve(EH_Solver *solver, blake2b_state *base_state,
+		EH_Solution *sol_buffer, i32 max_sols, EH_CancelToken *cancel);
+
 i32 eh_solve(blake2b_state *base_state, EH_Solution *sol_buffer, i32 max_sols);
 bool eh_check_solution(blake2b_state *base_state, EH_Solution *solution);
 
+// NOTE: Reports how fast 8, 16, 32 and 64 threads can scatter slots
+// into the solver buckets with an atomic per slot versus staged.
+void eh_bench_scatter(void);
+
 // ----------------------------------------------------------------
 // BitcoinZ STRATUM - btcz_stratum.cc
 // ----------------------------------------------------------------
@@ -242,21 +541,49 @@ struct MiningParams{
 	i32 nonce1_bytes;
 	u256 nonce1;
 	u256 target;
+
+	// NOTE: When the notify that carried this job was received, in
+	// time_now_us units. Used to measure the job switch latency.
+	i64 notify_time_us;
+
+	// NOTE: The sequence number these params were published with, so
+	// each miner can tell on its own whether it has the latest ones.
+	i32 job_seq;
 };
 
+// NOTE: The session runs on its own network thread from connect until
+// close. New params are handed out by btcz_stratum_update_params and
+// solutions are queued by btcz_stratum_submit_solutions, neither of which
+// waits on the network. `cancel` is optional and gets tripped whenever
+// a new clean job arrives, after its params can be taken. A job that
+// isn't clean is only picked up by the next btcz_stratum_update_params
+// and solutions for the jobs before it are still submitted.
+//	Any number of miners can share a session, each with its own params
+// (initially a copy of `out_params`) and cancel token, added with
+// btcz_stratum_add_cancel.
+#define STRATUM_MAX_CANCEL 64
 struct STRATUM;
 STRATUM *btcz_stratum_connect(
 		const char *connect_addr,
 		const char *connect_port,
 		const char *user,
 		const char *password,
-		MiningParams *out_params);
+		MiningParams *out_params,
+		EH_CancelToken *cancel);
+void btcz_stratum_close(STRATUM *S);
 
-bool btcz_stratum_submit_solution(
-		STRATUM *S, MiningParams *params,
-		u256 nonce, EH_Solution solution);
+// NOTE: Solutions for the same nonce should be submitted together so
+// they can be sent together.
+bool btcz_stratum_submit_solutions(
+		STRATUM *S, MiningParams *params, u256 nonce,
+		EH_Solution *solutions, i32 num_solutions);
 
 bool btcz_stratum_update_params(
 		STRATUM *S, MiningParams *inout_params);
+bool btcz_stratum_add_cancel(STRATUM *S, EH_CancelToken *cancel);
+
+// NOTE: Replays recorded server sessions through the receive buffer and
+// message parsing, split in every way that matters.
+bool btcz_stratum_selftest(void);
 
 #endif //COMMON_HH_
@@ -0,0 +1,445 @@
+// NOTE: CPU feature detection for x64. The features reported here
+// are already checked against what the OS has enabled (XCR0) so any
+// feature set to true is safe to use.
+
+#include "common.hh"
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#elif defined(__GNUC__)
+#	include <cpuid.h>
+#endif
+
+#if PLATFORM_WINDOWS
+#	include <windows.h>
+#elif PLATFORM_LINUX
+#	include <sched.h>
+#endif
+
+static
+void cpu__cpuid(u32 leaf, u32 subleaf, u32 *regs){
+#if defined(_MSC_VER)
+	int tmp[4];
+	__cpuidex(tmp, (int)leaf, (int)subleaf);
+	regs[0] = (u32)tmp[0];
+	regs[1] = (u32)tmp[1];
+	regs[2] = (u32)tmp[2];
+	regs[3] = (u32)tmp[3];
+#elif defined(__GNUC__)
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static
+u64 cpu__xgetbv(u32 index){
+#if defined(_MSC_VER)
+	return _xgetbv(index);
+#elif defined(__GNUC__)
+	u32 eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return ((u64)edx << 32) | eax;
+#endif
+}
+
+static
+CPU_Features cpu__detect_features(void){
+	CPU_Features result = {};
+
+	u32 regs[4];
+	cpu__cpuid(0, 0, regs);
+	u32 max_leaf = regs[0];
+	if(max_leaf < 1)
+		return result;
+
+	cpu__cpuid(1, 0, regs);
+	u32 leaf1_ecx = regs[2];
+	result.ssse3 = (leaf1_ecx & (1 << 9)) != 0;
+	result.sse41 = (leaf1_ecx & (1 << 19)) != 0;
+
+	// NOTE: AVX state (YMM) must be enabled by the OS and AVX-512 state
+	// (opmask, ZMM_Hi256, Hi16_ZMM) too, otherwise using them will fault.
+	bool osxsave = (leaf1_ecx & (1 << 27)) != 0;
+	bool avx = (leaf1_ecx & (1 << 28)) != 0;
+	u64 xcr0 = osxsave ? cpu__xgetbv(0) : 0;
+	bool os_ymm = (xcr0 & 0x06) == 0x06;
+	bool os_zmm = (xcr0 & 0xE6) == 0xE6;
+
+	if(max_leaf >= 7){
+		cpu__cpuid(7, 0, regs);
+		u32 leaf7_ebx = regs[1];
+		result.avx2 = avx && os_ymm && (leaf7_ebx & (1 << 5)) != 0;
+		result.avx512f = os_zmm && (leaf7_ebx & (1 << 16)) != 0;
+		result.sha_ni = (leaf7_ebx & (1 << 29)) != 0;
+	}
+	return result;
+}
+
+// NOTE: Features are detected once on the first call to cpu_features,
+// which should happen at startup before any other threads exist.
+static bool cpu__initialized = false;
+static CPU_Features cpu__features;
+
+const CPU_Features *cpu_features(void){
+	if(!cpu__initialized){
+		cpu__features = cpu__detect_features();
+		cpu__initialized = true;
+	}
+	return &cpu__features;
+}
+
+bool cpu_disable_features(const char *list){
+	// NOTE: Make sure we have detected features before, or the
+	// detection would overwrite whatever we disable here.
+	cpu_features();
+
+	const char *ptr = list;
+	while(*ptr){
+		const char *end = ptr;
+		while(*end && *end != ',')
+			end += 1;
+
+		usize len = (usize)(end - ptr);
+		if(len == 3 && strncmp(ptr, "all", len) == 0){
+			memset(&cpu__features, 0, sizeof(CPU_Features));
+		}else if(len == 5 && strncmp(ptr, "ssse3", len) == 0){
+			cpu__features.ssse3 = false;
+		}else if(len == 5 && strncmp(ptr, "sse41", len) == 0){
+			cpu__features.sse41 = false;
+		}else if(len == 4 && strncmp(ptr, "avx2", len) == 0){
+			cpu__features.avx2 = false;
+		}else if(len == 6 && strncmp(ptr, "avx512", len) == 0){
+			cpu__features.avx512f = false;
+		}else if(len == 3 && strncmp(ptr, "sha", len) == 0){
+			cpu__features.sha_ni = false;
+		}else if(len > 0){
+			LOG_ERROR("unknown cpu feature \"%.*s\"\n", (int)len, ptr);
+			return false;
+		}
+
+		ptr = (*end == ',') ? end + 1 : end;
+	}
+	return true;
+}
+
+void cpu_print_features(void){
+	const CPU_Features *cpu = cpu_features();
+	LOG("cpu features: ssse3=%d sse41=%d avx2=%d avx512f=%d sha_ni=%d\n",
+		cpu->ssse3, cpu->sse41, cpu->avx2, cpu->avx512f, cpu->sha_ni);
+}
+
+// ----------------------------------------------------------------
+// topology
+// ----------------------------------------------------------------
+
+i32 cpu_parse_list(const char *str, i32 *out_cpus, i32 max_cpus){
+	i32 num_cpus = 0;
+	const char *ptr = str;
+	while(*ptr && *ptr != '\n'){
+		char *end;
+		long first = strtol(ptr, &end, 10);
+		if(end == ptr || first < 0)
+			return -1;
+		long last = first;
+		ptr = end;
+		if(*ptr == '-'){
+			last = strtol(ptr + 1, &end, 10);
+			if(end == ptr + 1 || last < first)
+				return -1;
+			ptr = end;
+		}
+
+		for(long cpu = first; cpu <= last; cpu += 1){
+			if(num_cpus >= max_cpus)
+				return -1;
+			out_cpus[num_cpus] = (i32)cpu;
+			num_cpus += 1;
+		}
+
+		if(*ptr == ',')
+			ptr += 1;
+		else if(*ptr && *ptr != '\n')
+			return -1;
+	}
+	return num_cpus;
+}
+
+static
+CPU_Info *cpu__topology_find(CPU_Topology *topo, i32 cpu){
+	for(i32 i = 0; i < topo->num_cpus; i += 1){
+		if(topo->cpus[i].cpu == cpu)
+			return &topo->cpus[i];
+	}
+	return NULL;
+}
+
+#if PLATFORM_WINDOWS
+
+// NOTE: Only processor group 0 (the first 64 cpus) is considered, which
+// is also all thread_set_affinity can pin to.
+static
+void cpu__detect_topology(CPU_Topology *topo){
+	DWORD_PTR process_mask, system_mask;
+	if(!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+		process_mask = 1;
+	for(i32 cpu = 0; cpu < 64 && topo->num_cpus < CPU_MAX_CPUS; cpu += 1){
+		if(process_mask & ((DWORD_PTR)1 << cpu)){
+			CPU_Info *info = &topo->cpus[topo->num_cpus];
+			info->cpu = cpu;
+			info->node = 0;
+			info->package = 0;
+			info->core = cpu;
+			topo->num_cpus += 1;
+		}
+	}
+
+	DWORD len = 0;
+	GetLogicalProcessorInformation(NULL, &len);
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *slpi =
+		(SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)malloc(len);
+	if(slpi && GetLogicalProcessorInformation(slpi, &len)){
+		i32 num_entries = (i32)(len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+		i32 core_id = 0;
+		i32 package_id = 0;
+		for(i32 i = 0; i < num_entries; i += 1){
+			i32 value;
+			if(slpi[i].Relationship == RelationProcessorCore){
+				value = core_id++;
+			}else if(slpi[i].Relationship == RelationProcessorPackage){
+				value = package_id++;
+			}else if(slpi[i].Relationship == RelationNumaNode){
+				value = (i32)slpi[i].NumaNode.NodeNumber;
+			}else{
+				continue;
+			}
+
+			for(i32 cpu = 0; cpu < 64; cpu += 1){
+				CPU_Info *info;
+				if(!(slpi[i].ProcessorMask & ((ULONG_PTR)1 << cpu))
+				|| !(info = cpu__topology_find(topo, cpu)))
+					continue;
+				if(slpi[i].Relationship == RelationProcessorCore)
+					info->core = value;
+				else if(slpi[i].Relationship == RelationProcessorPackage)
+					info->package = value;
+				else
+					info->node = value;
+			}
+		}
+	}
+	free(slpi);
+}
+
+#elif PLATFORM_LINUX
+
+static
+i32 cpu__read_sysfs_int(const char *path, i32 default_value){
+	i32 result = default_value;
+	FILE *f = fopen(path, "r");
+	if(f){
+		if(fscanf(f, "%d", &result) != 1)
+			result = default_value;
+		fclose(f);
+	}
+	return result;
+}
+
+static
+void cpu__detect_topology(CPU_Topology *topo){
+	cpu_set_t set;
+	if(sched_getaffinity(0, sizeof(set), &set) != 0){
+		CPU_ZERO(&set);
+		CPU_SET(0, &set);
+	}
+
+	char path[256];
+	for(i32 cpu = 0; cpu < CPU_SETSIZE && topo->num_cpus < CPU_MAX_CPUS; cpu += 1){
+		if(!CPU_ISSET(cpu, &set))
+			continue;
+		CPU_Info *info = &topo->cpus[topo->num_cpus];
+		info->cpu = cpu;
+		info->node = 0;
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		info->package = cpu__read_sysfs_int(path, 0);
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		info->core = cpu__read_sysfs_int(path, cpu);
+		topo->num_cpus += 1;
+	}
+
+	// NOTE: Node ids may have holes so we look at a few past the
+	// last one we found before giving up.
+	i32 misses = 0;
+	for(i32 node = 0; misses < 16; node += 1){
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = fopen(path, "r");
+		if(!f){
+			misses += 1;
+			continue;
+		}
+		misses = 0;
+
+		char line[4096];
+		i32 node_cpus[CPU_MAX_CPUS];
+		i32 num_node_cpus = -1;
+		if(fgets(line, sizeof(line), f))
+			num_node_cpus = cpu_parse_list(line, node_cpus, CPU_MAX_CPUS);
+		fclose(f);
+		for(i32 i = 0; i < num_node_cpus; i += 1){
+			CPU_Info *info = cpu__topology_find(topo, node_cpus[i]);
+			if(info)
+				info->node = node;
+		}
+	}
+}
+
+#endif
+
+// NOTE: The topology is detected on the first call and never changes
+// after that. The first call isn't synchronized so it has to happen
+// before any other thread could make it, see main.
+static bool cpu__topology_initialized = false;
+static CPU_Topology cpu__topology;
+
+const CPU_Topology *cpu_topology(void){
+	if(!cpu__topology_initialized){
+		CPU_Topology *topo = &cpu__topology;
+		topo->num_cpus = 0;
+		cpu__detect_topology(topo);
+
+		// NOTE: Renumber nodes so they go from zero to num_nodes - 1,
+		// counting only the nodes we have cpus on.
+		i32 node_ids[CPU_MAX_NODES];
+		topo->num_nodes = 0;
+		for(i32 i = 0; i < topo->num_cpus; i += 1){
+			i32 node = 0;
+			while(node < topo->num_nodes && node_ids[node] != topo->cpus[i].node)
+				node += 1;
+			if(node == topo->num_nodes){
+				if(topo->num_nodes < CPU_MAX_NODES){
+					node_ids[node] = topo->cpus[i].node;
+					topo->num_nodes += 1;
+				}else{
+					node = CPU_MAX_NODES - 1;
+				}
+			}
+			topo->cpus[i].node = node;
+		}
+		if(topo->num_nodes == 0)
+			topo->num_nodes = 1;
+		cpu__topology_initialized = true;
+	}
+	return &cpu__topology;
+}
+
+i32 cpu_node_of(i32 cpu){
+	const CPU_Topology *topo = cpu_topology();
+	for(i32 i = 0; i < topo->num_cpus; i += 1){
+		if(topo->cpus[i].cpu == cpu)
+			return topo->cpus[i].node;
+	}
+	return 0;
+}
+
+// NOTE: Compact goes through the cpus of a node before moving to the next
+// one, with hyperthreads of the same core next to each other. Scatter
+// goes round robin through the nodes and, inside each node, through every
+// core before using their second hyperthread.
+#define CPU_AFFINITY_KEY_LEN 4
+
+static
+bool cpu__same_core(const CPU_Info *a, const CPU_Info *b){
+	return a->package == b->package && a->core == b->core;
+}
+
+static
+void cpu__affinity_key(const CPU_Topology *topo, const CPU_Info *info,
+		i32 policy, i32 *out_key){
+	if(policy == CPU_AFFINITY_COMPACT){
+		out_key[0] = info->node;
+		out_key[1] = info->package;
+		out_key[2] = info->core;
+		out_key[3] = info->cpu;
+		return;
+	}
+
+	// NOTE: A cpu's sibling rank is how many hyperthreads of the same core
+	// come before it and its core rank is how many cores of the same node
+	// come before its core.
+	i32 sibling_rank = 0;
+	i32 core_rank = 0;
+	for(i32 i = 0; i < topo->num_cpus; i += 1){
+		const CPU_Info *other = &topo->cpus[i];
+		if(other->node != info->node)
+			continue;
+		if(cpu__same_core(other, info)){
+			if(other->cpu < info->cpu)
+				sibling_rank += 1;
+		}else if(other->package < info->package
+				|| (other->package == info->package && other->core < info->core)){
+			bool first_of_core = true;
+			for(i32 j = 0; j < i; j += 1){
+				if(cpu__same_core(&topo->cpus[j], other)){
+					first_of_core = false;
+					break;
+				}
+			}
+			if(first_of_core)
+				core_rank += 1;
+		}
+	}
+	out_key[0] = sibling_rank;
+	out_key[1] = core_rank;
+	out_key[2] = info->node;
+	out_key[3] = info->cpu;
+}
+
+static
+bool cpu__key_less(const i32 *a, const i32 *b){
+	for(i32 i = 0; i < CPU_AFFINITY_KEY_LEN; i += 1){
+		if(a[i] != b[i])
+			return a[i] < b[i];
+	}
+	return false;
+}
+
+i32 cpu_affinity_order(i32 policy, i32 *out_cpus, i32 max_cpus){
+	const CPU_Topology *topo = cpu_topology();
+	if(policy != CPU_AFFINITY_COMPACT && policy != CPU_AFFINITY_SCATTER)
+		return 0;
+
+	// NOTE: Insertion sort on the keys, there are only so many cpus.
+	// The keys are on the stack because miners create their solvers
+	// from different threads at the same time.
+	i32 keys[CPU_MAX_CPUS][CPU_AFFINITY_KEY_LEN];
+	i32 num_cpus = 0;
+	for(i32 i = 0; i < topo->num_cpus && num_cpus < max_cpus; i += 1){
+		i32 key[CPU_AFFINITY_KEY_LEN];
+		cpu__affinity_key(topo, &topo->cpus[i], policy, key);
+		i32 j = num_cpus;
+		while(j > 0 && cpu__key_less(key, keys[j - 1])){
+			memcpy(keys[j], keys[j - 1], sizeof(key));
+			out_cpus[j] = out_cpus[j - 1];
+			j -= 1;
+		}
+		memcpy(keys[j], key, sizeof(key));
+		out_cpus[j] = topo->cpus[i].cpu;
+		num_cpus += 1;
+	}
+	return num_cpus;
+}
+
+void cpu_print_topology(void){
+	const CPU_Topology *topo = cpu_topology();
+	LOG("cpu topology: %d cpus, %d numa nodes\n", topo->num_cpus, topo->num_nodes);
+	for(i32 node = 0; node < topo->num_nodes; node += 1){
+		char line[512];
+		i32 len = 0;
+		for(i32 i = 0; i < topo->num_cpus && len < (i32)sizeof(line) - 16; i += 1){
+			if(topo->cpus[i].node == node)
+				len += snprintf(line + len, sizeof(line) - len, " %d", topo->cpus[i].cpu);
+		}
+		line[len] = 0;
+		LOG("\tnode %d:%s\n", node, line);
+	}
+}
@@ -2,6 +2,7 @@
 
 #include "common.hh"
 #include "buffer_util.hh"
+#include "memory.hh"
 
 // TODO: PartialJoin is a weird name for this but StepRow
 // isn't any good either. Come up with something else.
@@ -249,10 +250,16 @@ i32 eh_solve(blake2b_state *base_state, EH_Solution *sol_buffer, i32 max_sols){
 	// do on Linux where the kernel only assigns memory pages when you touch
 	// the memory but requires extra steps on Windows with VirtualAlloc(MEM_COMMIT).
 
+	// NOTE: Both arrays are accessed all over the place by the merge sort
+	// so we want them on huge pages whenever possible.
 	float extra_room = 1.05f; // 5% should work for now
 	i32 total_slots = (i32)(EH_RANGE * extra_room);
-	PartialJoin *partial = (PartialJoin*)malloc(total_slots * sizeof(PartialJoin));
-	PartialJoin *aux = (PartialJoin*)malloc(total_slots * sizeof(PartialJoin));
+	MemPages partial_pages = mem_alloc_pages(
+		total_slots * sizeof(PartialJoin), MEM_PAGES_HUGE_1GB);
+	MemPages aux_pages = mem_alloc_pages(
+		total_slots * sizeof(PartialJoin), MEM_PAGES_HUGE_1GB);
+	PartialJoin *partial = (PartialJoin*)partial_pages.ptr;
+	PartialJoin *aux = (PartialJoin*)aux_pages.ptr;
 
 	i32 num_partial = 0;
 	for(i32 i = 0; num_partial < EH_RANGE; i += 1){
@@ -330,8 +337,8 @@ i32 eh_solve(blake2b_state *base_state, EH_Solution *sol_buffer, i32 max_sols){
 		i += j;
 	}
 
-	free(partial);
-	free(aux);
+	mem_free_pages(&partial_pages);
+	mem_free_pages(&aux_pages);
 	return num_sols;
 }
 
@@ -1,13 +1,14 @@
 
 #include "common.hh"
 #include "buffer_util.hh"
+#include "memory.hh"
 #include "thread.hh"
 
-#define EH_BUCKET_BITS			((EH_HASH_DIGIT_BITS * 3) / 5)
-#define EH_BUCKET_MASK			((1 << EH_BUCKET_BITS) - 1)
-#define	EH_NUM_BUCKETS			(1 << EH_BUCKET_BITS)
-
-#define EH_OTHER_BITS			(EH_HASH_DIGIT_BITS - EH_BUCKET_BITS)
+// NOTE: These are only the defaults. The solver takes its geometry at
+// creation (see EH_Geometry and eh_layout_init) so different settings
+// can be compared on the same build, with --bench-geometry. The notes
+// below still call them by their old macro names.
+#define EH_DEFAULT_BUCKET_BITS	(EH_HASH_DIGIT_BITS / 2)
 
 // NOTE: The number of bucket slots can be calculated as follows:
 //	num_bucket_slots = extra_room * (EH_RANGE / EH_NUM_BUCKETS)
@@ -37,11 +38,31 @@
 // This will make us discard more collisions but will consume a lot less memory
 // and will be a little faster (haven't measured but it seems to be faster and
 // it makes sense because the program requires less bandwidth).
-//#define EH_SLOT_BITS			(EH_OTHER_BITS + 1)
-
-#define EH_SLOT_BITS			(EH_OTHER_BITS + 2)
-#define EH_SLOT_MASK			((1 << EH_SLOT_BITS) - 1)
-#define EH_NUM_BUCKET_SLOTS		(1 << EH_SLOT_BITS)
+//#define EH_DEFAULT_SLOT_BITS	(EH_HASH_DIGIT_BITS - EH_DEFAULT_BUCKET_BITS + 1)
+
+#define EH_DEFAULT_SLOT_BITS	(EH_HASH_DIGIT_BITS - EH_DEFAULT_BUCKET_BITS + 2)
+
+// NOTE: Slot ids are still EH_SLOT_BITS wide but buckets only have room
+// for three quarters of them (an extra_room of 1.5). Whatever goes past
+// that takes the ids that are left from a spill area shared by all
+// buckets (see EH_Spill) instead of being discarded, so the few buckets
+// that get unlucky don't need every other bucket to carry the same room.
+#define EH_DEFAULT_BUCKET_SLOTS_PERCENT 75
+
+// NOTE: We used to have EH_BUCKET_BITS = (EH_HASH_DIGIT_BITS * 3) / 5 which
+// for BTCZ gives 2^20 buckets of 64 slots. That makes every bucket fit in L1
+// but it also means that every slot pushed has to do an atomic_add on one of
+// 2^20 counters, which is where most of the time went with many threads.
+//	With half of the digit bits we get 2^12 buckets of 2^14 slots instead.
+// Buckets are now big enough that threads can stage their output per bucket
+// (see EH_Stage) and reserve space for many slots at once. The bigger buckets
+// also even out the statistical edge cases discussed above since each bucket
+// takes the average of a lot more hashes. References need more than 32 bits
+// now (12 + 2 * 14) but those already have room for 64 bits.
+
+// NOTE: Bucket counters are padded to a cache line each so that threads
+// reserving space in neighbouring buckets don't fight over the same line.
+#define EH_COUNTER_STRIDE		(64 / (i32)sizeof(i32))
 
 #define EH_LAST_ROUND			(EH_K - 1)
 
@@ -107,21 +128,148 @@
 //	  round 3 = [E  F  3l 3h 1l 1h I] <- [D  E  F  2l 2h 0l 0h]
 //	  round 4 = [E  F  3l 3h 1l 1h I] -> [we don't output at the last round]
 //
-struct EH_Slot{
-	u32 data[EH_HASH_DIGITS + 1];
+//	That was with u32 slots of 7 words, with digits and references side by
+// side, so every collision scan also dragged the references through the
+// cache. Now each bucket is split in blocks of bucket_slots entries
+// instead: first the digits of every slot and then one block of references
+// per level ("level" being init for level 0 and the output of round r for
+// level r + 1), stacked from the end of the bucket like they used to be
+// stacked from the end of the slot. Everything is byte packed: digits take
+// EH_HASH_DIGIT_BYTES (3 for BTCZ), references EH_REF_BYTES (5, for the
+// 12 + 14 + 14 bits of bucket_id, s0 and s1) and the index EH_INDEX_BYTES.
+// The digits of a level are packed with only the digits it has left, so
+// each round only goes through the digits it needs. For BTCZ, in bytes per
+// slot of each block:
+//	                   set 0 (22 bytes)          set 1 (20 bytes)
+//	  init    = [A B C D E F       I]
+//	  round 0 =                          -> [B C D E F     0]
+//	  round 1 = [C D E F  .  1     I] <-
+//	  round 2 =                          -> [D E F  .  2   0]
+//	  round 3 = [E F  .   3  1     I] <-
+//
+//	So that's 42 bytes for both sets instead of 56. The gaps (.) are left
+// alone and the digits of each level only overwrite blocks that the levels
+// still needed don't use.
+//	Digits are stored in little endian order so the first one can be read
+// with an unaligned u32 load. The digits block is always followed by some
+// other block so that load never goes past the end of the bucket.
+#define EH_REF_BYTES			5
+#define EH_INDEX_BYTES			4
+#define EH_NUM_LEVELS			(EH_LAST_ROUND + 1)
+#define EH_MAX_SLOT_BYTES		(EH_HASH_DIGITS * EH_HASH_DIGIT_BYTES + EH_INDEX_BYTES)
+
+static_assert(EH_DEFAULT_BUCKET_BITS + 2 * EH_DEFAULT_SLOT_BITS <= 8 * EH_REF_BYTES, "");
+static_assert(EH_SOLUTION_INDEX_BITS <= 8 * EH_INDEX_BYTES, "");
+static_assert(EH_NUM_LEVELS == EH_K, "one EH_Geometry::bucket_slots per level");
+
+// NOTE: The bucket geometry and where each level goes, see eh_layout_init.
+// The digits of a level start at the beginning of the bucket and its
+// references at refs_offset[level] bytes into it.
+struct EH_SlotLayout{
+	i32 bucket_bits;
+	u32 bucket_mask;
+	i32 num_buckets;
+	i32 other_bits;
+	i32 slot_bits;
+	u32 slot_mask;
+	i32 num_slot_ids;
+
+	usize bucket_size[2];
+	i32 bucket_slots[EH_NUM_LEVELS];
+	usize refs_offset[EH_NUM_LEVELS];
+
+	// NOTE: How many spill pages a bucket can take at each level and how
+	// many slots it can hold with them, see EH_Spill.
+	i32 spill_pages[EH_NUM_LEVELS];
+	i32 max_slots[EH_NUM_LEVELS];
+	i32 spill_table_stride;
+
+	// NOTE: Bucket fills are counted in bins of 1 << fill_bin_shift
+	// slots, see EH_FILL_BINS.
+	i32 fill_bin_shift;
 };
 
 #define EH_INPUT_IDX(round)		((round) & 1)
 #define EH_OUTPUT_IDX(round)	(1 - ((round) & 1))
 
+// NOTE: A solve is split into phases separated by barriers: init, one
+// phase per round and the last round.
+#define EH_PHASE_INIT			0
+#define EH_PHASE_ROUND(round)	(1 + (round))
+#define EH_PHASE_LAST			EH_PHASE_ROUND(EH_LAST_ROUND)
+#define EH_NUM_PHASES			(EH_PHASE_LAST + 1)
+
+// NOTE: Work is handed out in chunks from a shared cursor per phase
+// instead of statically by thread id, so a thread that gets slowed
+// down (by fuller buckets or by the OS taking its core) just ends up
+// taking fewer chunks instead of holding everyone at the barrier.
+// Init chunks are in groups of BLAKE2B_MAX_LANES blakes.
+#define EH_DEFAULT_BUCKET_CHUNK	4
+#define EH_INIT_CHUNK			256
+
+// NOTE: Slots pushed past the end of their bucket go to spill pages of
+// EH_SPILL_PAGE_SLOTS slots each, taken from a pool shared by every bucket
+// and level, and keep their slot ids (bucket_slots and up). Each level has
+// its own page table so the spilled slots of earlier levels are still
+// there for eh_get_indices. A page holds the slots of a single level, all
+// the digits first and then all the references. Pages are only taken when
+// a bucket actually overflows and the pool is reset on every solve.
+#define EH_SPILL_PAGE_BITS		10
+#define EH_SPILL_PAGE_SLOTS		(1 << EH_SPILL_PAGE_BITS)
+#define EH_SPILL_PAGE_MASK		(EH_SPILL_PAGE_SLOTS - 1)
+#define EH_SPILL_PAGE_SIZE		(EH_SPILL_PAGE_SLOTS * EH_MAX_SLOT_BYTES)
+#define EH_MAX_BUCKET_SPILL_PAGES	16
+#define EH_NUM_SPILL_PAGES		1024
+
+// NOTE: Every thread counts how full each bucket it reads back was, per
+// level, in EH_FILL_BINS bins that cover the slot ids. With
+// EH_SolverConfig::adaptive_slots, thread 0 merges these after each solve
+// into a running histogram per level where older solves fade by
+// EH_FILL_DECAY, and sets each level's capacity to the fill that all but
+// EH_FILL_OVERFLOW_PPM buckets per million stayed under. The few buckets
+// above it go to spill pages. If that doesn't fit in the slot budget every
+// level is scaled down evenly, see eh_solver_adapt_slots.
+#define EH_FILL_BIN_BITS		9
+#define EH_FILL_BINS			(1 << EH_FILL_BIN_BITS)
+#define EH_FILL_DECAY			0.75
+#define EH_FILL_OVERFLOW_PPM	1000
+
+struct EH_Spill{
+	u8 *pages;
+	i32 num_pages_taken;
+
+	// NOTE: The page taken by each level, bucket and spill page of the
+	// bucket, or -1 if there is none. See eh_spill_table_index.
+	i32 *page_table;
+	i32 page_table_size;
+};
+
 struct EH_State{
-	blake2b_state *base_state;
+	blake2b_eh_midstate midstate;
 	i32 num_threads;
+	i32 bucket_chunk_size;
+
+	// NOTE: Buckets are split between NUMA nodes in proportion to the
+	// number of threads on each node, with node n owning the buckets
+	// in [node_bucket_begin[n], node_bucket_begin[n + 1]). Threads only
+	// go to the buckets of other nodes once their own are done. Without
+	// pinning everything is a single node.
+	i32 num_nodes;
+	i32 node_bucket_begin[CPU_MAX_NODES + 1];
+
+	// NOTE: One cursor per node and phase, padded to a cache line each
+	// like the bucket counters. The init phase only uses node zero's.
+	i32 work_cursor[EH_NUM_PHASES][CPU_MAX_NODES][16];
+
+	// NOTE: Optional, can be tripped from any thread at any time.
+	EH_CancelToken *cancel;
 
 	i32 *num_slots_taken[2];
 	// TODO: Maybe this should be called "slot_pool" or
 	// something instead of only "slots".
-	EH_Slot *slots[2];
+	u8 *slots[2];
+	EH_SlotLayout layout;
+	EH_Spill spill;
 
 	i32 max_sols;
 	i32 num_sols;
@@ -131,13 +279,68 @@ struct EH_State{
 	i32 num_discarded_hashes;
 	i32 num_discarded_collisions;
 	i32 num_discarded_solutions;
+	i32 num_spilled_slots;
 };
 
+struct EH_Stage;
+struct EH_Collisions;
 struct EH_ThreadContext{
+	EH_Solver *solver;
 	EH_State *eh;
 	barrier_t *barrier;
 	i32 thread_id;
 	thread_t thread_handle;
+
+	// NOTE: The cpu this thread is pinned to (-1 if it isn't) and the
+	// solver node it belongs to. Each thread also first touches its
+	// share of the buckets of its node, see eh_thread_setup.
+	i32 cpu;
+	i32 node;
+	i32 touch_bucket_begin;
+	i32 touch_bucket_end;
+
+	// NOTE: Per thread scratch memory, see eh_solver_create. The stage
+	// and collisions are placed in it by eh_thread_setup.
+	u8 *scratch;
+	EH_Stage *stage;
+	EH_Collisions *collisions;
+
+	// NOTE: Time spent working on each phase of the last solve and
+	// when the work ended. Both are written before the barrier that ends
+	// the phase so thread 0 can read them right after it. How long a
+	// thread then waited is how much later the last thread arrived, see
+	// eh_print_timings.
+	i64 busy_us[EH_NUM_PHASES];
+	i64 end_us[EH_NUM_PHASES];
+
+	// NOTE: Bucket fill histogram of each level for the current solve.
+	i32 fill_bins[EH_NUM_LEVELS][EH_FILL_BINS];
+};
+
+// NOTE: The solver arena holds both sets of buckets plus their
+// counters. It is allocated and pre-faulted once in eh_solver_create
+// and reused for every solve. Slot contents are always written before
+// being read so only the counters need to be reset between solves.
+struct EH_Solver{
+	i32 num_threads;
+	barrier_t barrier;
+	bool quit;
+
+	bool thread_timings;
+
+	MemPages arena;
+	MemPages thread_arena;
+
+	EH_State eh;
+	EH_ThreadContext *thr_context;
+
+	// NOTE: The geometry the current layout was made from and how much
+	// of the arena both slot sets can take, which is more than the layout
+	// uses when adaptive_slots can grow it. See EH_FILL_BINS.
+	bool adaptive_slots;
+	EH_Geometry geometry;
+	usize slots_capacity;
+	f64 fill_histogram[EH_NUM_LEVELS][EH_FILL_BINS];
 };
 
 static
@@ -205,33 +408,270 @@ void unpack_uints(i32 uint_bits,
 }
 
 static
-void eh_generate_blake(blake2b_state *base_state,
-		i32 generator, u8 *out, i32 outlen){
-	u32 le_generator = u32_cpu_to_le(generator);
-	blake2b_state extended_state = *base_state;
-	blake2b_update(&extended_state, (u8*)&le_generator, 4);
-	blake2b_final(&extended_state, out, outlen);
+u8 *eh_get_bucket(u8 *slots, usize bucket_size, i32 bucket_id){
+	return slots + (usize)bucket_id * bucket_size;
+}
+
+// NOTE: The fill is counted before clamping so buckets that overflowed
+// still show how many slots they would have needed.
+static INLINE
+i32 eh_get_num_slots_taken(i32 *num_slots_taken, i32 bucket_id, i32 max_slots,
+		i32 *fill_bins, i32 fill_bin_shift){
+	i32 result = atomic_exchange(&num_slots_taken[bucket_id * EH_COUNTER_STRIDE], 0);
+	i32 bin = result >> fill_bin_shift;
+	fill_bins[(bin < EH_FILL_BINS) ? bin : (EH_FILL_BINS - 1)] += 1;
+	if(result > max_slots)
+		result = max_slots;
+	return result;
+}
+
+static INLINE
+i32 eh_spill_table_index(EH_SlotLayout *layout, i32 level, i32 bucket_id, i32 page_num){
+	DEBUG_ASSERT(page_num < layout->spill_pages[level]);
+	return (level * layout->num_buckets + bucket_id) * layout->spill_table_stride + page_num;
 }
 
+// NOTE: Returns the page in `entry`, taking a new one from the pool if
+// there is none yet, or NULL if the pool ran out. When two threads race
+// for the same entry the page of the one that loses is wasted, which is
+// fine since it only happens to buckets that are already overflowing.
 static
-EH_Slot *eh_get_bucket(EH_Slot *slots, i32 bucket_id){
-	return slots + bucket_id * EH_NUM_BUCKET_SLOTS;
+u8 *eh_spill_take_page(EH_Spill *spill, i32 *entry){
+	i32 page = atomic_load(entry);
+	if(page < 0){
+		i32 new_page = atomic_add(&spill->num_pages_taken, 1);
+		if(new_page < EH_NUM_SPILL_PAGES){
+			page = atomic_compare_exchange(entry, -1, new_page);
+			if(page < 0)
+				page = new_page;
+		}else{
+			page = atomic_load(entry);
+			if(page < 0)
+				return NULL;
+		}
+	}
+	return spill->pages + (usize)page * EH_SPILL_PAGE_SIZE;
+}
+
+// NOTE: Returns spill page `page_num` of a bucket or NULL if it wasn't
+// taken. Only valid once the level is done being written.
+static INLINE
+u8 *eh_spill_get_page(EH_Spill *spill, EH_SlotLayout *layout,
+		i32 level, i32 bucket_id, i32 page_num){
+	i32 page = spill->page_table[eh_spill_table_index(layout, level, bucket_id, page_num)];
+	if(page < 0)
+		return NULL;
+	return spill->pages + (usize)page * EH_SPILL_PAGE_SIZE;
 }
 
+// NOTE: Slots aren't written to their output bucket right away. Instead,
+// each thread stages them in a small write-combining buffer per output
+// bucket and only when a buffer fills up, space for all its slots is
+// reserved with a single atomic_add and the slots are copied over. This
+// cuts the atomics on the bucket counters by EH_STAGE_SLOTS times and
+// turns scattered slot writes into two sequential copies, one into the
+// digits and one into the references of the output level (see the NOTE
+// on EH_SlotLayout). Staged slots are split the same way. Slots that go
+// past the end of the bucket are copied to spill pages, if there is a
+// spill area, or discarded.
+#define EH_STAGE_SLOTS 16
+#define EH_STAGE_ROW_SIZE (EH_STAGE_SLOTS * EH_MAX_SLOT_BYTES)
+struct EH_Stage{
+	EH_SlotLayout *layout;
+	i32 level;
+	u8 *output_slots;
+	i32 *output_num_slots_taken;
+	usize output_bucket_size;
+	usize output_refs_offset;
+	i32 bucket_slots;
+	i32 max_slots;
+	i32 digit_bytes;
+	i32 ref_bytes;
+	i32 num_discarded;
+
+	EH_Spill *spill;
+	i32 num_spilled;
+
+	// NOTE: One count and one row of EH_STAGE_ROW_SIZE bytes per bucket,
+	// right after the struct, see eh_stage_setup.
+	u8 *count;
+	u8 *slots;
+};
+
 static
-i32 eh_get_num_slots_taken(i32 *num_slots_taken, i32 bucket_id){
-	i32 result = atomic_exchange(&num_slots_taken[bucket_id], 0);
-	if(result > EH_NUM_BUCKET_SLOTS)
-		result = EH_NUM_BUCKET_SLOTS;
-	return result;
+usize eh_stage_size(i32 num_buckets){
+	return mem_align_up(sizeof(EH_Stage), 64)
+		+ mem_align_up(num_buckets, 64)
+		+ (usize)num_buckets * EH_STAGE_ROW_SIZE;
 }
 
 static
-EH_Slot *eh_push_slot(EH_Slot *slots, i32 *num_slots_taken, i32 bucket_id){
-	i32 slot_id = atomic_add(&num_slots_taken[bucket_id], 1);
-	if(slot_id >= EH_NUM_BUCKET_SLOTS)
-		return NULL;
-	return slots + bucket_id * EH_NUM_BUCKET_SLOTS + slot_id;
+EH_Stage *eh_stage_setup(u8 *memory, i32 num_buckets){
+	EH_Stage *stage = (EH_Stage*)memory;
+	stage->count = memory + mem_align_up(sizeof(EH_Stage), 64);
+	stage->slots = stage->count + mem_align_up(num_buckets, 64);
+	return stage;
+}
+
+static INLINE
+i32 eh_digit_bytes(i32 level){
+	return (EH_HASH_DIGITS - level) * EH_HASH_DIGIT_BYTES;
+}
+
+static INLINE
+i32 eh_ref_bytes(i32 level){
+	return (level == 0) ? EH_INDEX_BYTES : EH_REF_BYTES;
+}
+
+static
+void eh_stage_begin(EH_Stage *stage, EH_SlotLayout *layout, i32 level,
+		u8 *output_slots, i32 *output_num_slots_taken, EH_Spill *spill){
+	stage->layout = layout;
+	stage->level = level;
+	stage->output_slots = output_slots;
+	stage->output_num_slots_taken = output_num_slots_taken;
+	stage->output_bucket_size = layout->bucket_size[level & 1];
+	stage->output_refs_offset = layout->refs_offset[level];
+	stage->bucket_slots = layout->bucket_slots[level];
+	stage->max_slots = layout->max_slots[level];
+	stage->digit_bytes = eh_digit_bytes(level);
+	stage->ref_bytes = eh_ref_bytes(level);
+	stage->num_discarded = 0;
+	stage->spill = spill;
+	stage->num_spilled = 0;
+	memset(stage->count, 0, layout->num_buckets);
+	DEBUG_ASSERT(stage->digit_bytes + stage->ref_bytes <= EH_MAX_SLOT_BYTES);
+}
+
+static
+void eh_stage_flush(EH_Stage *stage, i32 bucket_id){
+	i32 count = stage->count[bucket_id];
+	stage->count[bucket_id] = 0;
+
+	i32 first = atomic_add(
+		&stage->output_num_slots_taken[bucket_id * EH_COUNTER_STRIDE], count);
+	i32 num_fit = stage->bucket_slots - first;
+	if(num_fit > count)
+		num_fit = count;
+	if(num_fit < 0)
+		num_fit = 0;
+
+	i32 digit_bytes = stage->digit_bytes;
+	i32 ref_bytes = stage->ref_bytes;
+	u8 *src = stage->slots + (usize)bucket_id * EH_STAGE_ROW_SIZE;
+	u8 *src_refs = src + EH_STAGE_SLOTS * digit_bytes;
+	u8 *dst = stage->output_slots + bucket_id * stage->output_bucket_size;
+	memcpy(dst + first * digit_bytes, src, num_fit * digit_bytes);
+	memcpy(dst + stage->output_refs_offset + first * ref_bytes,
+		src_refs, num_fit * ref_bytes);
+
+	// NOTE: The rest goes to spill pages, one page at a time.
+	for(i32 i = num_fit; i < count;){
+		i32 slot = first + i;
+		i32 spill_id = slot - stage->bucket_slots;
+		i32 page_num = spill_id >> EH_SPILL_PAGE_BITS;
+		i32 page_slot = spill_id & EH_SPILL_PAGE_MASK;
+		i32 n = EH_SPILL_PAGE_SLOTS - page_slot;
+		if(n > count - i)
+			n = count - i;
+
+		u8 *page = NULL;
+		if(stage->spill && slot < stage->max_slots){
+			if(n > stage->max_slots - slot)
+				n = stage->max_slots - slot;
+			i32 *entry = &stage->spill->page_table[eh_spill_table_index(
+				stage->layout, stage->level, bucket_id, page_num)];
+			page = eh_spill_take_page(stage->spill, entry);
+		}
+
+		if(page){
+			memcpy(page + page_slot * digit_bytes,
+				src + i * digit_bytes, n * digit_bytes);
+			memcpy(page + EH_SPILL_PAGE_SLOTS * digit_bytes + page_slot * ref_bytes,
+				src_refs + i * ref_bytes, n * ref_bytes);
+			stage->num_spilled += n;
+		}else{
+			stage->num_discarded += n;
+		}
+		i += n;
+	}
+}
+
+// NOTE: Returns where to write the digits of the new slot and sets
+// `out_ref` to where its reference goes.
+static INLINE
+u8 *eh_stage_push(EH_Stage *stage, i32 bucket_id, u8 **out_ref){
+	if(stage->count[bucket_id] == EH_STAGE_SLOTS)
+		eh_stage_flush(stage, bucket_id);
+	i32 i = stage->count[bucket_id];
+	stage->count[bucket_id] += 1;
+	u8 *row = stage->slots + (usize)bucket_id * EH_STAGE_ROW_SIZE;
+	*out_ref = row + EH_STAGE_SLOTS * stage->digit_bytes + i * stage->ref_bytes;
+	return row + i * stage->digit_bytes;
+}
+
+// NOTE: Flushes whatever is left and returns the number of slots that
+// didn't fit in their output buckets.
+static
+i32 eh_stage_end(EH_Stage *stage){
+	for(i32 bucket_id = 0; bucket_id < stage->layout->num_buckets; bucket_id += 1){
+		if(stage->count[bucket_id] > 0)
+			eh_stage_flush(stage, bucket_id);
+	}
+	return stage->num_discarded;
+}
+
+void eh_cancel_reset(EH_CancelToken *token){
+	atomic_exchange(&token->tripped, 0);
+}
+
+void eh_cancel_trip(EH_CancelToken *token){
+	atomic_exchange(&token->tripped, 1);
+}
+
+bool eh_cancel_is_tripped(EH_CancelToken *token){
+	return token != NULL && *(volatile i32*)&token->tripped != 0;
+}
+
+// NOTE: This is also where a cancelled solve stops. Threads stop
+// taking chunks as soon as the token is tripped, so each phase that
+// is left degenerates into a barrier pass and the solve unwinds after
+// at most one chunk (bucket_chunk_size buckets) per thread.
+static INLINE
+bool eh_take_chunk(i32 *cursor, i32 chunk_size, i32 range_begin, i32 range_end,
+		i32 *out_begin, i32 *out_end){
+	i32 begin = range_begin + atomic_add(cursor, chunk_size);
+	if(begin >= range_end)
+		return false;
+	*out_begin = begin;
+	*out_end = (range_end - begin < chunk_size) ? range_end : (begin + chunk_size);
+	return true;
+}
+
+static INLINE
+bool eh_next_chunk(EH_State *eh, i32 phase, i32 chunk_size, i32 total,
+		i32 *out_begin, i32 *out_end){
+	if(eh_cancel_is_tripped(eh->cancel))
+		return false;
+	return eh_take_chunk(eh->work_cursor[phase][0],
+		chunk_size, 0, total, out_begin, out_end);
+}
+
+// NOTE: Same as eh_next_chunk but for buckets, starting with the ones
+// owned by `node` and then stealing from the other nodes.
+static INLINE
+bool eh_next_bucket_chunk(EH_State *eh, i32 phase, i32 node,
+		i32 *out_begin, i32 *out_end){
+	if(eh_cancel_is_tripped(eh->cancel))
+		return false;
+	for(i32 i = 0; i < eh->num_nodes; i += 1){
+		i32 n = (node + i) % eh->num_nodes;
+		if(eh_take_chunk(eh->work_cursor[phase][n], eh->bucket_chunk_size,
+				eh->node_bucket_begin[n], eh->node_bucket_begin[n + 1],
+				out_begin, out_end))
+			return true;
+	}
+	return false;
 }
 
 static
@@ -242,101 +682,284 @@ EH_Solution *eh_push_solution(EH_State *eh){
 	return eh->sol_buffer + sol_id;
 }
 
-static INLINE
-u64 eh_get_ancestor(i32 round, EH_Slot *a){
-	i32 i = NARRAY(a->data) - round - 1;
-	DEBUG_ASSERT(i > 0);
-	if(round == 0){
-		return (u64)a->data[i];
-	}else{
-		return (u64)a->data[i] | ((u64)a->data[i + 1] << 32);
+bool eh_geometry_resolve(EH_Geometry *geometry){
+	if(geometry->bucket_bits == 0)
+		geometry->bucket_bits = EH_DEFAULT_BUCKET_BITS;
+	if(geometry->slot_bits == 0){
+		geometry->slot_bits = (EH_DEFAULT_SLOT_BITS - EH_DEFAULT_BUCKET_BITS)
+			+ (EH_HASH_DIGIT_BITS - geometry->bucket_bits);
+	}
+
+	// NOTE: The other bits of the first digit index EH_Collisions::head
+	// so they can't be too many either.
+	i32 other_bits = EH_HASH_DIGIT_BITS - geometry->bucket_bits;
+	if(other_bits < 0 || other_bits > 20 || geometry->slot_bits <= 0
+	|| (geometry->bucket_bits + 2 * geometry->slot_bits) > 8 * EH_REF_BYTES)
+		return false;
+
+	i32 num_slot_ids = 1 << geometry->slot_bits;
+	for(i32 level = 0; level < EH_NUM_LEVELS; level += 1){
+		if(geometry->bucket_slots[level] == 0){
+			geometry->bucket_slots[level] = (i32)(((i64)num_slot_ids
+				* EH_DEFAULT_BUCKET_SLOTS_PERCENT) / 100);
+		}
+		if(geometry->bucket_slots[level] <= 0
+		|| geometry->bucket_slots[level] > num_slot_ids)
+			return false;
 	}
+	return true;
 }
 
+// NOTE: Level 0 (the init output) goes to set 0 and then each level goes
+// to the other set. A set's bucket size is the biggest of its levels and
+// the references of each level go right before the references of the
+// levels that came before it in the same set. `geometry` must have been
+// resolved already.
 static
-bool eh_same_ancestor(i32 round, EH_Slot *a, EH_Slot *b){
-	i32 i = NARRAY(a->data) - round - 1;
-	DEBUG_ASSERT(i > 0);
-	if(round == 0){
-		return a->data[i] == b->data[i];
-	}else{
-		return a->data[i] == b->data[i]
-			&& a->data[i + 1] == b->data[i + 1];
+void eh_layout_init(EH_SlotLayout *layout, EH_Geometry *geometry){
+	layout->bucket_bits = geometry->bucket_bits;
+	layout->bucket_mask = (1u << geometry->bucket_bits) - 1;
+	layout->num_buckets = 1 << geometry->bucket_bits;
+	layout->other_bits = EH_HASH_DIGIT_BITS - geometry->bucket_bits;
+	layout->slot_bits = geometry->slot_bits;
+	layout->slot_mask = (1u << geometry->slot_bits) - 1;
+	layout->num_slot_ids = 1 << geometry->slot_bits;
+
+	usize tail[EH_NUM_LEVELS];
+	usize tail_size[2] = {};
+	usize bucket_size[2] = {};
+	layout->spill_table_stride = 0;
+	for(i32 level = 0; level < EH_NUM_LEVELS; level += 1){
+		i32 set = level & 1;
+		i32 bucket_slots = geometry->bucket_slots[level];
+		tail_size[set] += (usize)bucket_slots * eh_ref_bytes(level);
+		tail[level] = tail_size[set];
+		usize size = (usize)bucket_slots * eh_digit_bytes(level) + tail[level];
+		if(bucket_size[set] < size)
+			bucket_size[set] = size;
+
+		i32 spill_pages = (layout->num_slot_ids - bucket_slots
+			+ EH_SPILL_PAGE_SLOTS - 1) / EH_SPILL_PAGE_SLOTS;
+		if(spill_pages > EH_MAX_BUCKET_SPILL_PAGES)
+			spill_pages = EH_MAX_BUCKET_SPILL_PAGES;
+		i32 max_slots = bucket_slots + spill_pages * EH_SPILL_PAGE_SLOTS;
+		if(max_slots > layout->num_slot_ids)
+			max_slots = layout->num_slot_ids;
+		layout->bucket_slots[level] = bucket_slots;
+		layout->spill_pages[level] = spill_pages;
+		layout->max_slots[level] = max_slots;
+		if(layout->spill_table_stride < spill_pages)
+			layout->spill_table_stride = spill_pages;
 	}
+	layout->fill_bin_shift = (geometry->slot_bits > EH_FILL_BIN_BITS)
+		? (geometry->slot_bits - EH_FILL_BIN_BITS) : 0;
+
+	// NOTE: Buckets start on a cache line.
+	for(i32 set = 0; set < 2; set += 1)
+		layout->bucket_size[set] = mem_align_up(bucket_size[set], 64);
+	for(i32 level = 0; level < EH_NUM_LEVELS; level += 1)
+		layout->refs_offset[level] = layout->bucket_size[level & 1] - tail[level];
 }
 
 static
-void eh_write_to_output_slot(i32 round, EH_Slot *dest, EH_Slot *src){
-	i32 n = NARRAY(dest->data) - round;
-	DEBUG_ASSERT(n > 0);
-	for(i32 i = 0; i < n; i += 1)
-		dest->data[i] = src->data[i];
+usize eh_layout_slots_size(EH_SlotLayout *layout){
+	return (usize)layout->num_buckets * (layout->bucket_size[0] + layout->bucket_size[1]);
 }
 
+// NOTE: Same as eh_layout_init but scales the bucket slots of every level
+// of `geometry` down by the same factor until both slot sets fit in
+// `budget` bytes. Returns false if they can't fit.
 static
-u64 eh_ref(i32 bucket_id, i32 s0, i32 s1){
-	DEBUG_ASSERT(bucket_id < EH_NUM_BUCKETS);
-	DEBUG_ASSERT(s0 < EH_NUM_BUCKET_SLOTS);
-	DEBUG_ASSERT(s1 < EH_NUM_BUCKET_SLOTS);
-	u64 result = (u64)bucket_id << (2 * EH_SLOT_BITS)
-		| (u64)s0 << EH_SLOT_BITS | (u64)s1;
+bool eh_layout_fit(EH_SlotLayout *layout, EH_Geometry *geometry, usize budget){
+	eh_layout_init(layout, geometry);
+	usize size = eh_layout_slots_size(layout);
+	while(size > budget){
+		// NOTE: Bucket sizes are linear in the bucket slots except for
+		// the cache line alignment, so this only loops to make up for it.
+		bool shrunk = false;
+		for(i32 level = 0; level < EH_NUM_LEVELS; level += 1){
+			i32 bucket_slots = geometry->bucket_slots[level];
+			i32 new_slots = (i32)(((u64)bucket_slots * budget) / size);
+			if(new_slots >= bucket_slots)
+				new_slots = bucket_slots - 1;
+			if(new_slots < 1)
+				new_slots = 1;
+			if(new_slots != bucket_slots)
+				shrunk = true;
+			geometry->bucket_slots[level] = new_slots;
+		}
+		if(!shrunk)
+			return false;
+		eh_layout_init(layout, geometry);
+		size = eh_layout_slots_size(layout);
+	}
+	return true;
+}
+
+bool eh_solver_config_check(EH_SolverConfig *config){
+	EH_Geometry geometry = config->geometry;
+	if(!eh_geometry_resolve(&geometry)){
+		LOG_ERROR("invalid geometry (bucket_bits = %d, slot_bits = %d):"
+			" bucket bits must be within %d..%d, bucket bits + 2 * slot bits"
+			" at most %d and bucket slots within 1..2^slot bits\n",
+			geometry.bucket_bits, geometry.slot_bits,
+			EH_HASH_DIGIT_BITS - 20, EH_HASH_DIGIT_BITS, 8 * EH_REF_BYTES);
+		return false;
+	}
+	if(config->adaptive_slots && config->slots_budget > 0){
+		EH_SlotLayout layout;
+		if(!eh_layout_fit(&layout, &geometry, config->slots_budget)){
+			LOG_ERROR("bucket slots don't fit in %zu MB\n",
+				config->slots_budget >> 20);
+			return false;
+		}
+	}
+	return true;
+}
+
+#define EH_DIGIT_MASK ((1u << EH_HASH_DIGIT_BITS) - 1)
+
+static INLINE
+u32 eh_load_digit(const u8 *ptr){
+	u32 result;
+	memcpy(&result, ptr, sizeof(u32));
+	return result & EH_DIGIT_MASK;
+}
+
+static INLINE
+void eh_store_digit(u8 *ptr, u32 digit){
+	memcpy(ptr, &digit, EH_HASH_DIGIT_BYTES);
+}
+
+static INLINE
+u8 *eh_level_digits(EH_State *eh, i32 level, i32 bucket_id){
+	i32 set = level & 1;
+	return eh_get_bucket(eh->slots[set], eh->layout.bucket_size[set], bucket_id);
+}
+
+static INLINE
+u8 *eh_level_refs(EH_State *eh, i32 level, i32 bucket_id){
+	return eh_level_digits(eh, level, bucket_id) + eh->layout.refs_offset[level];
+}
+
+// NOTE: This is the index of the hash for level 0 and a back reference
+// (see eh_ref) for every other level.
+static INLINE
+u64 eh_get_ancestor(EH_State *eh, i32 level, i32 bucket_id, i32 slot){
+	i32 ref_bytes = eh_ref_bytes(level);
+	i32 bucket_slots = eh->layout.bucket_slots[level];
+	u8 *refs;
+	if(slot < bucket_slots){
+		refs = eh_level_refs(eh, level, bucket_id);
+	}else{
+		i32 spill_id = slot - bucket_slots;
+		u8 *page = eh_spill_get_page(&eh->spill, &eh->layout,
+			level, bucket_id, spill_id >> EH_SPILL_PAGE_BITS);
+		DEBUG_ASSERT(page != NULL);
+		refs = page + EH_SPILL_PAGE_SLOTS * eh_digit_bytes(level);
+		slot = spill_id & EH_SPILL_PAGE_MASK;
+	}
+	u64 result = 0;
+	memcpy(&result, refs + slot * ref_bytes, ref_bytes);
 	return result;
 }
 
+// NOTE: Gets the digits of the spill pages of a bucket, with NULL for the
+// pages that weren't needed or that didn't fit in the pool.
 static
-i32 eh_ref_bucket_id(u64 ref){
-	i32 result = (i32)((ref >> (2 * EH_SLOT_BITS)) & EH_BUCKET_MASK);
+void eh_get_spill_digits(EH_State *eh, i32 level, i32 bucket_id,
+		i32 num_slots_taken, u8 **out_spill_digits){
+	i32 bucket_slots = eh->layout.bucket_slots[level];
+	for(i32 i = 0; i < eh->layout.spill_pages[level]; i += 1){
+		out_spill_digits[i] = NULL;
+		if(num_slots_taken > (bucket_slots + i * EH_SPILL_PAGE_SLOTS)){
+			out_spill_digits[i] = eh_spill_get_page(&eh->spill,
+				&eh->layout, level, bucket_id, i);
+		}
+	}
+}
+
+// NOTE: Returns where the digits of a slot are or NULL if it is in a
+// spill page that couldn't be taken.
+static INLINE
+u8 *eh_get_slot_digits(u8 *digits, u8 **spill_digits,
+		i32 bucket_slots, i32 digit_bytes, i32 slot){
+	if(slot < bucket_slots)
+		return digits + slot * digit_bytes;
+	i32 spill_id = slot - bucket_slots;
+	u8 *page = spill_digits[spill_id >> EH_SPILL_PAGE_BITS];
+	if(!page)
+		return NULL;
+	return page + (spill_id & EH_SPILL_PAGE_MASK) * digit_bytes;
+}
+
+static INLINE
+void eh_xor_bytes(u8 *dest, const u8 *a, const u8 *b, i32 len){
+	i32 i = 0;
+	for(; (i + 8) <= len; i += 8){
+		u64 x, y;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		x ^= y;
+		memcpy(dest + i, &x, 8);
+	}
+	for(; i < len; i += 1)
+		dest[i] = a[i] ^ b[i];
+}
+
+static INLINE
+u64 eh_ref(i32 slot_bits, i32 bucket_id, i32 s0, i32 s1){
+	DEBUG_ASSERT(s0 < (1 << slot_bits));
+	DEBUG_ASSERT(s1 < (1 << slot_bits));
+	u64 result = (u64)bucket_id << (2 * slot_bits)
+		| (u64)s0 << slot_bits | (u64)s1;
 	return result;
 }
 
 static
-i32 eh_ref_s0(u64 ref){
-	i32 result = (i32)((ref >> EH_SLOT_BITS) & EH_SLOT_MASK);
+i32 eh_ref_bucket_id(EH_SlotLayout *layout, u64 ref){
+	i32 result = (i32)((ref >> (2 * layout->slot_bits)) & layout->bucket_mask);
 	return result;
 }
 
 static
-i32 eh_ref_s1(u64 ref){
-	i32 result = (i32)(ref & EH_SLOT_MASK);
+i32 eh_ref_s0(EH_SlotLayout *layout, u64 ref){
+	i32 result = (i32)((ref >> layout->slot_bits) & layout->slot_mask);
 	return result;
 }
 
 static
-EH_Slot eh_join(i32 round, EH_Slot *a, EH_Slot *b,
-		i32 bucket_id, i32 s0, i32 s1){
-	i32 num_hash_digits = NARRAY(a->data) - round - 2;
-	DEBUG_ASSERT(num_hash_digits > 0);
-
-	EH_Slot result;
-	for(i32 i = 0; i < num_hash_digits; i += 1)
-		result.data[i] = a->data[i + 1] ^ b->data[i + 1];
-
-	u64 ref = eh_ref(bucket_id, s0, s1);
-	// NOTE: The order is important and must match the order
-	// used inside eh_get_ancestor.
-	result.data[num_hash_digits] = (u32)ref;
-	result.data[num_hash_digits + 1] = (u32)(ref >> 32);
+i32 eh_ref_s1(EH_SlotLayout *layout, u64 ref){
+	i32 result = (i32)(ref & layout->slot_mask);
 	return result;
 }
 
+static
+void eh_join(i32 round, u8 *dest, u8 *dest_ref,
+		const u8 *a, const u8 *b, u64 ref){
+	// NOTE: The first digit of both is the same (that's the collision)
+	// so the output starts with the second one.
+	i32 num_bytes = eh_digit_bytes(round + 1);
+	DEBUG_ASSERT(num_bytes > 0);
+	eh_xor_bytes(dest, a + EH_HASH_DIGIT_BYTES, b + EH_HASH_DIGIT_BYTES, num_bytes);
+	memcpy(dest_ref, &ref, EH_REF_BYTES);
+}
+
 static
 void eh_get_indices(EH_State *eh, i32 round, u64 ref, u32 *out_indices){
-	i32 bucket_id = eh_ref_bucket_id(ref);
-	i32 s0 = eh_ref_s0(ref);
-	i32 s1 = eh_ref_s1(ref);
-	EH_Slot *slots = eh->slots[EH_INPUT_IDX(round)];
-	EH_Slot *bucket = eh_get_bucket(slots, bucket_id);
+	i32 bucket_id = eh_ref_bucket_id(&eh->layout, ref);
+	i32 s0 = eh_ref_s0(&eh->layout, ref);
+	i32 s1 = eh_ref_s1(&eh->layout, ref);
+	u64 a = eh_get_ancestor(eh, round, bucket_id, s0);
+	u64 b = eh_get_ancestor(eh, round, bucket_id, s1);
 	i32 step = 1 << round;
 
 	if(round == 0){
-		DEBUG_ASSERT(EH_INPUT_IDX(0) == 0);
-		out_indices[0] = (u32)eh_get_ancestor(0, &bucket[s0]);
-		out_indices[1] = (u32)eh_get_ancestor(0, &bucket[s1]);
+		out_indices[0] = (u32)a;
+		out_indices[1] = (u32)b;
 	}else{
-		eh_get_indices(eh, round - 1,
-			eh_get_ancestor(round, &bucket[s0]), out_indices);
-		eh_get_indices(eh, round - 1,
-			eh_get_ancestor(round, &bucket[s1]), out_indices + step);
+		eh_get_indices(eh, round - 1, a, out_indices);
+		eh_get_indices(eh, round - 1, b, out_indices + step);
 	}
 
 	if(out_indices[0] > out_indices[step]){
@@ -349,13 +972,11 @@ void eh_get_indices(EH_State *eh, i32 round, u64 ref, u32 *out_indices){
 }
 
 static
-bool eh_get_distinct_indices(EH_State *eh, EH_Slot *a, EH_Slot *b, u32 *out_indices){
+bool eh_get_distinct_indices(EH_State *eh, u64 ref_a, u64 ref_b, u32 *out_indices){
 	i32 round = EH_LAST_ROUND;
 	i32 step = 1 << round;
-	eh_get_indices(eh, round - 1,
-		eh_get_ancestor(round, a), out_indices);
-	eh_get_indices(eh, round - 1,
-		eh_get_ancestor(round, b), out_indices + step);
+	eh_get_indices(eh, round - 1, ref_a, out_indices);
+	eh_get_indices(eh, round - 1, ref_b, out_indices + step);
 	if(out_indices[0] > out_indices[step]){
 		for(i32 i = 0; i < step; i += 1){
 			u32 tmp = out_indices[i];
@@ -374,30 +995,53 @@ bool eh_get_distinct_indices(EH_State *eh, EH_Slot *a, EH_Slot *b, u32 *out_indi
 }
 
 static
-void eh_solve_init(EH_State *eh, i32 thread_id,
-		EH_Slot *output_slots, i32 *output_num_slots_taken){
+void eh_solve_init(EH_State *eh, EH_Stage *stage, i32 *output_num_slots_taken){
+	// NOTE: Each thread generates BLAKE2B_MAX_LANES consecutive blakes at
+	// a time so they can be finalized in parallel by the multi-lane
+	// blake2b kernels.
+	eh_stage_begin(stage, &eh->layout, 0,
+		eh->slots[0], output_num_slots_taken, &eh->spill);
+	u32 bucket_mask = eh->layout.bucket_mask;
+
 	i32 num_blakes = (EH_RANGE + EH_HASHES_PER_BLAKE - 1) / EH_HASHES_PER_BLAKE;
-	for(i32 i = thread_id; i < num_blakes; i += eh->num_threads){
-		u8 blake[EH_BLAKE_OUTLEN];
-		eh_generate_blake(eh->base_state, i, blake, EH_BLAKE_OUTLEN);
-		for(i32 j = 0; j < EH_HASHES_PER_BLAKE; j += 1){
-			i32 index = EH_HASHES_PER_BLAKE * i + j;
-			u32 hash_digits[EH_HASH_DIGITS];
-			unpack_uints(EH_HASH_DIGIT_BITS,
-				blake + j * EH_HASH_BYTES, EH_HASH_BYTES,
-				hash_digits, EH_HASH_DIGITS);
-
-			i32 bucket_id = hash_digits[0] & EH_BUCKET_MASK;
-			EH_Slot *out_slot = eh_push_slot(output_slots,
-					output_num_slots_taken, bucket_id);
-			if(!out_slot){
-				atomic_add(&eh->num_discarded_hashes, 1);
-				continue;
+	i32 num_groups = (num_blakes + BLAKE2B_MAX_LANES - 1) / BLAKE2B_MAX_LANES;
+	i32 group_begin, group_end;
+	while(eh_next_chunk(eh, EH_PHASE_INIT, EH_INIT_CHUNK,
+			num_groups, &group_begin, &group_end)){
+		for(i32 group = group_begin; group < group_end; group += 1){
+			i32 first = group * BLAKE2B_MAX_LANES;
+			i32 num_lanes = num_blakes - first;
+			if(num_lanes > BLAKE2B_MAX_LANES)
+				num_lanes = BLAKE2B_MAX_LANES;
+
+			u8 blakes[BLAKE2B_MAX_LANES][EH_BLAKE_OUTLEN];
+			blake2b_eh_generate_lanes(&eh->midstate, first, num_lanes, blakes[0]);
+			for(i32 lane = 0; lane < num_lanes; lane += 1){
+				i32 i = first + lane;
+				u8 *blake = blakes[lane];
+				for(i32 j = 0; j < EH_HASHES_PER_BLAKE; j += 1){
+					i32 index = EH_HASHES_PER_BLAKE * i + j;
+					u32 hash_digits[EH_HASH_DIGITS];
+					unpack_uints(EH_HASH_DIGIT_BITS,
+						blake + j * EH_HASH_BYTES, EH_HASH_BYTES,
+						hash_digits, EH_HASH_DIGITS);
+
+					i32 bucket_id = hash_digits[0] & bucket_mask;
+					u8 *out_index;
+					u8 *out_digits = eh_stage_push(stage, bucket_id, &out_index);
+					for(i32 k = 0; k < EH_HASH_DIGITS; k += 1)
+						eh_store_digit(out_digits + k * EH_HASH_DIGIT_BYTES, hash_digits[k]);
+					memcpy(out_index, &index, EH_INDEX_BYTES);
+				}
 			}
-			memcpy(out_slot->data, hash_digits, sizeof(hash_digits));
-			out_slot->data[EH_HASH_DIGITS] = index;
 		}
 	}
+
+	i32 num_discarded = eh_stage_end(stage);
+	if(num_discarded > 0)
+		atomic_add(&eh->num_discarded_hashes, num_discarded);
+	if(stage->num_spilled > 0)
+		atomic_add(&eh->num_spilled_slots, stage->num_spilled);
 }
 
 struct EH_Collisions{
@@ -405,101 +1049,176 @@ struct EH_Collisions{
 	// based on the bucket bits of their first hash digit. To fully sort them
 	// tho, we still need to consider the other bits.
 	//	Now, one way to do this is to do a regular sort but since we want to
-	// preserve the last u32s inside each EH_Slot, we could try to create a
+	// preserve the references of each slot, we could try to create a
 	// linked list for each of the combinations of the other bits.
+	//	There is one head per combination of the other bits and one next
+	// per slot id, both right after the struct, see eh_collisions_setup.
 
-	i32 head[1 << EH_OTHER_BITS];
-	i32 next[EH_NUM_BUCKET_SLOTS];
+	i32 num_heads;
+	i32 num_slot_ids;
+	i32 *head;
+	i32 *next;
 };
 
+static
+usize eh_collisions_size(EH_SlotLayout *layout){
+	return mem_align_up(sizeof(EH_Collisions), 64)
+		+ mem_align_up(((usize)1 << layout->other_bits) * sizeof(i32), 64)
+		+ (usize)layout->num_slot_ids * sizeof(i32);
+}
+
+static
+EH_Collisions *eh_collisions_setup(u8 *memory, EH_SlotLayout *layout){
+	EH_Collisions *c = (EH_Collisions*)memory;
+	c->num_heads = 1 << layout->other_bits;
+	c->num_slot_ids = layout->num_slot_ids;
+	c->head = (i32*)(memory + mem_align_up(sizeof(EH_Collisions), 64));
+	c->next = (i32*)((u8*)c->head + mem_align_up(c->num_heads * sizeof(i32), 64));
+	return c;
+}
+
+static INLINE
 void eh_collisions_init(EH_Collisions *c){
-	for(i32 i = 0; i < NARRAY(c->head); i += 1)
+	// NOTE: `next` is always written by eh_collisions_insert_slot
+	// before being read so only `head` needs to be reset.
+	for(i32 i = 0; i < c->num_heads; i += 1)
 		c->head[i] = -1;
-	for(i32 i = 0; i < NARRAY(c->next); i += 1)
-		c->next[i] = -1;
 }
 
+static INLINE
 i32 eh_collisions_insert_slot(EH_Collisions *c, i32 slot, u32 other_bits){
-	DEBUG_ASSERT(other_bits < NARRAY(c->head));
-	DEBUG_ASSERT(slot >= 0 && slot < EH_NUM_BUCKET_SLOTS);
+	DEBUG_ASSERT(other_bits < (u32)c->num_heads);
+	DEBUG_ASSERT(slot >= 0 && slot < c->num_slot_ids);
 	i32 head = c->head[other_bits];
 	c->next[slot] = head;
 	c->head[other_bits] = slot;
 	return head;
 }
 
+static INLINE
 i32 eh_collisions_next_slot(EH_Collisions *c, i32 slot){
-	DEBUG_ASSERT(slot >= 0 && slot < EH_NUM_BUCKET_SLOTS);
+	DEBUG_ASSERT(slot >= 0 && slot < c->num_slot_ids);
 	return c->next[slot];
 }
 
 static
-void eh_solve_one(EH_State *eh, i32 round, i32 thread_id,
-		EH_Slot *input_slots, i32 *input_num_slots_taken,
-		EH_Slot *output_slots, i32 *output_num_slots_taken){
-	for(i32 bucket_id = thread_id;
-			bucket_id < EH_NUM_BUCKETS;
-			bucket_id += eh->num_threads){
-		EH_Slot *bucket = eh_get_bucket(input_slots, bucket_id);
-		i32 num_slots_taken = eh_get_num_slots_taken(
-				input_num_slots_taken, bucket_id);
-
-		EH_Collisions collisions;
-		eh_collisions_init(&collisions);
-		for(i32 s0 = 0; s0 < num_slots_taken; s0 += 1){
-			i32 s1 = eh_collisions_insert_slot(&collisions, s0,
-				(bucket[s0].data[0] >> EH_BUCKET_BITS));
-			for(; s1 >= 0; s1 = eh_collisions_next_slot(&collisions, s1)){
-				if(eh_same_ancestor(round, &bucket[s0], &bucket[s1]))
-					continue;
-				EH_Slot tmp = eh_join(round,
-					&bucket[s0], &bucket[s1], bucket_id, s0, s1);
-				i32 out_bucket_id = tmp.data[0] & EH_BUCKET_MASK;
-				EH_Slot *out_slot = eh_push_slot(output_slots,
-						output_num_slots_taken, out_bucket_id);
-				if(!out_slot){
-					atomic_add(&eh->num_discarded_collisions, 1);
+void eh_solve_one(EH_State *eh, i32 round, i32 node,
+		EH_Stage *stage, EH_Collisions *collisions, i32 *fill_bins,
+		i32 *input_num_slots_taken, i32 *output_num_slots_taken){
+	// NOTE: The geometry and the collision list pointers are copied to
+	// locals because the compiler has to assume any store in the loop below
+	// could change them (we build with -fno-strict-aliasing).
+	EH_Collisions local_collisions = *collisions;
+	collisions = &local_collisions;
+	EH_SlotLayout *layout = &eh->layout;
+	i32 bucket_bits = layout->bucket_bits;
+	u32 bucket_mask = layout->bucket_mask;
+	i32 slot_bits = layout->slot_bits;
+	i32 bucket_slots = layout->bucket_slots[round];
+	i32 fill_bin_shift = layout->fill_bin_shift;
+	i32 digit_bytes = eh_digit_bytes(round);
+	i32 output_digit_bytes = eh_digit_bytes(round + 1);
+	eh_stage_begin(stage, &eh->layout, round + 1,
+		eh->slots[EH_OUTPUT_IDX(round)], output_num_slots_taken, &eh->spill);
+	i32 chunk_begin, chunk_end;
+	while(eh_next_bucket_chunk(eh, EH_PHASE_ROUND(round),
+			node, &chunk_begin, &chunk_end)){
+		for(i32 bucket_id = chunk_begin; bucket_id < chunk_end; bucket_id += 1){
+			u8 *digits = eh_level_digits(eh, round, bucket_id);
+			i32 num_slots_taken = eh_get_num_slots_taken(input_num_slots_taken,
+					bucket_id, layout->max_slots[round], fill_bins, fill_bin_shift);
+			u8 *spill_digits[EH_MAX_BUCKET_SPILL_PAGES];
+			eh_get_spill_digits(eh, round, bucket_id, num_slots_taken, spill_digits);
+
+			eh_collisions_init(collisions);
+			for(i32 s0 = 0; s0 < num_slots_taken; s0 += 1){
+				u8 *a = eh_get_slot_digits(digits, spill_digits,
+					bucket_slots, digit_bytes, s0);
+				if(!a)
 					continue;
+				i32 s1 = eh_collisions_insert_slot(collisions, s0,
+					(eh_load_digit(a) >> bucket_bits));
+				for(; s1 >= 0; s1 = eh_collisions_next_slot(collisions, s1)){
+					u8 *b = eh_get_slot_digits(digits, spill_digits,
+						bucket_slots, digit_bytes, s1);
+					u32 out_digit = eh_load_digit(a + EH_HASH_DIGIT_BYTES)
+						^ eh_load_digit(b + EH_HASH_DIGIT_BYTES);
+
+					// NOTE: If every digit left is the same, the output would
+					// be all zeros, which in practice only happens when both
+					// come from the same indices and can't lead to a solution.
+					if(out_digit == 0 && memcmp(a + EH_HASH_DIGIT_BYTES,
+							b + EH_HASH_DIGIT_BYTES, output_digit_bytes) == 0)
+						continue;
+
+					u8 *out_ref;
+					u8 *out_digits = eh_stage_push(stage,
+						out_digit & bucket_mask, &out_ref);
+					eh_join(round, out_digits, out_ref, a, b,
+						eh_ref(slot_bits, bucket_id, s0, s1));
 				}
-				eh_write_to_output_slot(round, out_slot, &tmp);
 			}
 		}
 	}
+
+	i32 num_discarded = eh_stage_end(stage);
+	if(num_discarded > 0)
+		atomic_add(&eh->num_discarded_collisions, num_discarded);
+	if(stage->num_spilled > 0)
+		atomic_add(&eh->num_spilled_slots, stage->num_spilled);
 }
 
 static
-void eh_solve_last(EH_State *eh, i32 thread_id,
-		EH_Slot *input_slots, i32 *input_num_slots_taken){
-	for(i32 bucket_id = thread_id;
-			bucket_id < EH_NUM_BUCKETS;
-			bucket_id += eh->num_threads){
-		EH_Slot *bucket = eh_get_bucket(input_slots, bucket_id);
-		i32 num_slots_taken = eh_get_num_slots_taken(
-				input_num_slots_taken, bucket_id);
-
-		EH_Collisions collisions;
-		eh_collisions_init(&collisions);
-		for(i32 s0 = 0; s0 < num_slots_taken; s0 += 1){
-			i32 s1 = eh_collisions_insert_slot(&collisions, s0,
-				(bucket[s0].data[0] >> EH_BUCKET_BITS));
-			for(; s1 >= 0; s1 = eh_collisions_next_slot(&collisions, s1)){
-				// NOTE: EH_Collisions will check for collisions on the first
-				// hash digit but we still need to check the second hash digit.
-				if(bucket[s0].data[1] != bucket[s1].data[1])
-					continue;
-
-				if(eh_same_ancestor(EH_LAST_ROUND, &bucket[s0], &bucket[s1]))
+void eh_solve_last(EH_State *eh, i32 node, EH_Collisions *collisions,
+		i32 *fill_bins, i32 *input_num_slots_taken){
+	// NOTE: Same as in eh_solve_one.
+	EH_Collisions local_collisions = *collisions;
+	collisions = &local_collisions;
+	EH_SlotLayout *layout = &eh->layout;
+	i32 bucket_bits = layout->bucket_bits;
+	i32 bucket_slots = layout->bucket_slots[EH_LAST_ROUND];
+	i32 fill_bin_shift = layout->fill_bin_shift;
+	i32 digit_bytes = eh_digit_bytes(EH_LAST_ROUND);
+	i32 chunk_begin, chunk_end;
+	while(eh_next_bucket_chunk(eh, EH_PHASE_LAST,
+			node, &chunk_begin, &chunk_end)){
+		for(i32 bucket_id = chunk_begin; bucket_id < chunk_end; bucket_id += 1){
+			u8 *digits = eh_level_digits(eh, EH_LAST_ROUND, bucket_id);
+			i32 num_slots_taken = eh_get_num_slots_taken(input_num_slots_taken,
+					bucket_id, layout->max_slots[EH_LAST_ROUND], fill_bins, fill_bin_shift);
+			u8 *spill_digits[EH_MAX_BUCKET_SPILL_PAGES];
+			eh_get_spill_digits(eh, EH_LAST_ROUND, bucket_id, num_slots_taken, spill_digits);
+
+			eh_collisions_init(collisions);
+			for(i32 s0 = 0; s0 < num_slots_taken; s0 += 1){
+				u8 *a = eh_get_slot_digits(digits, spill_digits,
+					bucket_slots, digit_bytes, s0);
+				if(!a)
 					continue;
-
-				u32 sol_indices[EH_SOLUTION_INDICES];
-				if(eh_get_distinct_indices(eh, &bucket[s0], &bucket[s1], sol_indices)){
-					EH_Solution *out_sol = eh_push_solution(eh);
-					if(out_sol){
-						pack_uints(EH_SOLUTION_INDEX_BITS,
-							sol_indices, EH_SOLUTION_INDICES,
-							out_sol->packed, EH_PACKED_SOLUTION_BYTES);
-					}else{
-						atomic_add(&eh->num_discarded_solutions, 1);
+				i32 s1 = eh_collisions_insert_slot(collisions, s0,
+					(eh_load_digit(a) >> bucket_bits));
+				for(; s1 >= 0; s1 = eh_collisions_next_slot(collisions, s1)){
+					// NOTE: EH_Collisions will check for collisions on the first
+					// hash digit but we still need to check the second hash digit.
+					u8 *b = eh_get_slot_digits(digits, spill_digits,
+						bucket_slots, digit_bytes, s1);
+					if(eh_load_digit(a + EH_HASH_DIGIT_BYTES)
+					!= eh_load_digit(b + EH_HASH_DIGIT_BYTES))
+						continue;
+
+					u32 sol_indices[EH_SOLUTION_INDICES];
+					if(eh_get_distinct_indices(eh,
+							eh_get_ancestor(eh, EH_LAST_ROUND, bucket_id, s0),
+							eh_get_ancestor(eh, EH_LAST_ROUND, bucket_id, s1),
+							sol_indices)){
+						EH_Solution *out_sol = eh_push_solution(eh);
+						if(out_sol){
+							pack_uints(EH_SOLUTION_INDEX_BITS,
+								sol_indices, EH_SOLUTION_INDICES,
+								out_sol->packed, EH_PACKED_SOLUTION_BYTES);
+						}else{
+							atomic_add(&eh->num_discarded_solutions, 1);
+						}
 					}
 				}
 			}
@@ -512,96 +1231,491 @@ void eh_print_stats(EH_State *eh){
 	LOG("\tnum_discarded_hashes = %d\n", eh->num_discarded_hashes);
 	LOG("\tnum_discarded_collisions = %d\n", eh->num_discarded_collisions);
 	LOG("\tnum_discarded_solutions = %d\n", eh->num_discarded_solutions);
+	i32 num_spill_pages = eh->spill.num_pages_taken;
+	if(num_spill_pages > EH_NUM_SPILL_PAGES)
+		num_spill_pages = EH_NUM_SPILL_PAGES;
+	LOG("\tnum_spilled_slots = %d (%d spill pages)\n",
+		eh->num_spilled_slots, num_spill_pages);
 }
 
+// NOTE: Reports, for each phase of the last solve, how long threads
+// worked and how long they then waited at the barrier for the others.
+// The max idle time of a phase is the tail that better scheduling
+// should shrink. The same for each thread is only printed with
+// EH_SolverConfig::thread_timings.
 static
-void eh_worker_thread(void *arg){
-	EH_ThreadContext *ctx = (EH_ThreadContext*)arg;
-	eh_solve_init(ctx->eh, ctx->thread_id,
-		ctx->eh->slots[0], ctx->eh->num_slots_taken[0]);
-	barrier_wait(ctx->barrier);
+void eh_print_timings(EH_Solver *solver){
+	static const char *phase_names[EH_NUM_PHASES] = {
+		"init", "round 0", "round 1", "round 2", "round 3", "last",
+	};
+	static_assert(EH_NUM_PHASES == 6, "update phase_names");
+
+	LOG("timings (busy/idle ms, chunk = %d buckets):\n",
+		solver->eh.bucket_chunk_size);
+	i64 last_end_us[EH_NUM_PHASES];
+	for(i32 phase = 0; phase < EH_NUM_PHASES; phase += 1){
+		i64 max_busy = 0;
+		i64 total_busy = 0;
+		i64 first_end = solver->thr_context[0].end_us[phase];
+		i64 last_end = first_end;
+		for(i32 i = 0; i < solver->num_threads; i += 1){
+			EH_ThreadContext *ctx = &solver->thr_context[i];
+			if(ctx->busy_us[phase] > max_busy)
+				max_busy = ctx->busy_us[phase];
+			if(ctx->end_us[phase] < first_end)
+				first_end = ctx->end_us[phase];
+			if(ctx->end_us[phase] > last_end)
+				last_end = ctx->end_us[phase];
+			total_busy += ctx->busy_us[phase];
+		}
+		last_end_us[phase] = last_end;
+		LOG("\t%-8s avg busy %8.2f, max busy %8.2f, max idle %8.2f\n",
+			phase_names[phase],
+			(f64)total_busy / (1000.0 * solver->num_threads),
+			(f64)max_busy / 1000.0, (f64)(last_end - first_end) / 1000.0);
+	}
+
+	if(!solver->thread_timings)
+		return;
+	for(i32 i = 0; i < solver->num_threads; i += 1){
+		EH_ThreadContext *ctx = &solver->thr_context[i];
+		char line[256];
+		i32 len = 0;
+		for(i32 phase = 0; phase < EH_NUM_PHASES; phase += 1){
+			len += snprintf(line + len, sizeof(line) - len, " %7.1f/%-6.1f",
+				(f64)ctx->busy_us[phase] / 1000.0,
+				(f64)(last_end_us[phase] - ctx->end_us[phase]) / 1000.0);
+		}
+		LOG("\tthread %2d:%s\n", i, line);
+	}
+}
+
+// NOTE: Runs `work`, records how long it took and when it ended and
+// then waits at the barrier.
+#define EH_TIMED_PHASE(ctx, phase, work)						\
+	do{															\
+		i64 start_ = time_now_us();								\
+		work;													\
+		i64 end_ = time_now_us();								\
+		(ctx)->busy_us[phase] = end_ - start_;					\
+		(ctx)->end_us[phase] = end_;							\
+		barrier_wait((ctx)->barrier);							\
+	}while(0)
+
+static
+void eh_solve_work(EH_ThreadContext *ctx){
+	EH_State *eh = ctx->eh;
+	EH_TIMED_PHASE(ctx, EH_PHASE_INIT,
+		eh_solve_init(eh, ctx->stage, eh->num_slots_taken[0]));
 	for(i32 round = 0; round < EH_LAST_ROUND; round += 1){
 		if(ctx->thread_id == 0){
 			LOG("starting digit %d\n", round);
-			eh_print_stats(ctx->eh);
+			eh_print_stats(eh);
 		}
 		barrier_wait(ctx->barrier);
 
 		i32 input_idx = EH_INPUT_IDX(round);
 		i32 output_idx = EH_OUTPUT_IDX(round);
-		eh_solve_one(ctx->eh, round, ctx->thread_id,
-			ctx->eh->slots[input_idx], ctx->eh->num_slots_taken[input_idx],
-			ctx->eh->slots[output_idx], ctx->eh->num_slots_taken[output_idx]);
-		barrier_wait(ctx->barrier);
+		EH_TIMED_PHASE(ctx, EH_PHASE_ROUND(round),
+			eh_solve_one(eh, round, ctx->node, ctx->stage, ctx->collisions,
+				ctx->fill_bins[round], eh->num_slots_taken[input_idx],
+				eh->num_slots_taken[output_idx]));
 	}
 
 	if(ctx->thread_id == 0){
 		LOG("starting last two digits\n");
-		eh_print_stats(ctx->eh);
+		eh_print_stats(eh);
 	}
 	barrier_wait(ctx->barrier);
 
 	i32 input_idx = EH_INPUT_IDX(EH_LAST_ROUND);
-	eh_solve_last(ctx->eh, ctx->thread_id,
-		ctx->eh->slots[input_idx], ctx->eh->num_slots_taken[input_idx]);
+	EH_TIMED_PHASE(ctx, EH_PHASE_LAST,
+		eh_solve_last(eh, ctx->node, ctx->collisions,
+			ctx->fill_bins[EH_LAST_ROUND], eh->num_slots_taken[input_idx]));
 
-	barrier_wait(ctx->barrier);
 	if(ctx->thread_id == 0){
+		if(eh_cancel_is_tripped(eh->cancel))
+			LOG("equihash cancelled\n");
 		LOG("equihash end\n");
-		eh_print_stats(ctx->eh);
+		eh_print_stats(eh);
+		eh_print_timings(ctx->solver);
 	}
 }
 
-i32 eh_solve(blake2b_state *base_state, EH_Solution *sol_buffer, i32 max_sols){
-	// TODO: Use a thread pool and an arena.
-	i32 num_threads = num_cpu_cores();
-	// NOTE: Leave one thread for the system.
-	if(num_threads > 1)
-		num_threads -= 1;
+// NOTE: Worker threads are spawned once when the solver is created
+// and parked on the solver barrier between solves. Each solve starts
+// when thread 0 (the thread calling eh_solver_solve) enters the same
+// barrier and ends with the last barrier inside eh_solve_work, after
+// which workers go back to being parked.
+//	Before that, every thread goes through eh_thread_setup and one extra
+// barrier so eh_solver_create only returns once all memory is faulted.
+static
+void eh_thread_setup(EH_ThreadContext *ctx){
+	if(ctx->cpu >= 0 && !thread_set_affinity(&ctx->cpu, 1))
+		LOG_ERROR("failed to pin thread %d to cpu %d\n", ctx->thread_id, ctx->cpu);
+
+	// NOTE: Pages are placed on the node of the thread that touches them
+	// first, so each thread faults in its share of the buckets (of both
+	// slot sets) and counters, plus its own scratch memory. This is only
+	// as fine grained as the page size, with 1GB pages most of the arena
+	// ends up on whichever node touched each gigabyte first.
+	EH_State *eh = ctx->eh;
+	i32 num_buckets = ctx->touch_bucket_end - ctx->touch_bucket_begin;
+	if(num_buckets > 0){
+		for(i32 i = 0; i < 2; i += 1){
+			usize bucket_size = eh->layout.bucket_size[i];
+			mem_prefault(eh_get_bucket(eh->slots[i], bucket_size, ctx->touch_bucket_begin),
+				(usize)num_buckets * bucket_size);
+			mem_prefault(eh->num_slots_taken[i] + ctx->touch_bucket_begin * EH_COUNTER_STRIDE,
+				(usize)num_buckets * EH_COUNTER_STRIDE * sizeof(i32));
+		}
+	}
+	// NOTE: The spill area is shared by every node and barely used, so
+	// it just goes wherever thread 0 is.
+	if(ctx->thread_id == 0){
+		// NOTE: Slot memory past the current layout is only there for
+		// eh_solver_adapt_slots to grow into.
+		EH_Solver *solver = ctx->solver;
+		usize slots_size = eh_layout_slots_size(&eh->layout);
+		if(solver->slots_capacity > slots_size){
+			mem_prefault(solver->arena.ptr + slots_size,
+				solver->slots_capacity - slots_size);
+		}
+		mem_prefault(eh->spill.pages, (usize)EH_NUM_SPILL_PAGES * EH_SPILL_PAGE_SIZE);
+		mem_prefault(eh->spill.page_table, eh->spill.page_table_size * sizeof(i32));
+	}
+	usize stage_size = mem_align_up(eh_stage_size(eh->layout.num_buckets), 64);
+	usize collisions_size = eh_collisions_size(&eh->layout);
+	mem_prefault(ctx->scratch, stage_size + collisions_size);
+	ctx->stage = eh_stage_setup(ctx->scratch, eh->layout.num_buckets);
+	ctx->collisions = eh_collisions_setup(ctx->scratch + stage_size, &eh->layout);
+	barrier_wait(ctx->barrier);
+}
 
-	i32 num_slots = EH_NUM_BUCKETS * EH_NUM_BUCKET_SLOTS;
+static
+void eh_worker_thread(void *arg){
+	EH_ThreadContext *ctx = (EH_ThreadContext*)arg;
+	EH_Solver *solver = ctx->solver;
+	eh_thread_setup(ctx);
+	while(1){
+		barrier_wait(ctx->barrier);
+		if(solver->quit)
+			break;
+		eh_solve_work(ctx);
+	}
+}
 
-	// initialize state
-	EH_State eh = {};
-	eh.base_state = base_state;
-	eh.num_threads = num_threads;
-	eh.num_slots_taken[0] = (i32*)calloc(2 * EH_NUM_BUCKETS, sizeof(i32));
-	eh.num_slots_taken[1] = eh.num_slots_taken[0] + EH_NUM_BUCKETS;
-	eh.slots[0] = (EH_Slot*)calloc(2 * num_slots, sizeof(EH_Slot));
-	eh.slots[1] = eh.slots[0] + num_slots;
-	eh.max_sols = max_sols;
-	eh.num_sols = 0;
-	eh.sol_buffer = sol_buffer;
+EH_SolverConfig eh_solver_default_config(void){
+	EH_SolverConfig result = {};
+	result.num_threads = 0;
+	result.max_page_mode = MEM_PAGES_HUGE_1GB;
+	result.bucket_chunk_size = EH_DEFAULT_BUCKET_CHUNK;
+	return result;
+}
+
+EH_Solver *eh_solver_create(EH_SolverConfig *config){
+	EH_SolverConfig default_config = eh_solver_default_config();
+	if(!config)
+		config = &default_config;
+
+	i32 num_threads = config->num_threads;
+	if(num_threads <= 0){
+		num_threads = num_cpu_cores();
+		// NOTE: Leave one thread for the system.
+		if(num_threads > 1)
+			num_threads -= 1;
+	}
+
+	EH_Solver *solver = (EH_Solver*)calloc(1, sizeof(EH_Solver));
+	solver->num_threads = num_threads;
+	solver->quit = false;
+	solver->thread_timings = config->thread_timings;
+	barrier_init(&solver->barrier, num_threads);
+
+	EH_State *eh = &solver->eh;
+	EH_Geometry geometry = config->geometry;
+	if(!eh_geometry_resolve(&geometry)){
+		FATAL_ERROR("invalid geometry (bucket_bits = %d, slot_bits = %d)\n",
+			geometry.bucket_bits, geometry.slot_bits);
+	}
+	eh_layout_init(&eh->layout, &geometry);
+	solver->slots_capacity = eh_layout_slots_size(&eh->layout);
+	solver->adaptive_slots = config->adaptive_slots;
+	if(config->adaptive_slots && config->slots_budget > 0){
+		solver->slots_capacity = config->slots_budget;
+		if(!eh_layout_fit(&eh->layout, &geometry, solver->slots_capacity)){
+			FATAL_ERROR("bucket slots don't fit in %zu MB\n",
+				config->slots_budget >> 20);
+		}
+	}
+	solver->geometry = geometry;
+	LOG("solver geometry: %d buckets, %d bit slot ids,"
+		" bucket slots %d %d %d %d %d\n",
+		eh->layout.num_buckets, eh->layout.slot_bits,
+		geometry.bucket_slots[0], geometry.bucket_slots[1],
+		geometry.bucket_slots[2], geometry.bucket_slots[3],
+		geometry.bucket_slots[4]);
+	static_assert(EH_NUM_LEVELS == 5, "update the geometry log");
+
+	// allocate arena
+	i32 num_buckets = eh->layout.num_buckets;
+	usize slots_size = solver->slots_capacity;
+	usize counters_size = 2 * (usize)num_buckets * EH_COUNTER_STRIDE * sizeof(i32);
+	// NOTE: Levels get more spill pages per bucket as they shrink so the
+	// page table has to be big enough for the smallest they can get.
+	i32 spill_table_stride = eh->layout.spill_table_stride;
+	if(solver->adaptive_slots)
+		spill_table_stride = EH_MAX_BUCKET_SPILL_PAGES;
+	eh->spill.page_table_size = EH_NUM_LEVELS * num_buckets * spill_table_stride;
+	usize spill_size = (usize)EH_NUM_SPILL_PAGES * EH_SPILL_PAGE_SIZE
+		+ eh->spill.page_table_size * sizeof(i32);
+	solver->arena = mem_alloc_pages(slots_size + counters_size + spill_size,
+		config->max_page_mode);
+	LOG("solver arena: %zu MB using %s pages\n",
+		solver->arena.size >> 20,
+		mem_page_mode_name(solver->arena.page_mode));
+	if(solver->adaptive_slots)
+		LOG("solver bucket slots adapt within %zu MB\n", slots_size >> 20);
+
+	eh->num_threads = num_threads;
+	eh->bucket_chunk_size = config->bucket_chunk_size;
+	if(eh->bucket_chunk_size <= 0)
+		eh->bucket_chunk_size = EH_DEFAULT_BUCKET_CHUNK;
+	eh->slots[0] = solver->arena.ptr;
+	eh->slots[1] = eh->slots[0] + (usize)num_buckets * eh->layout.bucket_size[0];
+	eh->num_slots_taken[0] = (i32*)(solver->arena.ptr + slots_size);
+	eh->num_slots_taken[1] = eh->num_slots_taken[0] + num_buckets * EH_COUNTER_STRIDE;
+	eh->spill.pages = solver->arena.ptr + slots_size + counters_size;
+	eh->spill.page_table = (i32*)(eh->spill.pages
+		+ (usize)EH_NUM_SPILL_PAGES * EH_SPILL_PAGE_SIZE);
+
+	// NOTE: Thread scratch memory is only a couple MB per thread so
+	// 1GB pages would be a waste. Each thread gets its own cache line
+	// aligned chunk.
+	usize stage_size = mem_align_up(eh_stage_size(num_buckets), 64);
+	usize collisions_size = mem_align_up(eh_collisions_size(&eh->layout), 64);
+	usize thread_scratch_size = stage_size + collisions_size;
+	i32 thread_page_mode = config->max_page_mode;
+	if(thread_page_mode > MEM_PAGES_HUGE_2MB)
+		thread_page_mode = MEM_PAGES_HUGE_2MB;
+	solver->thread_arena = mem_alloc_pages(
+		num_threads * thread_scratch_size, thread_page_mode);
+
+	// NOTE: Pick a cpu for each thread and number the nodes that got
+	// any threads from zero. This is on the stack because miners create
+	// their solvers at the same time from different threads.
+	i32 cpu_order[CPU_MAX_CPUS];
+	i32 num_cpus = 0;
+	if(config->affinity == CPU_AFFINITY_LIST){
+		num_cpus = config->num_affinity_cpus;
+		if(num_cpus > CPU_MAX_CPUS)
+			num_cpus = CPU_MAX_CPUS;
+		memcpy(cpu_order, config->affinity_cpus, num_cpus * sizeof(i32));
+	}else if(config->affinity != CPU_AFFINITY_NONE){
+		num_cpus = cpu_affinity_order(config->affinity, cpu_order, CPU_MAX_CPUS);
+	}
+
+	solver->thr_context =
+		(EH_ThreadContext*)calloc(num_threads, sizeof(EH_ThreadContext));
+	i32 node_ids[CPU_MAX_NODES];
+	i32 node_threads[CPU_MAX_NODES] = {};
+	eh->num_nodes = 0;
+	for(i32 i = 0; i < num_threads; i += 1){
+		EH_ThreadContext *ctx = &solver->thr_context[i];
+		ctx->cpu = (num_cpus > 0) ? cpu_order[i % num_cpus] : -1;
+		i32 node_id = (ctx->cpu >= 0) ? cpu_node_of(ctx->cpu) : 0;
+		i32 node = 0;
+		while(node < eh->num_nodes && node_ids[node] != node_id)
+			node += 1;
+		if(node == eh->num_nodes){
+			node_ids[node] = node_id;
+			eh->num_nodes += 1;
+		}
+		ctx->node = node;
+		node_threads[node] += 1;
+	}
+
+	// NOTE: Split buckets between nodes and then each node's buckets
+	// between its threads for the first touch.
+	i32 node_touch_cursor[CPU_MAX_NODES];
+	i32 threads_so_far = 0;
+	for(i32 n = 0; n < eh->num_nodes; n += 1){
+		eh->node_bucket_begin[n] = (i32)(((i64)num_buckets * threads_so_far) / num_threads);
+		node_touch_cursor[n] = 0;
+		threads_so_far += node_threads[n];
+	}
+	eh->node_bucket_begin[eh->num_nodes] = num_buckets;
+	if(eh->num_nodes > 1 || num_cpus > 0){
+		LOG("solver threads pinned to %d cpus over %d node(s)\n",
+			(num_cpus < num_threads) ? num_cpus : num_threads, eh->num_nodes);
+	}
 
 	// spawn threads
-	barrier_t barrier;
-	barrier_init(&barrier, num_threads);
-	EH_ThreadContext *thr_context =
-		(EH_ThreadContext*)malloc(num_threads * sizeof(EH_ThreadContext));
 	for(i32 i = 0; i < num_threads; i += 1){
-		thr_context[i].eh = &eh;
-		thr_context[i].barrier = &barrier;
-		thr_context[i].thread_id = i;
-		if(i != 0){
-			thread_spawn(&thr_context[i].thread_handle,
-				eh_worker_thread, &thr_context[i]);
+		EH_ThreadContext *ctx = &solver->thr_context[i];
+		ctx->solver = solver;
+		ctx->eh = &solver->eh;
+		ctx->barrier = &solver->barrier;
+		ctx->thread_id = i;
+		ctx->scratch = solver->thread_arena.ptr + i * thread_scratch_size;
+
+		i32 node = ctx->node;
+		i32 node_begin = eh->node_bucket_begin[node];
+		i32 node_buckets = eh->node_bucket_begin[node + 1] - node_begin;
+		i32 rank = node_touch_cursor[node];
+		node_touch_cursor[node] += 1;
+		ctx->touch_bucket_begin = node_begin + (node_buckets * rank) / node_threads[node];
+		ctx->touch_bucket_end = node_begin + (node_buckets * (rank + 1)) / node_threads[node];
+
+		if(i != 0)
+			thread_spawn(&ctx->thread_handle, eh_worker_thread, ctx);
+	}
+	eh_thread_setup(&solver->thr_context[0]);
+	return solver;
+}
+
+void eh_solver_destroy(EH_Solver *solver){
+	if(!solver)
+		return;
+
+	// wake up parked threads and join them
+	solver->quit = true;
+	barrier_wait(&solver->barrier);
+	for(i32 i = 1; i < solver->num_threads; i += 1)
+		thread_join(&solver->thr_context[i].thread_handle);
+	barrier_delete(&solver->barrier);
+
+	mem_free_pages(&solver->arena);
+	mem_free_pages(&solver->thread_arena);
+	free(solver->thr_context);
+	free(solver);
+}
+
+i32 eh_solver_page_mode(EH_Solver *solver){
+	return solver->arena.page_mode;
+}
+
+usize eh_solver_memory_size(EH_Solver *solver){
+	return solver->arena.size + solver->thread_arena.size;
+}
+
+void eh_solver_last_stats(EH_Solver *solver, EH_SolveStats *out_stats){
+	EH_State *eh = &solver->eh;
+	out_stats->num_discarded_hashes = eh->num_discarded_hashes;
+	out_stats->num_discarded_collisions = eh->num_discarded_collisions;
+	out_stats->num_discarded_solutions = eh->num_discarded_solutions;
+	out_stats->num_spilled_slots = eh->num_spilled_slots;
+}
+
+// NOTE: See EH_FILL_BINS. This runs on thread 0 between solves, while
+// the other threads are parked, so the layout can change under nobody.
+// Both slot sets are rewritten from scratch on every solve and the
+// spill page table is reset, so only slots[1] has to move with it.
+//	Buckets do move relative to the ranges each thread first touched in
+// eh_thread_setup, so with threads over more than one NUMA node some of
+// them end up on the wrong node.
+static
+void eh_solver_adapt_slots(EH_Solver *solver){
+	// NOTE: Slots discarded at one level never make it to the buckets of
+	// the next, so a solve that ran out of room understates the fill of
+	// every level after it and would only make them shrink further.
+	EH_State *eh = &solver->eh;
+	if(eh->num_discarded_hashes > 0 || eh->num_discarded_collisions > 0)
+		return;
+
+	EH_Geometry geometry = solver->geometry;
+	i32 fill_bin_shift = eh->layout.fill_bin_shift;
+	i32 num_slot_ids = eh->layout.num_slot_ids;
+	for(i32 level = 0; level < EH_NUM_LEVELS; level += 1){
+		f64 *histogram = solver->fill_histogram[level];
+		f64 total = 0.0;
+		for(i32 bin = 0; bin < EH_FILL_BINS; bin += 1){
+			f64 count = histogram[bin] * EH_FILL_DECAY;
+			for(i32 i = 0; i < solver->num_threads; i += 1)
+				count += solver->thr_context[i].fill_bins[level][bin];
+			histogram[bin] = count;
+			total += count;
+		}
+
+		// NOTE: A cancelled solve may not have reached this level.
+		if(total <= 0.0)
+			continue;
+
+		// NOTE: Drop bins from the top while the buckets in them are few
+		// enough to overflow. Buckets in `bin` and below then fit.
+		f64 max_overflow = total * EH_FILL_OVERFLOW_PPM / 1000000.0;
+		f64 overflow = 0.0;
+		i32 bin = EH_FILL_BINS - 1;
+		while(bin > 0 && (overflow + histogram[bin]) <= max_overflow){
+			overflow += histogram[bin];
+			bin -= 1;
 		}
+		i32 bucket_slots = (bin + 1) << fill_bin_shift;
+		if(bucket_slots > num_slot_ids)
+			bucket_slots = num_slot_ids;
+		geometry.bucket_slots[level] = bucket_slots;
 	}
 
-	// do work alongside other threads (this is thread_id == 0)
-	eh_worker_thread(&thr_context[0]);
+	EH_SlotLayout layout;
+	if(!eh_layout_fit(&layout, &geometry, solver->slots_capacity))
+		return;
+	if(memcmp(geometry.bucket_slots, solver->geometry.bucket_slots,
+			sizeof(geometry.bucket_slots)) == 0)
+		return;
+
+	solver->geometry = geometry;
+	eh->layout = layout;
+	eh->slots[1] = eh->slots[0] + (usize)layout.num_buckets * layout.bucket_size[0];
+	LOG("solver bucket slots %d %d %d %d %d (%zu MB)\n",
+		geometry.bucket_slots[0], geometry.bucket_slots[1],
+		geometry.bucket_slots[2], geometry.bucket_slots[3],
+		geometry.bucket_slots[4], eh_layout_slots_size(&layout) >> 20);
+}
 
-	// join other threads
-	for(i32 i = 1; i < num_threads; i += 1)
-		thread_join(&thr_context[i].thread_handle);
-	barrier_delete(&barrier);
+i32 eh_solver_solve(EH_Solver *solver, blake2b_state *base_state,
+		EH_Solution *sol_buffer, i32 max_sols, EH_CancelToken *cancel){
+	// initialize state
+	EH_State *eh = &solver->eh;
+	blake2b_eh_midstate_init(&eh->midstate, base_state);
+	memset(eh->num_slots_taken[0], 0,
+		2 * (usize)eh->layout.num_buckets * EH_COUNTER_STRIDE * sizeof(i32));
+	eh->max_sols = max_sols;
+	eh->num_sols = 0;
+	eh->sol_buffer = sol_buffer;
+	eh->num_discarded_hashes = 0;
+	eh->num_discarded_collisions = 0;
+	eh->num_discarded_solutions = 0;
+	eh->num_spilled_slots = 0;
+	eh->spill.num_pages_taken = 0;
+	memset(eh->spill.page_table, 0xFF, eh->spill.page_table_size * sizeof(i32));
+	memset(eh->work_cursor, 0, sizeof(eh->work_cursor));
+	eh->cancel = cancel;
+	for(i32 i = 0; i < solver->num_threads; i += 1){
+		memset(solver->thr_context[i].fill_bins, 0,
+			sizeof(solver->thr_context[i].fill_bins));
+	}
 
-	// release used memory
-	free(eh.num_slots_taken[0]);
-	free(eh.slots[0]);
-	free(thr_context);
+	// wake up parked threads and do work alongside them
+	// (this is thread_id == 0)
+	barrier_wait(&solver->barrier);
+	eh_solve_work(&solver->thr_context[0]);
+	if(solver->adaptive_slots)
+		eh_solver_adapt_slots(solver);
+
+	// NOTE: Whatever a cancelled solve found is for a job nobody
+	// wants anymore.
+	if(eh_cancel_is_tripped(cancel))
+		return 0;
+	return eh->num_sols;
+}
 
-	return eh.num_sols;
+i32 eh_solve(blake2b_state *base_state, EH_Solution *sol_buffer, i32 max_sols){
+	// NOTE: This is a one-shot solve. Anything that solves more than
+	// once should keep an EH_Solver around instead.
+	EH_Solver *solver = eh_solver_create(NULL);
+	i32 num_sols = eh_solver_solve(solver, base_state, sol_buffer, max_sols, NULL);
+	eh_solver_destroy(solver);
+	return num_sols;
 }
 
 bool eh_check_solution(blake2b_state *base_state, EH_Solution *solution){
@@ -619,6 +1733,8 @@ bool eh_check_solution(blake2b_state *base_state, EH_Solution *solution){
 	}
 
 	// generate hashes
+	blake2b_eh_midstate midstate;
+	blake2b_eh_midstate_init(&midstate, base_state);
 	struct{
 		u32 hash_digits[EH_HASH_DIGITS];
 	}slots[EH_SOLUTION_INDICES];
@@ -626,7 +1742,7 @@ bool eh_check_solution(blake2b_state *base_state, EH_Solution *solution){
 		u8 blake[EH_BLAKE_OUTLEN];
 		i32 j = indices[i] / EH_HASHES_PER_BLAKE;
 		i32 k = indices[i] % EH_HASHES_PER_BLAKE;
-		eh_generate_blake(base_state, j, blake, EH_BLAKE_OUTLEN);
+		blake2b_eh_generate(&midstate, j, blake);
 		unpack_uints(EH_HASH_DIGIT_BITS,
 			blake + k * EH_HASH_BYTES, EH_HASH_BYTES,
 			slots[i].hash_digits, EH_HASH_DIGITS);
@@ -654,3 +1770,156 @@ bool eh_check_solution(blake2b_state *base_state, EH_Solution *solution){
 
 	return true;
 }
+
+// ----------------------------------------------------------------
+// scatter benchmark
+// ----------------------------------------------------------------
+
+// NOTE: Measures how fast threads can scatter slots into buckets, which
+// is what eh_solve_init and every eh_solve_one round do, without any of
+// the hashing. Each thread pushes its share of EH_RANGE slots to random
+// buckets, either with an atomic_add per slot on the bucket counter (what
+// we used to do, with counters packed or padded) or staged through an
+// EH_Stage with one atomic_add per flush.
+enum{
+	EH_SCATTER_ATOMIC_PACKED = 0,
+	EH_SCATTER_ATOMIC_PADDED,
+	EH_SCATTER_STAGED,
+
+	EH_SCATTER_MODE_COUNT,
+};
+
+static const char *eh_scatter_mode_names[EH_SCATTER_MODE_COUNT] = {
+	"atomic/packed",
+	"atomic/padded",
+	"staged",
+};
+
+struct EH_ScatterBench{
+	barrier_t barrier;
+	i32 mode;
+	i32 num_threads;
+	EH_SlotLayout layout;
+	u8 *slots;
+	i32 *num_slots_taken;
+	u8 *thread_scratch;
+	usize thread_scratch_size;
+};
+
+struct EH_ScatterThread{
+	EH_ScatterBench *bench;
+	i32 thread_id;
+	thread_t thread_handle;
+};
+
+static
+void eh_scatter_bench_thread(void *arg){
+	EH_ScatterThread *thr = (EH_ScatterThread*)arg;
+	EH_ScatterBench *bench = thr->bench;
+	i32 mode = bench->mode;
+	i32 stride = (mode == EH_SCATTER_ATOMIC_PACKED) ? 1 : EH_COUNTER_STRIDE;
+	i32 num_slots = EH_RANGE / bench->num_threads;
+	u32 rng = 0x9E3779B9u * (u32)(thr->thread_id + 1);
+
+	EH_Stage *stage = eh_stage_setup(bench->thread_scratch
+		+ thr->thread_id * bench->thread_scratch_size, bench->layout.num_buckets);
+	if(mode == EH_SCATTER_STAGED){
+		eh_stage_begin(stage, &bench->layout, 0,
+			bench->slots, bench->num_slots_taken, NULL);
+	}
+
+	barrier_wait(&bench->barrier);
+	for(i32 i = 0; i < num_slots; i += 1){
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		i32 bucket_id = (i32)(rng & bench->layout.bucket_mask);
+
+		u8 *out_digits;
+		u8 *out_index;
+		if(mode == EH_SCATTER_STAGED){
+			out_digits = eh_stage_push(stage, bucket_id, &out_index);
+		}else{
+			i32 slot_id = atomic_add(&bench->num_slots_taken[bucket_id * stride], 1);
+			if(slot_id >= bench->layout.bucket_slots[0])
+				continue;
+			u8 *bucket = eh_get_bucket(bench->slots, bench->layout.bucket_size[0], bucket_id);
+			out_digits = bucket + slot_id * eh_digit_bytes(0);
+			out_index = bucket + bench->layout.refs_offset[0]
+				+ slot_id * EH_INDEX_BYTES;
+		}
+		for(i32 j = 0; j < EH_HASH_DIGITS; j += 1)
+			eh_store_digit(out_digits + j * EH_HASH_DIGIT_BYTES, rng + j);
+		memcpy(out_index, &rng, EH_INDEX_BYTES);
+	}
+	if(mode == EH_SCATTER_STAGED)
+		eh_stage_end(stage);
+	barrier_wait(&bench->barrier);
+}
+
+void eh_bench_scatter(void){
+	static const i32 thread_counts[] = { 8, 16, 32, 64 };
+	i32 max_threads = thread_counts[NARRAY(thread_counts) - 1];
+
+	EH_ScatterBench bench;
+	EH_Geometry geometry = {};
+	eh_geometry_resolve(&geometry);
+	eh_layout_init(&bench.layout, &geometry);
+	i32 num_buckets = bench.layout.num_buckets;
+	usize slots_size = (usize)num_buckets * bench.layout.bucket_size[0];
+	usize counters_size = (usize)num_buckets * EH_COUNTER_STRIDE * sizeof(i32);
+	MemPages arena = mem_alloc_pages(slots_size + counters_size, MEM_PAGES_HUGE_1GB);
+	mem_prefault(arena.ptr, arena.size);
+
+	usize thread_scratch_size = mem_align_up(eh_stage_size(num_buckets), 64);
+	MemPages thread_arena = mem_alloc_pages(
+		max_threads * thread_scratch_size, MEM_PAGES_HUGE_2MB);
+	mem_prefault(thread_arena.ptr, thread_arena.size);
+
+	LOG("scatter bench: %d slots, %d buckets of %d slots, %d cpu cores\n",
+		EH_RANGE, num_buckets, bench.layout.bucket_slots[0], num_cpu_cores());
+
+	bench.slots = arena.ptr;
+	bench.num_slots_taken = (i32*)(arena.ptr + slots_size);
+	bench.thread_scratch = thread_arena.ptr;
+	bench.thread_scratch_size = thread_scratch_size;
+
+	EH_ScatterThread *threads =
+		(EH_ScatterThread*)calloc(max_threads, sizeof(EH_ScatterThread));
+	for(i32 t = 0; t < NARRAY(thread_counts); t += 1){
+		i32 num_threads = thread_counts[t];
+		for(i32 mode = 0; mode < EH_SCATTER_MODE_COUNT; mode += 1){
+			memset(bench.num_slots_taken, 0, counters_size);
+			bench.mode = mode;
+			bench.num_threads = num_threads;
+
+			// NOTE: The calling thread joins the barrier too so it can
+			// time from the moment every thread is ready to go.
+			barrier_init(&bench.barrier, num_threads + 1);
+			for(i32 i = 0; i < num_threads; i += 1){
+				threads[i].bench = &bench;
+				threads[i].thread_id = i;
+				thread_spawn(&threads[i].thread_handle,
+					eh_scatter_bench_thread, &threads[i]);
+			}
+
+			barrier_wait(&bench.barrier);
+			i64 start = time_now_us();
+			barrier_wait(&bench.barrier);
+			i64 elapsed = time_now_us() - start;
+
+			for(i32 i = 0; i < num_threads; i += 1)
+				thread_join(&threads[i].thread_handle);
+			barrier_delete(&bench.barrier);
+
+			i32 num_slots = (EH_RANGE / num_threads) * num_threads;
+			LOG("%2d threads, %-14s %8.3f ms, %8.2f Mslots/s\n",
+				num_threads, eh_scatter_mode_names[mode],
+				(f64)elapsed / 1000.0, (f64)num_slots / (f64)elapsed);
+		}
+	}
+
+	free(threads);
+	mem_free_pages(&thread_arena);
+	mem_free_pages(&arena);
+}
@@ -72,12 +72,9 @@ bool json_lexstring(JSON_State *state, JSON_Token *tok){
 
 	if(state->ptr[0]){
 		u8 *end = state->ptr;
-		usize len = end - start;
 		tok->token = TOKEN_STRING;
-		if(len >= sizeof(tok->token_string))
-			len = sizeof(tok->token_string) - 1;
-		memcpy(tok->token_string, start, len);
-		tok->token_string[len] = 0;
+		tok->token_string.ptr = (const char*)start;
+		tok->token_string.len = (i32)(end - start);
 		state->ptr += 1; // skip closing quote
 		return true;
 	}else{
@@ -187,7 +184,7 @@ bool json_consume_boolean(JSON_State *state, JSON_Token *tok){
 
 bool json_consume_key(JSON_State *state, const char *key){
 	if(state->tok.token == TOKEN_STRING
-	&& strcmp(key, state->tok.token_string) == 0){
+	&& str_slice_equals(state->tok.token_string, key)){
 		json_next_token(state, &state->tok);
 		return json_consume_token(state, NULL, ':');
 	}
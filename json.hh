@@ -17,11 +17,14 @@ enum{
 	TOKEN_INVALID,	// special token to signal an error on the lexer
 };
 
+// NOTE: String tokens point into the text being parsed (without the
+// quotes and with escape sequences left as they are) so they are only
+// valid for as long as that text is.
 struct JSON_Token{
 	int token;
 	union{
 		i64 token_number;
-		char token_string[256];
+		StrSlice token_string;
 		bool token_boolean;
 	};
 };
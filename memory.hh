@@ -0,0 +1,238 @@
+// NOTE: This will work on windows and linux only.
+
+#ifndef MEMORY_HH_
+#define MEMORY_HH_
+
+#include "common.hh"
+
+#if PLATFORM_WINDOWS
+#	include <windows.h>
+#elif PLATFORM_LINUX
+#	include <sys/mman.h>
+#else
+#	error "add platform memory settings"
+#endif
+
+// ----------------------------------------------------------------
+// page allocation
+// ----------------------------------------------------------------
+#define MEM_PAGE_SIZE		((usize)4 << 10)
+#define MEM_HUGE_2MB_SIZE	((usize)2 << 20)
+#define MEM_HUGE_1GB_SIZE	((usize)1 << 30)
+
+// NOTE: Page modes are ordered from worst to best. Asking for a
+// page mode will try it first and then fall back to the next worse
+// mode until one of them succeeds. Normal pages never fail (or it's
+// a fatal error).
+//	On linux, huge pages come from the hugetlb pool (MAP_HUGETLB) which
+// needs to be reserved by the administrator (vm.nr_hugepages or the
+// hugepages= boot parameter for 1GB pages) and transparent huge pages
+// come from madvise(MADV_HUGEPAGE) which only needs THP to be set to
+// "madvise" or "always".
+//	On windows, large pages need the "Lock pages in memory" privilege
+// and there is no transparent mode nor 1GB pages through VirtualAlloc
+// so both fall back to 2MB large pages.
+enum{
+	MEM_PAGES_NORMAL = 0,
+	MEM_PAGES_TRANSPARENT_HUGE,
+	MEM_PAGES_HUGE_2MB,
+	MEM_PAGES_HUGE_1GB,
+
+	MEM_PAGES_COUNT,
+};
+
+struct MemPages{
+	u8 *ptr;
+	usize size;
+	i32 page_mode;
+};
+
+static INLINE
+const char *mem_page_mode_name(i32 page_mode){
+	switch(page_mode){
+		case MEM_PAGES_NORMAL:				return "normal";
+		case MEM_PAGES_TRANSPARENT_HUGE:	return "transparent huge";
+		case MEM_PAGES_HUGE_2MB:			return "huge 2MB";
+		case MEM_PAGES_HUGE_1GB:			return "huge 1GB";
+		default:							return "unknown";
+	}
+}
+
+static INLINE
+usize mem_align_up(usize size, usize alignment){
+	DEBUG_ASSERT(IS_POWER_OF_TWO(alignment));
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+#if PLATFORM_WINDOWS
+
+static
+bool mem__enable_lock_memory_privilege(void){
+	static i32 result = -1;
+	if(result != -1)
+		return result != 0;
+
+	result = 0;
+	HANDLE token;
+	if(OpenProcessToken(GetCurrentProcess(),
+			TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)){
+		TOKEN_PRIVILEGES tp;
+		tp.PrivilegeCount = 1;
+		tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		if(LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &tp.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS){
+			result = 1;
+		}
+		CloseHandle(token);
+	}
+	return result != 0;
+}
+
+static
+bool mem__try_alloc_pages(MemPages *out, usize size, i32 page_mode){
+	DWORD alloc_type = MEM_RESERVE | MEM_COMMIT;
+	if(page_mode == MEM_PAGES_HUGE_2MB){
+		usize large_page_size = GetLargePageMinimum();
+		if(large_page_size == 0 || !mem__enable_lock_memory_privilege())
+			return false;
+		size = mem_align_up(size, large_page_size);
+		alloc_type |= MEM_LARGE_PAGES;
+	}else if(page_mode != MEM_PAGES_NORMAL){
+		return false;
+	}
+
+	void *ptr = VirtualAlloc(NULL, size, alloc_type, PAGE_READWRITE);
+	if(ptr == NULL)
+		return false;
+
+	out->ptr = (u8*)ptr;
+	out->size = size;
+	out->page_mode = page_mode;
+	return true;
+}
+
+static INLINE
+void mem_free_pages(MemPages *pages){
+	if(pages->ptr != NULL)
+		VirtualFree(pages->ptr, 0, MEM_RELEASE);
+	pages->ptr = NULL;
+	pages->size = 0;
+}
+
+#elif PLATFORM_LINUX
+
+#ifndef MAP_HUGE_SHIFT
+#	define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#	define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#	define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+static
+void *mem__mmap(usize size, int extra_flags){
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+	return ptr != MAP_FAILED ? ptr : NULL;
+}
+
+static
+bool mem__try_alloc_pages(MemPages *out, usize size, i32 page_mode){
+	u8 *ptr = NULL;
+	switch(page_mode){
+		case MEM_PAGES_NORMAL:{
+			ptr = (u8*)mem__mmap(size, 0);
+			break;
+		}
+
+		case MEM_PAGES_TRANSPARENT_HUGE:{
+#ifdef MADV_HUGEPAGE
+			// NOTE: THP can only back 2MB aligned ranges so we map
+			// an extra 2MB and trim both ends to get an aligned range.
+			size = mem_align_up(size, MEM_HUGE_2MB_SIZE);
+			usize map_size = size + MEM_HUGE_2MB_SIZE;
+			u8 *map = (u8*)mem__mmap(map_size, 0);
+			if(map == NULL)
+				return false;
+
+			ptr = (u8*)mem_align_up((usize)map, MEM_HUGE_2MB_SIZE);
+			usize head = (usize)(ptr - map);
+			usize tail = map_size - head - size;
+			if(head > 0) munmap(map, head);
+			if(tail > 0) munmap(ptr + size, tail);
+
+			if(madvise(ptr, size, MADV_HUGEPAGE) != 0){
+				munmap(ptr, size);
+				return false;
+			}
+#endif
+			break;
+		}
+
+		case MEM_PAGES_HUGE_2MB:{
+#ifdef MAP_HUGETLB
+			size = mem_align_up(size, MEM_HUGE_2MB_SIZE);
+			ptr = (u8*)mem__mmap(size, MAP_HUGETLB | MAP_HUGE_2MB);
+#endif
+			break;
+		}
+
+		case MEM_PAGES_HUGE_1GB:{
+#ifdef MAP_HUGETLB
+			size = mem_align_up(size, MEM_HUGE_1GB_SIZE);
+			ptr = (u8*)mem__mmap(size, MAP_HUGETLB | MAP_HUGE_1GB);
+#endif
+			break;
+		}
+	}
+
+	if(ptr == NULL)
+		return false;
+
+	out->ptr = ptr;
+	out->size = size;
+	out->page_mode = page_mode;
+	return true;
+}
+
+static INLINE
+void mem_free_pages(MemPages *pages){
+	if(pages->ptr != NULL)
+		munmap(pages->ptr, pages->size);
+	pages->ptr = NULL;
+	pages->size = 0;
+}
+
+#endif
+
+// NOTE: Pages returned by mem_alloc_pages are zero-filled by the
+// system but only get physically backed when first touched. Hugetlb
+// pages on linux are reserved from the pool at mmap time, not faulted,
+// so they too are only mapped on first touch (large pages on windows
+// are the exception and come committed). Use mem_prefault to pay for
+// that upfront instead of in the middle of whatever is going to use
+// them.
+
+static INLINE
+MemPages mem_alloc_pages(usize size, i32 max_page_mode){
+	DEBUG_ASSERT(max_page_mode >= 0 && max_page_mode < MEM_PAGES_COUNT);
+	MemPages result = {};
+	for(i32 mode = max_page_mode; mode >= MEM_PAGES_NORMAL; mode -= 1){
+		if(mem__try_alloc_pages(&result, size, mode))
+			return result;
+	}
+	FATAL_ERROR("failed to allocate %zu bytes\n", size);
+	return result;
+}
+
+static INLINE
+void mem_prefault(void *ptr, usize size){
+	volatile u8 *bytes = (volatile u8*)ptr;
+	for(usize i = 0; i < size; i += MEM_PAGE_SIZE)
+		bytes[i] = 0;
+}
+
+#endif //MEMORY_HH_
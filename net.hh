@@ -0,0 +1,491 @@
+// NOTE: This will work on windows and linux only.
+//	On windows this must be included before thread.hh (or anything else
+// that includes windows.h) because windows.h pulls the old winsock.h
+// otherwise.
+
+#ifndef NET_HH_
+#define NET_HH_
+
+#include "common.hh"
+
+#if PLATFORM_WINDOWS
+#	include <winsock2.h>
+#elif PLATFORM_LINUX
+#	include <arpa/inet.h>
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <netinet/in.h>
+#	include <netinet/tcp.h>
+#	include <poll.h>
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#	include <sys/socket.h>
+#	include <unistd.h>
+#else
+#	error "add platform net settings"
+#endif
+
+// NOTE: Sockets here are always non-blocking TCP streams. Reads are
+// driven by a NetPoller (epoll on linux, select on windows) and writes
+// go straight to the socket, only waiting for room in the send buffer
+// when it's full. Stream sockets get TCP_NODELAY so small writes like
+// share submits aren't held back by Nagle waiting for the ack of the
+// previous one, SO_KEEPALIVE so a dead pool is noticed even when it
+// has nothing to send, and a send buffer of NET_SEND_BUFFER_SIZE.
+#define NET_SEND_BUFFER_SIZE	(64 << 10)
+
+// NOTE: Return values of net_recv other than the number of bytes read.
+#define NET_RECV_CLOSED			0
+#define NET_RECV_ERROR			-1
+#define NET_RECV_WOULD_BLOCK	-2
+
+// NOTE: net_poller_wait waits forever with a negative timeout and
+// reports sockets with data (or a closed connection) as events that
+// carry the `user` pointer they were added with. Any thread can cut a
+// wait short with net_poller_wake, in which case it may return without
+// events. A wake with nobody waiting makes the next wait return.
+struct NetEvent{
+	void *user;
+	bool readable;
+	bool hangup;
+};
+
+#if PLATFORM_WINDOWS
+
+typedef SOCKET net_socket_t;
+#define NET_INVALID_SOCKET	INVALID_SOCKET
+#define NET_SEND_FLAGS		0
+
+struct net__WSAInit{
+	net__WSAInit(void){
+		WSADATA dummy;
+		if(WSAStartup(MAKEWORD(2, 2), &dummy) != 0)
+			FATAL_ERROR("failed to initialize windows sockets\n");
+	}
+	~net__WSAInit(void){
+		WSACleanup();
+	}
+};
+
+// NOTE: WSAStartup is reference counted so it's fine for every
+// translation unit to have its own.
+static net__WSAInit net__wsa_init;
+
+static INLINE
+i32 net_last_error(void){
+	return WSAGetLastError();
+}
+
+static INLINE
+bool net__would_block(void){
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+static INLINE
+void net_close(net_socket_t s){
+	closesocket(s);
+}
+
+static INLINE
+bool net_set_nonblocking(net_socket_t s){
+	u_long mode = 1;
+	return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+
+// NOTE: There is no epoll on windows so the poller is a plain select
+// over at most NET_POLLER_MAX_SOCKETS sockets, which is all we need.
+// Wakes are datagrams a loopback UDP socket sends to itself, which is
+// always in the read set.
+#define NET_POLLER_MAX_SOCKETS 16
+
+struct NetPoller{
+	i32 num_sockets;
+	net_socket_t sockets[NET_POLLER_MAX_SOCKETS];
+	void *users[NET_POLLER_MAX_SOCKETS];
+	net_socket_t wakeup;
+};
+
+static INLINE
+bool net_poller_init(NetPoller *poller){
+	poller->num_sockets = 0;
+	poller->wakeup = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(poller->wakeup == INVALID_SOCKET){
+		LOG_ERROR("failed to create wakeup socket (error = %d)\n", WSAGetLastError());
+		return false;
+	}
+
+	sockaddr_in sa = {};
+	sa.sin_family = AF_INET;
+	sa.sin_port = 0;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int sa_len = sizeof(sa);
+	if(bind(poller->wakeup, (sockaddr*)&sa, sizeof(sa)) != 0
+	|| getsockname(poller->wakeup, (sockaddr*)&sa, &sa_len) != 0
+	|| connect(poller->wakeup, (sockaddr*)&sa, sizeof(sa)) != 0
+	|| !net_set_nonblocking(poller->wakeup)){
+		LOG_ERROR("failed to set up wakeup socket (error = %d)\n", WSAGetLastError());
+		closesocket(poller->wakeup);
+		poller->wakeup = INVALID_SOCKET;
+		return false;
+	}
+	return true;
+}
+
+static INLINE
+void net_poller_destroy(NetPoller *poller){
+	poller->num_sockets = 0;
+	if(poller->wakeup != INVALID_SOCKET)
+		closesocket(poller->wakeup);
+	poller->wakeup = INVALID_SOCKET;
+}
+
+static INLINE
+void net_poller_wake(NetPoller *poller){
+	char byte = 0;
+	send(poller->wakeup, &byte, 1, 0);
+}
+
+static
+bool net_poller_add(NetPoller *poller, net_socket_t s, void *user){
+	if(poller->num_sockets >= NET_POLLER_MAX_SOCKETS)
+		return false;
+	poller->sockets[poller->num_sockets] = s;
+	poller->users[poller->num_sockets] = user;
+	poller->num_sockets += 1;
+	return true;
+}
+
+static
+void net_poller_remove(NetPoller *poller, net_socket_t s){
+	for(i32 i = 0; i < poller->num_sockets; i += 1){
+		if(poller->sockets[i] == s){
+			poller->num_sockets -= 1;
+			poller->sockets[i] = poller->sockets[poller->num_sockets];
+			poller->users[i] = poller->users[poller->num_sockets];
+			return;
+		}
+	}
+}
+
+static
+i32 net_poller_wait(NetPoller *poller, i32 timeout_ms,
+		NetEvent *events, i32 max_events){
+	fd_set readfds, exceptfds;
+	FD_ZERO(&readfds);
+	FD_ZERO(&exceptfds);
+	FD_SET(poller->wakeup, &readfds);
+	for(i32 i = 0; i < poller->num_sockets; i += 1){
+		FD_SET(poller->sockets[i], &readfds);
+		FD_SET(poller->sockets[i], &exceptfds);
+	}
+
+	timeval timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	int ret = select(0, &readfds, NULL, &exceptfds,
+		(timeout_ms >= 0) ? &timeout : NULL);
+	if(ret == SOCKET_ERROR){
+		LOG_ERROR("select failed (ret = %d, error = %d)\n",
+			ret, WSAGetLastError());
+		return -1;
+	}
+
+	if(FD_ISSET(poller->wakeup, &readfds)){
+		char drain[64];
+		while(recv(poller->wakeup, drain, sizeof(drain), 0) > 0){}
+	}
+
+	i32 num_events = 0;
+	for(i32 i = 0; i < poller->num_sockets && num_events < max_events; i += 1){
+		bool readable = FD_ISSET(poller->sockets[i], &readfds) != 0;
+		bool hangup = FD_ISSET(poller->sockets[i], &exceptfds) != 0;
+		if(readable || hangup){
+			events[num_events].user = poller->users[i];
+			events[num_events].readable = readable;
+			events[num_events].hangup = hangup;
+			num_events += 1;
+		}
+	}
+	return num_events;
+}
+
+static
+bool net__wait_writable(net_socket_t s, i32 timeout_ms){
+	fd_set writefds;
+	FD_ZERO(&writefds);
+	FD_SET(s, &writefds);
+	timeval timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	return select(0, NULL, &writefds, NULL, &timeout) > 0;
+}
+
+#elif PLATFORM_LINUX
+
+typedef int net_socket_t;
+#define NET_INVALID_SOCKET	-1
+
+// NOTE: A send on a connection the peer already closed raises SIGPIPE
+// unless told not to, and we'd rather get the error.
+#define NET_SEND_FLAGS		MSG_NOSIGNAL
+
+static INLINE
+i32 net_last_error(void){
+	return errno;
+}
+
+static INLINE
+bool net__would_block(void){
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static INLINE
+void net_close(net_socket_t s){
+	close(s);
+}
+
+static INLINE
+bool net_set_nonblocking(net_socket_t s){
+	int flags = fcntl(s, F_GETFL, 0);
+	return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// NOTE: Wakes go through an eventfd that is always in the epoll set.
+// Its events are drained inside net_poller_wait and never reported.
+struct NetPoller{
+	int epfd;
+	int wakefd;
+};
+
+static INLINE
+bool net_poller_init(NetPoller *poller){
+	poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(poller->epfd == -1){
+		LOG_ERROR("epoll_create1 failed (error = %d)\n", errno);
+		return false;
+	}
+
+	poller->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &poller->wakefd;
+	if(poller->wakefd == -1
+	|| epoll_ctl(poller->epfd, EPOLL_CTL_ADD, poller->wakefd, &ev) != 0){
+		LOG_ERROR("failed to set up wakeup eventfd (error = %d)\n", errno);
+		if(poller->wakefd != -1)
+			close(poller->wakefd);
+		close(poller->epfd);
+		poller->epfd = -1;
+		poller->wakefd = -1;
+		return false;
+	}
+	return true;
+}
+
+static INLINE
+void net_poller_destroy(NetPoller *poller){
+	if(poller->wakefd != -1)
+		close(poller->wakefd);
+	if(poller->epfd != -1)
+		close(poller->epfd);
+	poller->wakefd = -1;
+	poller->epfd = -1;
+}
+
+static INLINE
+void net_poller_wake(NetPoller *poller){
+	u64 one = 1;
+	ssize_t ret = write(poller->wakefd, &one, sizeof(one));
+	(void)ret;
+}
+
+static
+bool net_poller_add(NetPoller *poller, net_socket_t s, void *user){
+	epoll_event ev = {};
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = user;
+	return epoll_ctl(poller->epfd, EPOLL_CTL_ADD, s, &ev) == 0;
+}
+
+static
+void net_poller_remove(NetPoller *poller, net_socket_t s){
+	epoll_ctl(poller->epfd, EPOLL_CTL_DEL, s, NULL);
+}
+
+static
+i32 net_poller_wait(NetPoller *poller, i32 timeout_ms,
+		NetEvent *events, i32 max_events){
+	epoll_event evs[16];
+	if(max_events > (i32)NARRAY(evs))
+		max_events = (i32)NARRAY(evs);
+	int ret = epoll_wait(poller->epfd, evs, max_events, timeout_ms);
+	if(ret < 0){
+		if(errno == EINTR)
+			return 0;
+		LOG_ERROR("epoll_wait failed (ret = %d, error = %d)\n", ret, errno);
+		return -1;
+	}
+
+	i32 num_events = 0;
+	for(i32 i = 0; i < ret; i += 1){
+		if(evs[i].data.ptr == &poller->wakefd){
+			u64 count;
+			ssize_t drained = read(poller->wakefd, &count, sizeof(count));
+			(void)drained;
+			continue;
+		}
+		events[num_events].user = evs[i].data.ptr;
+		events[num_events].readable = (evs[i].events & EPOLLIN) != 0;
+		events[num_events].hangup = (evs[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+		num_events += 1;
+	}
+	return num_events;
+}
+
+static
+bool net__wait_writable(net_socket_t s, i32 timeout_ms){
+	pollfd pfd = {};
+	pfd.fd = s;
+	pfd.events = POLLOUT;
+	return poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLOUT) != 0;
+}
+
+#endif
+
+// ----------------------------------------------------------------
+// stream sockets
+// ----------------------------------------------------------------
+
+// NOTE: Used for both connected and accepted sockets. Failing to set
+// any of the options is only worth a log, the socket still works.
+static
+bool net_configure_stream(net_socket_t s){
+	if(!net_set_nonblocking(s)){
+		LOG_ERROR("failed to make socket non-blocking (error = %d)\n",
+			net_last_error());
+		return false;
+	}
+
+	int nodelay = 1;
+	int keepalive = 1;
+	int sndbuf = NET_SEND_BUFFER_SIZE;
+	if(setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay)) != 0)
+		LOG_ERROR("failed to set TCP_NODELAY (error = %d)\n", net_last_error());
+	if(setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (const char*)&keepalive, sizeof(keepalive)) != 0)
+		LOG_ERROR("failed to set SO_KEEPALIVE (error = %d)\n", net_last_error());
+	if(setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&sndbuf, sizeof(sndbuf)) != 0)
+		LOG_ERROR("failed to set SO_SNDBUF (error = %d)\n", net_last_error());
+	return true;
+}
+
+// NOTE: `addr` and `port` are in network byte order. The connect itself
+// blocks, the socket returned doesn't.
+static
+net_socket_t net_connect_tcp(u32 addr, u16 port){
+	net_socket_t s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(s == NET_INVALID_SOCKET){
+		LOG_ERROR("failed to create socket (error = %d)\n", net_last_error());
+		return NET_INVALID_SOCKET;
+	}
+
+	sockaddr_in sa = {};
+	sa.sin_family = AF_INET;
+	sa.sin_port = port;
+	sa.sin_addr.s_addr = addr;
+	int ret = connect(s, (sockaddr*)&sa, sizeof(sockaddr_in));
+	if(ret != 0){
+		LOG_ERROR("failed to connect (ret = %d, error = %d)\n",
+			ret, net_last_error());
+		net_close(s);
+		return NET_INVALID_SOCKET;
+	}
+
+	if(!net_configure_stream(s)){
+		net_close(s);
+		return NET_INVALID_SOCKET;
+	}
+	return s;
+}
+
+// NOTE: `port` is in network byte order. The listening socket is left
+// blocking, accepted sockets are configured like connected ones.
+static
+net_socket_t net_listen_tcp(u16 port){
+	net_socket_t s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(s == NET_INVALID_SOCKET){
+		LOG_ERROR("failed to create socket (error = %d)\n", net_last_error());
+		return NET_INVALID_SOCKET;
+	}
+
+	int reuse = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	sockaddr_in sa = {};
+	sa.sin_family = AF_INET;
+	sa.sin_port = port;
+	sa.sin_addr.s_addr = INADDR_ANY;
+	if(bind(s, (sockaddr*)&sa, sizeof(sockaddr_in)) != 0
+	|| listen(s, SOMAXCONN) != 0){
+		LOG_ERROR("failed to listen on port %d (error = %d)\n",
+			(i32)ntohs(port), net_last_error());
+		net_close(s);
+		return NET_INVALID_SOCKET;
+	}
+	return s;
+}
+
+static
+net_socket_t net_accept(net_socket_t listener){
+	net_socket_t s = accept(listener, NULL, NULL);
+	if(s == NET_INVALID_SOCKET){
+		LOG_ERROR("accept failed (error = %d)\n", net_last_error());
+		return NET_INVALID_SOCKET;
+	}
+
+	if(!net_configure_stream(s)){
+		net_close(s);
+		return NET_INVALID_SOCKET;
+	}
+	return s;
+}
+
+// NOTE: Returns the number of bytes read or one of NET_RECV_*.
+static
+i32 net_recv(net_socket_t s, char *buf, i32 len){
+	int ret = recv(s, buf, len, 0);
+	if(ret > 0)
+		return ret;
+	if(ret == 0)
+		return NET_RECV_CLOSED;
+	return net__would_block() ? NET_RECV_WOULD_BLOCK : NET_RECV_ERROR;
+}
+
+// NOTE: Sends all of `buf`, waiting up to `timeout_ms` for room in the
+// send buffer each time it fills up. It returns false if the connection
+// failed or the peer stopped reading, and `out_closed` tells whether the
+// connection was closed.
+static
+bool net_send_all(net_socket_t s, const char *buf, i32 len,
+		i32 timeout_ms, bool *out_closed){
+	*out_closed = false;
+	while(len > 0){
+		int ret = send(s, buf, len, NET_SEND_FLAGS);
+		if(ret > 0){
+			buf += ret;
+			len -= ret;
+		}else if(ret < 0 && net__would_block()){
+			if(!net__wait_writable(s, timeout_ms)){
+				LOG_ERROR("send timed out with %d bytes left\n", len);
+				return false;
+			}
+		}else{
+			LOG_ERROR("send failed (ret = %d, error = %d)\n",
+				ret, net_last_error());
+			*out_closed = (ret == 0);
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif //NET_HH_
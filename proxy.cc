@@ -1,7 +1,9 @@
 #include "common.hh"
+#include "buffer_util.hh"
+#include "net.hh"
 
+#include <ctype.h>
 #include <stdio.h>
-#include <winsock2.h>
 
 #define CHECK(condition, ...)			\
 	if(!(condition)){					\
@@ -40,6 +42,30 @@ void log_packet(i32 packet_num, i32 debug_num, const char *debug_name, u8 *buf,
 	fclose(fp);
 }
 
+// NOTE: Forwards whatever is available on `from` to `to`, logging each
+// read. Returns false when either side is done.
+static
+bool proxy_route(net_socket_t from, net_socket_t to,
+		i32 *packet_num, i32 *debug_num, const char *debug_name){
+	while(1){
+		u8 buf[4096];
+		i32 ret = net_recv(from, (char*)buf, NARRAY(buf));
+		if(ret == NET_RECV_WOULD_BLOCK)
+			return true;
+		if(ret <= 0){
+			LOG("%s: connection closed on recv (ret = %d)\n", debug_name, ret);
+			return false;
+		}
+		log_packet((*packet_num)++, (*debug_num)++, debug_name, buf, ret);
+
+		bool closed;
+		if(!net_send_all(to, (char*)buf, ret, 5000, &closed)){
+			LOG("%s: connection closed on send\n", debug_name);
+			return false;
+		}
+	}
+}
+
 int proxy_main(int argc, char **argv){
 	// 142.4.211.28:4000
 	u8 server_ipv4_addr[4] = { 142, 4, 211, 28 };
@@ -48,109 +74,61 @@ int proxy_main(int argc, char **argv){
 		| ((u32)server_ipv4_addr[1] << 8)
 		| ((u32)server_ipv4_addr[2] << 16)
 		| ((u32)server_ipv4_addr[3] << 24);
-	u16 server_port = htons(4000);
+	u16 server_port = u16_cpu_to_be(4000);
 	u16 proxy_port = server_port;
 
-	SOCKET proxy = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-	CHECK(proxy != INVALID_SOCKET, "failed to create proxy socket\n");
+	net_socket_t proxy = net_listen_tcp(proxy_port);
+	CHECK(proxy != NET_INVALID_SOCKET, "failed to listen on proxy port\n");
 
-	{
-		sockaddr_in addr;
-		addr.sin_family = AF_INET;
-		addr.sin_port = proxy_port;
-		addr.sin_addr.s_addr = INADDR_ANY;
-		int bind_result = bind(proxy, (sockaddr*)&addr, sizeof(sockaddr_in));
-		CHECK(bind_result == 0, "failed to bind to port %d\n", ntohs(proxy_port));
-	}
+	NetPoller poller;
+	CHECK(net_poller_init(&poller), "failed to create poller\n");
 
-	{
-		int listen_result = listen(proxy, SOMAXCONN);
-		CHECK(listen_result == 0, "failed to start listening\n");
-	}
+	// NOTE: Poller events carry a pointer to one of these to tell
+	// which side has data.
+	static char client_tag, server_tag;
 
 	LOG("serving...\n");
 	while(1){
-		SOCKET client = accept(proxy, NULL, NULL);
-		CHECK(client != INVALID_SOCKET, "failed to accept new connection\n");
+		net_socket_t client = net_accept(proxy);
+		CHECK(client != NET_INVALID_SOCKET, "failed to accept new connection\n");
 		LOG("new connection!\n");
 		LOG("connecting to server...\n");
 
-		SOCKET server = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-		CHECK(server != INVALID_SOCKET, "failed to create server socket\n");
-		{
-			sockaddr_in addr;
-			addr.sin_family = AF_INET;
-			addr.sin_port = server_port;
-			addr.sin_addr.s_addr = server_addr;
-			int connect_result = connect(server, (sockaddr*)&addr, sizeof(sockaddr_in));
-			CHECK(connect_result == 0, "failed to connect to server\n");
-		}
+		net_socket_t server = net_connect_tcp(server_addr, server_port);
+		CHECK(server != NET_INVALID_SOCKET, "failed to connect to server\n");
 		LOG("connected!\n");
 
+		CHECK(net_poller_add(&poller, client, &client_tag)
+			&& net_poller_add(&poller, server, &server_tag),
+			"failed to poll connection sockets\n");
+
 		i32 packet_num = 0;
 		i32 client_to_server_num = 0;
 		i32 server_to_client_num = 0;
-		while(1){
-			u8 buf[4096];
-			int ret;
-			fd_set readfds;
-			FD_ZERO(&readfds);
-			FD_SET(client, &readfds);
-			FD_SET(server, &readfds);
-			ret = select(0, &readfds, NULL, NULL, NULL);
-			CHECK(ret != SOCKET_ERROR, "select failed (ret = %d)\n", ret);
-
-			// route from client -> server
-			if(FD_ISSET(client, &readfds)){
-				ret = recv(client, (char*)buf, NARRAY(buf), 0);
-				if(ret <= 0){
-					LOG("client connection closed on recv (ret = %d)\n", ret);
-					break;
-				}
-				log_packet(packet_num++, client_to_server_num++,
-					"client_to_server", buf, ret);
-
-				ret = send(server, (char*)buf, ret, 0);
-				if(ret <= 0){
-					LOG_ERROR("server connection closed on send (ret = %d)\n", ret);
-					break;
-				}
-			}
-
-			// route from server -> client
-			if(FD_ISSET(server, &readfds)){
-				ret = recv(server, (char*)buf, NARRAY(buf), 0);
-				if(ret <= 0){
-					LOG_ERROR("server connection closed on recv (ret = %d)\n", ret);
-					break;
-				}
-				log_packet(packet_num++, server_to_client_num++,
-					"server_to_client", buf, ret);
-
-				ret = send(client, (char*)buf, ret, 0);
-				if(ret <= 0){
-					LOG("client connection closed on send (ret = %d)\n", ret);
-					break;
+		bool open = true;
+		while(open){
+			NetEvent events[2];
+			i32 num_events = net_poller_wait(&poller, -1, events, NARRAY(events));
+			CHECK(num_events >= 0, "poll failed\n");
+			for(i32 i = 0; open && i < num_events; i += 1){
+				if(events[i].user == &client_tag){
+					// route from client -> server
+					open = proxy_route(client, server, &packet_num,
+						&client_to_server_num, "client_to_server");
+				}else{
+					// route from server -> client
+					open = proxy_route(server, client, &packet_num,
+						&server_to_client_num, "server_to_client");
 				}
 			}
 		}
 
-		closesocket(client);
-		closesocket(server);
+		net_poller_remove(&poller, client);
+		net_poller_remove(&poller, server);
+		net_close(client);
+		net_close(server);
 	}
+	net_poller_destroy(&poller);
+	net_close(proxy);
 	return 0;
 }
-
-struct WSAInit{
-	WSAInit(void){
-		WSADATA dummy;
-		if(WSAStartup(MAKEWORD(2, 2), &dummy) != 0){
-			LOG_ERROR("failed to initialize windows sockets\n");
-			abort();
-		}
-	}
-	~WSAInit(void){
-		WSACleanup();
-	}
-};
-static WSAInit wsa_init;
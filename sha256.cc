@@ -1,5 +1,8 @@
 #include "common.hh"
 #include "buffer_util.hh"
+#include "thread.hh"
+
+#include <immintrin.h>
 
 static const u32 sha256_iv[8] = {
 	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
@@ -33,7 +36,7 @@ u32 rotr32(u32 val, u8 n){
 }
 
 static
-void sha256_compress(u32 *h, u8 *block){
+void sha256_compress_scalar(u32 *h, u8 *block){
 	u32 w[64];
 
 	for(i32 i = 0; i < 16; i += 1)
@@ -76,15 +79,64 @@ void sha256_compress(u32 *h, u8 *block){
 	h[7] += aux[7];
 }
 
+// NOTE: SHA-NI keeps the state as ABEF/CDGH pairs and runs two
+// rounds per sha256rnds2, with the message schedule done by
+// sha256msg1/sha256msg2 four words at a time.
+static TARGET_SHA
+void sha256_compress_shani(u32 *h, u8 *block){
+	const __m128i bswap = _mm_set_epi64x(
+		0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)&h[0]), 0xB1);	// CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)&h[4]), 0x1B);	// EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);							// ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);								// CDGH
+	__m128i abef_save = state0;
+	__m128i cdgh_save = state1;
+
+	__m128i msg[4];
+	for(i32 i = 0; i < 4; i += 1)
+		msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)&block[i * 16]), bswap);
+
+	for(i32 i = 0; i < 16; i += 1){
+		__m128i wk = _mm_add_epi32(msg[i & 3],
+			_mm_loadu_si128((__m128i*)&sha256_k[i * 4]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+
+		// NOTE: Words 4i+16..4i+19 replace words 4i..4i+3 which
+		// were just consumed.
+		if(i < 12){
+			__m128i w0 = msg[(i + 0) & 3];
+			__m128i w1 = msg[(i + 1) & 3];
+			__m128i w2 = msg[(i + 2) & 3];
+			__m128i w3 = msg[(i + 3) & 3];
+			w0 = _mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4));
+			msg[i & 3] = _mm_sha256msg2_epu32(w0, w3);
+		}
+	}
+
+	state0 = _mm_add_epi32(state0, abef_save);
+	state1 = _mm_add_epi32(state1, cdgh_save);
+	tmp = _mm_shuffle_epi32(state0, 0x1B);						// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);					// DCHG
+	_mm_storeu_si128((__m128i*)&h[0], _mm_blend_epi16(tmp, state1, 0xF0));	// DCBA
+	_mm_storeu_si128((__m128i*)&h[4], _mm_alignr_epi8(state1, tmp, 8));		// HGFE
+}
+
+// NOTE: Bound by sha256_dispatch_init.
+static void (*sha256_compress)(u32 *h, u8 *block) = sha256_compress_scalar;
+
 static
-void __sha256(u8 *in, i32 inlen, u8 *out_digest){
+void __sha256(void (*compress)(u32*, u8*), const sha256_midstate *M,
+		u8 *in, i32 inlen, u8 *out_digest){
 	u32 h[8];
-	memcpy(h, sha256_iv, sizeof(sha256_iv));
+	memcpy(h, M->h, sizeof(h));
 
 	u8 *ptr = in;
 	i32 len = inlen;
 	while(len >= 64){
-		sha256_compress(h, ptr);
+		compress(h, ptr);
 		ptr += 64;
 		len -= 64;
 	}
@@ -103,7 +155,7 @@ void __sha256(u8 *in, i32 inlen, u8 *out_digest){
 	// we'll need to compress two extra blocks.
 	//
 
-	u64 inlen_bits = (u64)inlen * 8;
+	u64 inlen_bits = (M->len + (u64)inlen) * 8;
 	if(len <= 55){
 		i32 num_zeros = 55 - len;
 		DEBUG_ASSERT(num_zeros >= 0);
@@ -113,7 +165,7 @@ void __sha256(u8 *in, i32 inlen, u8 *out_digest){
 		encode_u8(&block[len], 0x80);
 		memset(&block[len + 1], 0x00, num_zeros);
 		encode_u64_be(&block[56], inlen_bits);
-		sha256_compress(h, block);
+		compress(h, block);
 	}else{
 		DEBUG_ASSERT(len < 64);
 		i32 num_zeros = 63 - len;
@@ -125,12 +177,12 @@ void __sha256(u8 *in, i32 inlen, u8 *out_digest){
 		memcpy(&block[0], ptr, len);
 		encode_u8(&block[len], 0x80);
 		memset(&block[len + 1], 0x00, num_zeros);
-		sha256_compress(h, block);
+		compress(h, block);
 
 		// 2nd block
 		memset(&block[0], 0, 56);
 		encode_u64_be(&block[56], inlen_bits);
-		sha256_compress(h, block);
+		compress(h, block);
 	}
 
 	encode_u32_be(&out_digest[ 0], h[0]);
@@ -149,20 +201,219 @@ void __sha256(u8 *in, i32 inlen, u8 *out_digest){
 // matter because it simply copies the output of the hash directly
 // into the u256 internal buffer.
 
+// NOTE: The midstate of the empty prefix.
+static const sha256_midstate sha256_iv_midstate = {
+	{
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+		0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+	},
+	0
+};
+
 u256 sha256(u8 *in, i32 inlen){
 	u256 result;
-	__sha256(in, inlen, result.data);
+	__sha256(sha256_compress, &sha256_iv_midstate, in, inlen, result.data);
 	return result;
 }
 
 u256 wsha256(u8 *in, i32 inlen){
 	u8 digest1[32];
-	__sha256(in, inlen, digest1);
+	__sha256(sha256_compress, &sha256_iv_midstate, in, inlen, digest1);
 	u256 result;
-	__sha256(digest1, 32, result.data);
+	__sha256(sha256_compress, &sha256_iv_midstate, digest1, 32, result.data);
 	return result;
 }
 
+void sha256_midstate_init(sha256_midstate *M, u8 *in, i32 inlen){
+	ASSERT((inlen % 64) == 0);
+	memcpy(M->h, sha256_iv, sizeof(sha256_iv));
+	for(i32 i = 0; i < inlen; i += 64)
+		sha256_compress(M->h, in + i);
+	M->len = (u64)inlen;
+}
+
+// ----------------------------------------------------------------
+// multi-buffer double sha256
+// ----------------------------------------------------------------
+
+static INLINE
+void wsha256_many_x1(void (*compress)(u32*, u8*), const sha256_midstate *M,
+		u8 **in, i32 inlen, i32 count, u256 *out){
+	for(i32 i = 0; i < count; i += 1){
+		u8 digest1[32];
+		__sha256(compress, M, in[i], inlen, digest1);
+		__sha256(compress, &sha256_iv_midstate, digest1, 32, out[i].data);
+	}
+}
+
+static
+void wsha256_many_scalar(const sha256_midstate *M,
+		u8 **in, i32 inlen, i32 count, u256 *out){
+	wsha256_many_x1(sha256_compress_scalar, M, in, inlen, count, out);
+}
+
+static
+void wsha256_many_shani(const sha256_midstate *M,
+		u8 **in, i32 inlen, i32 count, u256 *out){
+	wsha256_many_x1(sha256_compress_shani, M, in, inlen, count, out);
+}
+
+// NOTE: The 8-way implementation keeps word i of the state (and of the
+// message schedule) of 8 independent messages in a single register,
+// one message per 32-bit lane, so it runs the plain scalar algorithm
+// on 8 messages at a time.
+#define X8_ROTR(x, n)	_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define X8_ADD(a, b)	_mm256_add_epi32(a, b)
+#define X8_XOR(a, b)	_mm256_xor_si256(a, b)
+#define X8_AND(a, b)	_mm256_and_si256(a, b)
+
+static TARGET_AVX2
+void sha256_compress_x8(__m256i *h, __m256i *w){
+	for(i32 i = 16; i < 64; i += 1){
+		__m256i s0 = X8_XOR(X8_XOR(X8_ROTR(w[i - 15], 7), X8_ROTR(w[i - 15], 18)),
+			_mm256_srli_epi32(w[i - 15], 3));
+		__m256i s1 = X8_XOR(X8_XOR(X8_ROTR(w[i - 2], 17), X8_ROTR(w[i - 2], 19)),
+			_mm256_srli_epi32(w[i - 2], 10));
+		w[i] = X8_ADD(X8_ADD(w[i - 16], s0), X8_ADD(w[i - 7], s1));
+	}
+
+	__m256i a = h[0], b = h[1], c = h[2], d = h[3];
+	__m256i e = h[4], f = h[5], g = h[6], hh = h[7];
+	for(i32 i = 0; i < 64; i += 1){
+		__m256i s1 = X8_XOR(X8_XOR(X8_ROTR(e, 6), X8_ROTR(e, 11)), X8_ROTR(e, 25));
+		__m256i ch = X8_XOR(X8_AND(e, f), _mm256_andnot_si256(e, g));
+		__m256i tmp1 = X8_ADD(X8_ADD(hh, s1), X8_ADD(ch,
+			X8_ADD(_mm256_set1_epi32((int)sha256_k[i]), w[i])));
+
+		__m256i s0 = X8_XOR(X8_XOR(X8_ROTR(a, 2), X8_ROTR(a, 13)), X8_ROTR(a, 22));
+		__m256i maj = X8_XOR(X8_AND(a, b), X8_AND(c, X8_XOR(a, b)));
+		__m256i tmp2 = X8_ADD(s0, maj);
+
+		hh = g;
+		g = f;
+		f = e;
+		e = X8_ADD(d, tmp1);
+		d = c;
+		c = b;
+		b = a;
+		a = X8_ADD(tmp1, tmp2);
+	}
+
+	h[0] = X8_ADD(h[0], a);
+	h[1] = X8_ADD(h[1], b);
+	h[2] = X8_ADD(h[2], c);
+	h[3] = X8_ADD(h[3], d);
+	h[4] = X8_ADD(h[4], e);
+	h[5] = X8_ADD(h[5], f);
+	h[6] = X8_ADD(h[6], g);
+	h[7] = X8_ADD(h[7], hh);
+}
+
+static TARGET_AVX2
+void sha256_load_x8(__m256i *w, u8 **blocks){
+	for(i32 i = 0; i < 16; i += 1){
+		w[i] = _mm256_setr_epi32(
+			(int)decode_u32_be(blocks[0] + i * 4), (int)decode_u32_be(blocks[1] + i * 4),
+			(int)decode_u32_be(blocks[2] + i * 4), (int)decode_u32_be(blocks[3] + i * 4),
+			(int)decode_u32_be(blocks[4] + i * 4), (int)decode_u32_be(blocks[5] + i * 4),
+			(int)decode_u32_be(blocks[6] + i * 4), (int)decode_u32_be(blocks[7] + i * 4));
+	}
+}
+
+static TARGET_AVX2
+void wsha256_many_x8(const sha256_midstate *M,
+		u8 **in, i32 inlen, i32 count, u256 *out){
+	DEBUG_ASSERT(count > 0 && count <= 8);
+
+	// NOTE: Unused lanes hash the first input again and get discarded.
+	u8 *lanes[8];
+	for(i32 lane = 0; lane < 8; lane += 1)
+		lanes[lane] = in[lane < count ? lane : 0];
+
+	__m256i h[8];
+	__m256i w[64];
+	for(i32 i = 0; i < 8; i += 1)
+		h[i] = _mm256_set1_epi32((int)M->h[i]);
+
+	// 1st hash - full blocks
+	i32 num_full_blocks = inlen / 64;
+	for(i32 blk = 0; blk < num_full_blocks; blk += 1){
+		u8 *blocks[8];
+		for(i32 lane = 0; lane < 8; lane += 1)
+			blocks[lane] = lanes[lane] + blk * 64;
+		sha256_load_x8(w, blocks);
+		sha256_compress_x8(h, w);
+	}
+
+	// 1st hash - padding (see __sha256)
+	i32 len = inlen - num_full_blocks * 64;
+	i32 num_tail_blocks = (len <= 55) ? 1 : 2;
+	u8 tail[8][128];
+	for(i32 lane = 0; lane < 8; lane += 1){
+		u8 *t = tail[lane];
+		memcpy(t, lanes[lane] + num_full_blocks * 64, len);
+		encode_u8(&t[len], 0x80);
+		memset(&t[len + 1], 0x00, num_tail_blocks * 64 - 8 - (len + 1));
+		encode_u64_be(&t[num_tail_blocks * 64 - 8], (M->len + (u64)inlen) * 8);
+	}
+	for(i32 blk = 0; blk < num_tail_blocks; blk += 1){
+		u8 *blocks[8];
+		for(i32 lane = 0; lane < 8; lane += 1)
+			blocks[lane] = tail[lane] + blk * 64;
+		sha256_load_x8(w, blocks);
+		sha256_compress_x8(h, w);
+	}
+
+	// 2nd hash - the message is the 32 bytes digest of the first
+	// hash which is exactly the state words in big endian so they
+	// can be used as message words without any shuffling.
+	for(i32 i = 0; i < 8; i += 1){
+		w[i] = h[i];
+		h[i] = _mm256_set1_epi32((int)sha256_iv[i]);
+	}
+	w[8] = _mm256_set1_epi32((int)0x80000000);
+	for(i32 i = 9; i < 15; i += 1)
+		w[i] = _mm256_setzero_si256();
+	w[15] = _mm256_set1_epi32(256);
+	sha256_compress_x8(h, w);
+
+	u32 digest[8][8];
+	for(i32 i = 0; i < 8; i += 1)
+		_mm256_storeu_si256((__m256i*)digest[i], h[i]);
+	for(i32 lane = 0; lane < count; lane += 1){
+		for(i32 i = 0; i < 8; i += 1)
+			encode_u32_be(&out[lane].data[i * 4], digest[i][lane]);
+	}
+}
+
+#undef X8_ROTR
+#undef X8_ADD
+#undef X8_XOR
+#undef X8_AND
+
+// NOTE: Bound by sha256_dispatch_init.
+typedef void (*wsha256_many_fn)(const sha256_midstate *M,
+		u8 **in, i32 inlen, i32 count, u256 *out);
+static i32 wsha256_many_width = 1;
+static wsha256_many_fn wsha256_many_kernel = wsha256_many_scalar;
+
+void wsha256_many_midstate(const sha256_midstate *M,
+		u8 **in, i32 inlen, i32 count, u256 *out){
+	DEBUG_ASSERT(inlen >= 0 && count >= 0);
+	i32 width = wsha256_many_width;
+	while(count > 0){
+		i32 n = (count < width) ? count : width;
+		wsha256_many_kernel(M, in, inlen, n, out);
+		in += n;
+		out += n;
+		count -= n;
+	}
+}
+
+void wsha256_many(u8 **in, i32 inlen, i32 count, u256 *out){
+	wsha256_many_midstate(&sha256_iv_midstate, in, inlen, count, out);
+}
+
 #if 0
 #include <stdio.h>
 int main(int argc, char **argv){
@@ -186,9 +437,49 @@ int main(int argc, char **argv){
 	printf("\n");
 	return 0;
 }
-#else
-int test_sha256(int argc, char **argv){
-	struct{
+#endif
+
+// ----------------------------------------------------------------
+// dispatch
+// ----------------------------------------------------------------
+
+// NOTE: Implementations are listed from best to worst with the scalar
+// implementation last as the fallback.
+struct sha256_compress_impl{
+	const char *name;
+	bool (*supported)(const CPU_Features *cpu);
+	void (*compress)(u32 *h, u8 *block);
+};
+
+static bool sha256__any(const CPU_Features *cpu){ return true; }
+
+static bool sha256__sha(const CPU_Features *cpu){ return cpu->sha_ni && cpu->sse41; }
+static bool sha256__avx2(const CPU_Features *cpu){ return cpu->avx2; }
+
+static const sha256_compress_impl sha256_compress_impls[] = {
+	{ "sha", sha256__sha, sha256_compress_shani },
+	{ "scalar", sha256__any, sha256_compress_scalar },
+};
+
+// NOTE: SHA-NI goes first because a single SHA-NI stream is about as
+// fast as the 8-way AVX2 implementation and doesn't need batches to
+// get there. Use `--cpu-disable=sha` to compare against AVX2.
+struct wsha256_many_impl{
+	const char *name;
+	bool (*supported)(const CPU_Features *cpu);
+	i32 width;
+	wsha256_many_fn hash;
+};
+
+static const wsha256_many_impl wsha256_many_impls[] = {
+	{ "sha", sha256__sha, 1, wsha256_many_shani },
+	{ "avx2", sha256__avx2, 8, wsha256_many_x8 },
+	{ "scalar", sha256__any, 1, wsha256_many_scalar },
+};
+
+static
+bool sha256_kat_compress(const sha256_compress_impl *impl, bool verbose){
+	static const struct{
 		const char *input;
 		const char *expected;
 	} tests[] = {
@@ -223,13 +514,192 @@ int test_sha256(int argc, char **argv){
 		},
 	};
 
+	void (*prev_compress)(u32*, u8*) = sha256_compress;
+	sha256_compress = impl->compress;
+
+	bool result = true;
 	for(i32 i = 0; i < NARRAY(tests); i += 1){
 		const char *input = tests[i].input;
 		u256 expected = hex_le_to_u256(tests[i].expected);
-		u256 result = sha256((u8*)input, (i32)strlen(input));
-		LOG("test #%d: %s\n", i,
-			(result == expected) ? "passed" : "failed");
+		u256 digest = sha256((u8*)input, (i32)strlen(input));
+		bool passed = (digest == expected);
+		if(verbose){
+			LOG("sha256_compress (%s) test #%d: %s\n",
+				impl->name, i, passed ? "passed" : "failed");
+		}
+		result = result && passed;
+	}
+
+	sha256_compress = prev_compress;
+	return result;
+}
+
+// NOTE: There are no published known answers for batches so the
+// answers come from the scalar implementation, which is checked by
+// sha256_kat_compress against known answers first. Every lane has
+// a different input to catch lanes getting mixed up and the lengths
+// cover every padding case plus the 241 bytes block header. Inputs
+// of 64 bytes or more are also hashed from the midstate of their
+// first block, which is then shared by all lanes.
+static
+bool sha256_kat_many(const wsha256_many_impl *impl, bool verbose){
+	static const i32 lengths[] = { 0, 3, 55, 56, 63, 64, 119, 120, 241 };
+
+	u8 data[8][256];
+	u32 seed = 0x12345678;
+	for(i32 lane = 0; lane < 8; lane += 1){
+		for(i32 i = 0; i < 256; i += 1){
+			seed = seed * 1664525 + 1013904223;
+			data[lane][i] = (u8)(seed >> 24);
+		}
+	}
+
+	u8 shared[8][256];
+	for(i32 lane = 0; lane < 8; lane += 1){
+		memcpy(shared[lane], data[0], 64);
+		memcpy(shared[lane] + 64, data[lane] + 64, 256 - 64);
+	}
+
+	sha256_midstate M;
+	memcpy(M.h, sha256_iv, sizeof(sha256_iv));
+	sha256_compress_scalar(M.h, shared[0]);
+	M.len = 64;
+
+	u8 *in[8], *shared_in[8], *shared_tail[8];
+	for(i32 lane = 0; lane < 8; lane += 1){
+		in[lane] = data[lane];
+		shared_in[lane] = shared[lane];
+		shared_tail[lane] = shared[lane] + 64;
+	}
+
+	bool result = true;
+	for(i32 i = 0; i < NARRAY(lengths); i += 1){
+		i32 len = lengths[i];
+		u256 expected[8];
+		u256 expected_shared[8];
+		wsha256_many_scalar(&sha256_iv_midstate, in, len, 8, expected);
+		wsha256_many_scalar(&sha256_iv_midstate, shared_in, len, 8, expected_shared);
+
+		bool passed = true;
+		for(i32 count = 1; count <= impl->width; count += 1){
+			u256 digest[8];
+			impl->hash(&sha256_iv_midstate, in, len, count, digest);
+			for(i32 lane = 0; lane < count; lane += 1){
+				if(!(digest[lane] == expected[lane]))
+					passed = false;
+			}
+
+			if(len >= 64){
+				impl->hash(&M, shared_tail, len - 64, count, digest);
+				for(i32 lane = 0; lane < count; lane += 1){
+					if(!(digest[lane] == expected_shared[lane]))
+						passed = false;
+				}
+			}
+		}
+		if(verbose){
+			LOG("wsha256_many (%s) test #%d (%d bytes): %s\n",
+				impl->name, i, len, passed ? "passed" : "failed");
+		}
+		result = result && passed;
+	}
+	return result;
+}
+
+void sha256_dispatch_init(void){
+	const CPU_Features *cpu = cpu_features();
+	for(i32 i = 0; i < NARRAY(sha256_compress_impls); i += 1){
+		const sha256_compress_impl *impl = &sha256_compress_impls[i];
+		if(!impl->supported(cpu))
+			continue;
+		if(!sha256_kat_compress(impl, false)){
+			LOG_ERROR("sha256_compress (%s) failed known answer test\n", impl->name);
+			continue;
+		}
+		LOG("sha256_compress: %s\n", impl->name);
+		sha256_compress = impl->compress;
+		break;
+	}
+
+	for(i32 i = 0; i < NARRAY(wsha256_many_impls); i += 1){
+		const wsha256_many_impl *impl = &wsha256_many_impls[i];
+		if(!impl->supported(cpu))
+			continue;
+		if(!sha256_kat_many(impl, false)){
+			LOG_ERROR("wsha256_many (%s) failed known answer test\n", impl->name);
+			continue;
+		}
+		LOG("wsha256_many: %s (%d lanes)\n", impl->name, impl->width);
+		wsha256_many_width = impl->width;
+		wsha256_many_kernel = impl->hash;
+		break;
+	}
+}
+
+bool sha256_selftest(void){
+	const CPU_Features *cpu = cpu_features();
+	bool result = true;
+	for(i32 i = 0; i < NARRAY(sha256_compress_impls); i += 1){
+		const sha256_compress_impl *impl = &sha256_compress_impls[i];
+		if(!impl->supported(cpu)){
+			LOG("sha256_compress (%s): not supported\n", impl->name);
+			continue;
+		}
+		result = sha256_kat_compress(impl, true) && result;
+	}
+
+	for(i32 i = 0; i < NARRAY(wsha256_many_impls); i += 1){
+		const wsha256_many_impl *impl = &wsha256_many_impls[i];
+		if(!impl->supported(cpu)){
+			LOG("wsha256_many (%s): not supported\n", impl->name);
+			continue;
+		}
+		result = sha256_kat_many(impl, true) && result;
+	}
+	return result;
+}
+
+void wsha256_bench(i32 num_headers){
+	const CPU_Features *cpu = cpu_features();
+
+	// NOTE: Batches of 8 headers like the miner checking the solutions
+	// of a single solve. Only the last 32 bytes (where the solution
+	// would be) change between headers.
+	u8 headers[8][241];
+	u8 *in[8];
+	for(i32 lane = 0; lane < 8; lane += 1){
+		for(i32 i = 0; i < 241; i += 1)
+			headers[lane][i] = (u8)(i * 7 + lane);
+		in[lane] = headers[lane];
+	}
+
+	for(i32 i = 0; i < NARRAY(wsha256_many_impls); i += 1){
+		const wsha256_many_impl *impl = &wsha256_many_impls[i];
+		if(!impl->supported(cpu)){
+			LOG("wsha256_many (%s): not supported\n", impl->name);
+			continue;
+		}
+
+		u32 check = 0;
+		i64 start = time_now_us();
+		for(i32 done = 0; done < num_headers; done += 8){
+			for(i32 lane = 0; lane < 8; lane += 1)
+				encode_u32_le(&headers[lane][209], (u32)(done + lane));
+
+			u256 digest[8];
+			i32 count = (num_headers - done < 8) ? (num_headers - done) : 8;
+			for(i32 j = 0; j < count; j += impl->width){
+				i32 n = (count - j < impl->width) ? (count - j) : impl->width;
+				impl->hash(&sha256_iv_midstate, in + j, 241, n, digest + j);
+			}
+			check ^= decode_u32_le(digest[0].data);
+		}
+		i64 elapsed = time_now_us() - start;
+		if(elapsed <= 0)
+			elapsed = 1;
+
+		LOG("wsha256_many (%s): %d headers, %.3f ms, %.3f MH/s (check = %08X)\n",
+			impl->name, num_headers, (f64)elapsed / 1000.0,
+			(f64)num_headers / (f64)elapsed, check);
 	}
-	return 0;
 }
-#endif
@@ -1,12 +1,29 @@
-// NOTE: This will work on windows only.
+// NOTE: This will work on windows and linux only.
 
 #ifndef THREAD_HH_
 #define THREAD_HH_
 
 #include "common.hh"
-#include <intrin.h>
-#include <windows.h>
-#include <process.h>
+
+#if PLATFORM_WINDOWS
+#	include <intrin.h>
+#	include <windows.h>
+#	include <process.h>
+#elif PLATFORM_LINUX
+#	include <errno.h>
+#	include <immintrin.h>
+#	include <limits.h>
+#	include <linux/futex.h>
+#	include <pthread.h>
+#	include <sched.h>
+#	include <sys/syscall.h>
+#	include <time.h>
+#	include <unistd.h>
+#else
+#	error "add platform thread settings"
+#endif
+
+#if PLATFORM_WINDOWS
 
 // ----------------------------------------------------------------
 // utility
@@ -18,6 +35,26 @@ i32 num_cpu_cores(void){
 	return info.dwNumberOfProcessors;
 }
 
+static INLINE
+i64 time_now_us(void){
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	i64 seconds = counter.QuadPart / frequency.QuadPart;
+	i64 remainder = counter.QuadPart % frequency.QuadPart;
+	return seconds * 1000000 + (remainder * 1000000) / frequency.QuadPart;
+}
+
+static INLINE
+void cpu_relax(void){
+	_mm_pause();
+}
+
+static INLINE
+void thread_sleep_ms(i32 ms){
+	Sleep(ms);
+}
+
 // ----------------------------------------------------------------
 // atomics
 // ----------------------------------------------------------------
@@ -31,9 +68,36 @@ i32 atomic_exchange(i32 *ptr, i32 value){
 	return _InterlockedExchange((volatile long*)ptr, value);
 }
 
+// NOTE: Returns the value that was in `ptr` before, which is equal to
+// `expected` if the exchange happened.
+static INLINE
+i32 atomic_compare_exchange(i32 *ptr, i32 expected, i32 desired){
+	return _InterlockedCompareExchange((volatile long*)ptr, desired, expected);
+}
+
+static INLINE
+i32 atomic_load(i32 *ptr){
+	return _InterlockedOr((volatile long*)ptr, 0);
+}
+
+// NOTE: x86 doesn't reorder loads with older loads or stores with older
+// stores, so plain accesses only have to be kept in place by the compiler.
+static INLINE
+void atomic_fence_acquire(void){
+	_ReadWriteBarrier();
+}
+
+static INLINE
+void atomic_fence_release(void){
+	_ReadWriteBarrier();
+}
+
 // ----------------------------------------------------------------
 // barrier
 // ----------------------------------------------------------------
+
+// NOTE: Synchronization barriers already spin for a while before
+// blocking (-1 is the default spin count).
 typedef SYNCHRONIZATION_BARRIER barrier_t;
 
 static INLINE
@@ -58,6 +122,7 @@ void barrier_wait(barrier_t *barrier){
 // ----------------------------------------------------------------
 typedef HANDLE thread_t;
 
+static
 void thread_spawn(thread_t *thr, void (*func)(void*), void *arg){
 	*thr = (HANDLE)_beginthreadex(NULL, 0,
 		(_beginthreadex_proc_type)func, arg, 0, NULL);
@@ -65,9 +130,296 @@ void thread_spawn(thread_t *thr, void (*func)(void*), void *arg){
 		FATAL_ERROR("failed to spawn thread\n");
 }
 
+static
 void thread_join(thread_t *thr){
 	if(WaitForSingleObject(*thr, INFINITE) != WAIT_OBJECT_0)
 		FATAL_ERROR("failed to join thread\n");
 }
 
+// NOTE: Restricts the calling thread to `cpus`. Only the first 64
+// cpus (processor group 0) can be used here.
+static
+bool thread_set_affinity(const i32 *cpus, i32 num_cpus){
+	DWORD_PTR mask = 0;
+	for(i32 i = 0; i < num_cpus; i += 1){
+		if(cpus[i] >= 0 && cpus[i] < 64)
+			mask |= (DWORD_PTR)1 << cpus[i];
+	}
+	return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+
+#elif PLATFORM_LINUX
+
+// ----------------------------------------------------------------
+// utility
+// ----------------------------------------------------------------
+
+// NOTE: Reads the cpu limit of the cgroup we're in, rounded up to
+// whole cpus, or returns zero if there is none. Containers usually
+// get a quota instead of a cpu set, in which case the cpus we can
+// see are not the cpus we can use.
+static
+i32 thread__cgroup_cpu_limit(void){
+	i64 quota = -1;
+	i64 period = 0;
+
+	// cgroup v2: "<quota> <period>" or "max <period>"
+	char path[512] = "/sys/fs/cgroup";
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if(f){
+		char line[256];
+		while(fgets(line, sizeof(line), f)){
+			if(strncmp(line, "0::", 3) == 0){
+				line[strcspn(line, "\n")] = 0;
+				if(strcmp(line + 3, "/") != 0)
+					snprintf(path, sizeof(path), "/sys/fs/cgroup%s", line + 3);
+				break;
+			}
+		}
+		fclose(f);
+	}
+	strncat(path, "/cpu.max", sizeof(path) - strlen(path) - 1);
+	f = fopen(path, "r");
+	if(!f)
+		f = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if(f){
+		char quota_str[32];
+		if(fscanf(f, "%31s %lld", quota_str, (long long*)&period) == 2
+		&& strcmp(quota_str, "max") != 0)
+			quota = atoll(quota_str);
+		fclose(f);
+	}else{
+		// cgroup v1: quota is -1 when there is none
+		f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+		if(f){
+			if(fscanf(f, "%lld", (long long*)&quota) != 1)
+				quota = -1;
+			fclose(f);
+		}
+		f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if(f){
+			if(fscanf(f, "%lld", (long long*)&period) != 1)
+				period = 0;
+			fclose(f);
+		}
+	}
+
+	if(quota <= 0 || period <= 0)
+		return 0;
+	return (i32)((quota + period - 1) / period);
+}
+
+// NOTE: This is the number of cpus we're allowed to run on (the
+// affinity mask we were started with) capped by the cgroup quota,
+// which may be a lot less than the number of cpus in the host.
+static INLINE
+i32 num_cpu_cores(void){
+	static i32 result = 0;
+	if(result > 0)
+		return result;
+
+	cpu_set_t set;
+	i32 num_cpus = 0;
+	if(sched_getaffinity(0, sizeof(set), &set) == 0)
+		num_cpus = CPU_COUNT(&set);
+	if(num_cpus <= 0)
+		num_cpus = (i32)sysconf(_SC_NPROCESSORS_ONLN);
+
+	i32 limit = thread__cgroup_cpu_limit();
+	if(limit > 0 && limit < num_cpus)
+		num_cpus = limit;
+	if(num_cpus <= 0)
+		num_cpus = 1;
+
+	result = num_cpus;
+	return result;
+}
+
+static INLINE
+i64 time_now_us(void){
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (i64)ts.tv_sec * 1000000 + (i64)ts.tv_nsec / 1000;
+}
+
+static INLINE
+void cpu_relax(void){
+	_mm_pause();
+}
+
+static INLINE
+void thread_sleep_ms(i32 ms){
+	timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR){}
+}
+
+// ----------------------------------------------------------------
+// atomics
+// ----------------------------------------------------------------
+
+// NOTE: These are the same full barrier operations as the windows
+// interlocked functions, on plain i32s.
+static INLINE
+i32 atomic_add(i32 *ptr, i32 value){
+	return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+static INLINE
+i32 atomic_exchange(i32 *ptr, i32 value){
+	return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+// NOTE: Returns the value that was in `ptr` before, which is equal to
+// `expected` if the exchange happened.
+static INLINE
+i32 atomic_compare_exchange(i32 *ptr, i32 expected, i32 desired){
+	__atomic_compare_exchange_n(ptr, &expected, desired,
+		false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return expected;
+}
+
+static INLINE
+i32 atomic_load(i32 *ptr){
+	return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+// NOTE: Keep plain accesses before an acquire fence from moving after it
+// and plain accesses after a release fence from moving before it, for
+// seqlock style reads and writes.
+static INLINE
+void atomic_fence_acquire(void){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+static INLINE
+void atomic_fence_release(void){
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// ----------------------------------------------------------------
+// barrier
+// ----------------------------------------------------------------
+
+// NOTE: The solver goes through a barrier after every phase and most
+// of them are released within microseconds of each other, so waiting
+// threads spin on the generation for up to BARRIER_SPIN_US before
+// going to sleep on a futex. The last thread to arrive only makes the
+// futex syscall if someone actually went to sleep.
+#define BARRIER_SPIN_US 100
+
+struct barrier_t{
+	i32 num_threads;
+	i32 count;
+	i32 generation;
+	i32 num_sleepers;
+};
+
+static INLINE
+void barrier_init(barrier_t *barrier, i32 num_threads){
+	if(num_threads <= 0)
+		FATAL_ERROR("failed to initialize barrier\n");
+	barrier->num_threads = num_threads;
+	barrier->count = 0;
+	barrier->generation = 0;
+	barrier->num_sleepers = 0;
+}
+
+static INLINE
+void barrier_delete(barrier_t *barrier){
+	(void)barrier;
+}
+
+static INLINE
+void barrier__futex_wait(i32 *addr, i32 value){
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static INLINE
+void barrier__futex_wake_all(i32 *addr){
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static
+void barrier_wait(barrier_t *barrier){
+	i32 generation = atomic_load(&barrier->generation);
+	if(atomic_add(&barrier->count, 1) == (barrier->num_threads - 1)){
+		// NOTE: The count must be reset before the generation moves
+		// because threads are free to enter the next one right after.
+		atomic_exchange(&barrier->count, 0);
+		atomic_add(&barrier->generation, 1);
+		if(atomic_load(&barrier->num_sleepers) > 0)
+			barrier__futex_wake_all(&barrier->generation);
+		return;
+	}
+
+	i64 deadline = time_now_us() + BARRIER_SPIN_US;
+	while(1){
+		for(i32 i = 0; i < 64; i += 1){
+			if(atomic_load(&barrier->generation) != generation)
+				return;
+			cpu_relax();
+		}
+		if(time_now_us() >= deadline)
+			break;
+	}
+
+	// NOTE: Sleepers are counted before checking the generation so the
+	// last thread either sees them or they see the new generation (and
+	// the futex wait returns right away).
+	atomic_add(&barrier->num_sleepers, 1);
+	while(atomic_load(&barrier->generation) == generation)
+		barrier__futex_wait(&barrier->generation, generation);
+	atomic_add(&barrier->num_sleepers, -1);
+}
+
+// ----------------------------------------------------------------
+// thread
+// ----------------------------------------------------------------
+typedef pthread_t thread_t;
+
+struct thread__start{
+	void (*func)(void*);
+	void *arg;
+};
+
+static
+void *thread__entry(void *arg){
+	thread__start start = *(thread__start*)arg;
+	free(arg);
+	start.func(start.arg);
+	return NULL;
+}
+
+static
+void thread_spawn(thread_t *thr, void (*func)(void*), void *arg){
+	thread__start *start = (thread__start*)malloc(sizeof(thread__start));
+	start->func = func;
+	start->arg = arg;
+	if(pthread_create(thr, NULL, thread__entry, start) != 0)
+		FATAL_ERROR("failed to spawn thread\n");
+}
+
+static
+void thread_join(thread_t *thr){
+	if(pthread_join(*thr, NULL) != 0)
+		FATAL_ERROR("failed to join thread\n");
+}
+
+// NOTE: Restricts the calling thread to `cpus`.
+static
+bool thread_set_affinity(const i32 *cpus, i32 num_cpus){
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(i32 i = 0; i < num_cpus; i += 1){
+		if(cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+			CPU_SET(cpus[i], &set);
+	}
+	return CPU_COUNT(&set) > 0
+		&& pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#endif
+
 #endif //THREAD_HH_